@@ -5,83 +5,496 @@
  *
  * This module implements a logging interface for use by other modules. This
  * module must be initialized with a filepath before it can function properly.
+ *
+ * A message is formatted by the thread logging it into a ring buffer shared
+ * by the process and written to the logfile later, in batches, by a flusher
+ * thread, so logging never waits on the disk. Space in the ring is reserved
+ * with a compare-and-swap and no lock is taken to log. When the ring is full,
+ * information and warning messages are dropped and counted, and the count is
+ * logged once the flusher catches up. Errors wait for space instead.
+ *
+ * In the binary format, a message is stored as its format string ID, the
+ * monotonic time and its raw arguments, and nothing is formatted until the
+ * log is read with ftps-logdump. Each format string is written to the log the
+ * first time a process uses it.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include "log.h"
+#include "logbin.h"
+#include "misc.h"
+
+#define LOG_RING_SIZE (1U << 20)  /* Must be a power of two */
+#define LOG_LINE_MAX (4352U)      /* Longer messages are truncated */
+#define LOG_BATCH_SIZE (65536U)
+#define LOG_FLUSH_INTERVAL_NS (100000000L)
+/* Values of log_site.state. */
+#define LOG_SITE_NEW (0U)
+#define LOG_SITE_BUSY (1U)       /* Being filled in by another thread */
+#define LOG_SITE_READY (2U)
+#define LOG_SITE_UNSUPPORTED (3U)  /* Logged as LOGBIN_TEXT */
+/* Times an error waits for the flusher to free space before it is dropped. */
+#define LOG_ERROR_RETRIES (1000U)
+
+/* A message in the ring, padded to a multiple of 8 bytes. */
+struct record {
+    _Atomic uint32_t size;  /* Bytes taken in the ring; 0 until the text is complete */
+    uint32_t len;           /* Length of text; 0 for padding up to the end of the ring */
+    char text[];
+};
+
+enum log_level log_threshold = LOG_LEVEL_INFO;
+static _Atomic enum log_format log_format = LOG_FORMAT_TEXT;
+
+static int logfd = -1;
+static _Alignas(8) char ring[LOG_RING_SIZE];
+static _Atomic uint64_t head;  /* Total bytes reserved by loggers */
+static _Atomic uint64_t tail;  /* Total bytes consumed by the flusher */
+static atomic_ulong dropped;           /* Messages dropped since startup */
+static atomic_ulong dropped_unlogged;  /* Drops not yet reported in the log */
+
+/* Held while the ring is drained. */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static char batch[LOG_BATCH_SIZE];
+static pthread_t flusher;
+static bool flusher_running;
+static atomic_bool stopping;
+static sem_t wakeup;
+static atomic_bool wake_pending;
+
+/* Write all of buf to the logfile. */
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(logfd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;  /* Nowhere left to report it */
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * Format the prefix of a message logged now into buf. The time is only
+ * formatted again once a second has passed.
+ */
+static size_t format_prefix(char *buf, enum log_level level) {
+    static __thread time_t stamp_time = -1;
+    static __thread char stamp[32];
+    static __thread size_t stamp_len;
+    const time_t t = time(NULL);
+    if (t != stamp_time) {
+        stamp_time = t;
+        if (t == (time_t) -1 || !ctime_r(&t, stamp)) {
+            strcpy(stamp, "Unknown time\n");
+        }
+        /* Replace trailing newline */
+        stamp_len = strlen(stamp);
+        stamp[stamp_len-1] = ' ';
+    }
+    memcpy(buf, stamp, stamp_len);
+    size_t len = strlen(logbin_level_tags[level]);
+    memcpy(&buf[stamp_len], logbin_level_tags[level], len);
+    return stamp_len + len;
+}
+
+/* Wake the flusher if it is not already being woken. */
+static void wake_flusher(void) {
+    if (!atomic_exchange(&wake_pending, true)) {
+        sem_post(&wakeup);
+    }
+}
+
+/* Zero the ring between positions from and to so the space can be reused. */
+static void clear_ring(uint64_t from, uint64_t to) {
+    while (from < to) {
+        size_t off = from & (LOG_RING_SIZE - 1);
+        size_t n = to - from < LOG_RING_SIZE - off ? to - from : LOG_RING_SIZE - off;
+        memset(&ring[off], 0, n);
+        from += n;
+    }
+}
 
-static FILE *logfile;
+/*
+ * Write every complete message in the ring to the logfile, stopping at the
+ * first one still being written. Must be called with drain_lock held.
+ */
+static void drain(void) {
+    uint64_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+    size_t n = 0;
+    for (;;) {
+        struct record *r = (struct record *)&ring[t & (LOG_RING_SIZE - 1)];
+        uint32_t size = atomic_load_explicit(&r->size, memory_order_acquire);
+        if (size == 0 || n + r->len > sizeof batch) {
+            /* Write the batch and hand its space back to loggers */
+            write_all(batch, n);
+            n = 0;
+            uint64_t old = atomic_load_explicit(&tail, memory_order_relaxed);
+            clear_ring(old, t);
+            atomic_store_explicit(&tail, t, memory_order_release);
+            if (size == 0) {
+                break;
+            }
+        }
+        memcpy(&batch[n], r->text, r->len);
+        n += r->len;
+        t += size;
+    }
+
+    unsigned long count = atomic_exchange(&dropped_unlogged, 0);
+    if (count > 0) {
+        char line[128];
+        size_t len = format_prefix(line, LOG_LEVEL_WARN);
+        len += snprintf(&line[len], sizeof line - len,
+                        "Log: dropped %lu messages; logging is too fast for the logfile\n",
+                        count);
+        write_all(line, len);
+    }
+}
+
+/* Write messages from the ring until told to stop. */
+static void *run_flusher(__attribute__((unused)) void *arg) {
+    while (!atomic_load(&stopping)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&wakeup, &deadline);
+        atomic_store(&wake_pending, false);
+        pthread_mutex_lock(&drain_lock);
+        drain();
+        pthread_mutex_unlock(&drain_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Start the flusher thread. Messages are written as they are logged if it
+ * cannot be started.
+ */
+static void start_flusher(void) {
+    atomic_store(&stopping, false);
+    atomic_store(&wake_pending, false);
+    /* Leave signals to the threads that expect them */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    flusher_running = pthread_create(&flusher, NULL, run_flusher, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Stop the flusher thread. */
+static void stop_flusher(void) {
+    if (flusher_running) {
+        atomic_store(&stopping, true);
+        sem_post(&wakeup);
+        pthread_join(flusher, NULL);
+        flusher_running = false;
+    }
+}
+
+/* Keep the ring consistent across fork(2). */
+static void before_fork(void) {
+    pthread_mutex_lock(&drain_lock);
+}
+
+/* Resume after fork(2) in the parent. */
+static void after_fork_parent(void) {
+    pthread_mutex_unlock(&drain_lock);
+}
+
+/*
+ * Start over after fork(2) in the child. Messages still in the ring are the
+ * parent's to write, and the flusher thread did not survive the fork.
+ */
+static void after_fork_child(void) {
+    uint64_t t = atomic_load(&tail);
+    uint64_t h = atomic_load(&head);
+    clear_ring(t, h);
+    atomic_store(&tail, h);
+    atomic_store(&dropped_unlogged, 0);
+    sem_init(&wakeup, 0, 0);
+    pthread_mutex_unlock(&drain_lock);
+    if (flusher_running) {
+        start_flusher();
+    }
+}
 
 /* Clean up any resources used. */
 static void logdeinit(void) {
-    fclose(logfile);
+    stop_flusher();
+    logflush();
+    close(logfd);
 }
 
 /* Initialize the logging subsystem. */
 void loginit(const char *const path) {
-    logfile = fopen(path, "a");
-    if (!logfile) {
-        perror("fopen");
+    logfd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (logfd == -1) {
+        perror("open");
         exit(EXIT_FAILURE);
     }
+    sem_init(&wakeup, 0, 0);
+    start_flusher();
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
     if (atexit(logdeinit)) {
         logwarn("Log file will not be closed on exit");
     }
 }
 
-/* Execute immediately before each log message. */
-static void prefix(void) {
-    const time_t t = time(NULL);
-    if (t == (time_t) -1) {
-        fprintf(logfile, "Unknown time ");
-    } else {
-        char *out = ctime(&t);
-        /* Remove trailing newline */
-        out[strlen(out)-1] = '\0';
-        fprintf(logfile, "%s ", out);
+/* Discard messages less severe than level. */
+void logsetlevel(enum log_level level) {
+    log_threshold = level;
+}
+
+/* Switch formats. */
+void logsetformat(enum log_format format) {
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    if (format == LOG_FORMAT_BINARY && atomic_load(&log_format) != format) {
+        /*
+         * Written directly so it precedes every record of this run, even those
+         * of children flushed before the parent's ring
+         */
+        struct {
+            struct logbin_header h;
+            int64_t sec;
+            int64_t nsec;
+        } anchor = {.h={.magic=LOGBIN_MAGIC, .kind=LOGBIN_KIND(LOGBIN_ANCHOR, 0),
+                        .len=2 * sizeof(int64_t)}};
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        anchor.h.time = monotonic_ns();
+        anchor.sec = now.tv_sec;
+        anchor.nsec = now.tv_nsec;
+        write_all((const char *)&anchor, sizeof anchor);
     }
+    atomic_store(&log_format, format);
+    pthread_mutex_unlock(&drain_lock);
 }
 
-/* Execute immediately after each log message. */
-static void suffix(void) {
-    fprintf(logfile, "\n");
-    fflush(logfile);
+/* Write every message logged so far. */
+void logflush(void) {
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
 }
 
-/* Log an information message. */
-void loginfo(const char *fmt, ...) {
-    prefix();
-    fputs("[INFO] ", logfile);
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(logfile, fmt, args);
-    va_end(args);
-    suffix();
+/* Return the number of dropped messages. */
+unsigned long logdropped(void) {
+    return atomic_load(&dropped);
 }
 
-/* Log a warning message. */
-void logwarn(const char *fmt, ...) {
-    prefix();
-    fputs("[WARN] ", logfile);
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(logfile, fmt, args);
-    va_end(args);
-    suffix();
+/*
+ * Copy a formatted line of len bytes into the ring. Returns false if it was
+ * dropped for lack of space.
+ */
+static bool enqueue(enum log_level level, const char *line, size_t len) {
+    const uint32_t size = (sizeof(struct record) + len + 7) & ~7U;
+    uint64_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    uint64_t pad;
+    for (unsigned tries = 0; ; ) {
+        /* A message never wraps; skip the end of the ring if it does not fit */
+        size_t off = h & (LOG_RING_SIZE - 1);
+        pad = off + size > LOG_RING_SIZE ? LOG_RING_SIZE - off : 0;
+        if (h + pad + size - atomic_load_explicit(&tail, memory_order_acquire) > LOG_RING_SIZE) {
+            wake_flusher();
+            if (level < LOG_LEVEL_ERROR || ++tries > LOG_ERROR_RETRIES) {
+                return false;
+            }
+            sched_yield();
+            h = atomic_load_explicit(&head, memory_order_relaxed);
+        } else if (atomic_compare_exchange_weak_explicit(&head, &h, h + pad + size,
+                                                         memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    if (pad > 0) {
+        struct record *r = (struct record *)&ring[h & (LOG_RING_SIZE - 1)];
+        r->len = 0;
+        atomic_store_explicit(&r->size, pad, memory_order_release);
+        h += pad;
+    }
+    struct record *r = (struct record *)&ring[h & (LOG_RING_SIZE - 1)];
+    r->len = len;
+    memcpy(r->text, line, len);
+    atomic_store_explicit(&r->size, size, memory_order_release);
+    /* Errors are written promptly; everything else waits unless the ring fills */
+    if (level == LOG_LEVEL_ERROR ||
+        h + size - atomic_load_explicit(&tail, memory_order_relaxed) > LOG_RING_SIZE / 2)
+    {
+        wake_flusher();
+    }
+    return true;
+}
+
+/* Queue a message of len bytes, or write it directly if there is no flusher. */
+static bool submit(enum log_level level, const char *buf, size_t len) {
+    if (!flusher_running) {
+        write_all(buf, len);
+    } else if (!enqueue(level, buf, len)) {
+        atomic_fetch_add(&dropped, 1);
+        atomic_fetch_add(&dropped_unlogged, 1);
+        return false;
+    }
+    return true;
 }
 
-/* Log an error message. */
-void logerr(const char *fmt, ...) {
-    prefix();
-    fputs("[ERROR] ", logfile);
+/* Format a message as a line of text into buf. Returns its length. */
+static size_t format_text(char *buf, enum log_level level, const char *fmt, va_list args) {
+    size_t len = format_prefix(buf, level);
+    int n = vsnprintf(&buf[len], LOG_LINE_MAX - len - 1, fmt, args);
+    if (n > 0) {
+        len += (size_t)n < LOG_LINE_MAX - len - 1 ? (size_t)n : LOG_LINE_MAX - len - 2;
+    }
+    buf[len++] = '\n';
+    return len;
+}
+
+/* Find the arguments of the format string of site. Returns false if it cannot be encoded. */
+static bool parse_site(struct log_site *site, const char *fmt) {
+    site->nargs = 0;
+    const char *start, *end;
+    enum logbin_arg arg;
+    unsigned stars;
+    int ret;
+    for (const char *p = fmt; (ret=logbin_next_conv(p, &start, &end, &arg, &stars)) == 1; p = end) {
+        if (site->nargs + stars + 1 > LOG_SITE_MAX_ARGS) {
+            return false;
+        }
+        for (unsigned i = 0; i < stars; i++) {
+            site->args[site->nargs++] = LOGBIN_ARG_INT;
+        }
+        site->args[site->nargs++] = arg;
+    }
+    site->id = logbin_format_id(fmt);
+    return ret == 0;
+}
+
+/* Return true if site can be logged in binary, filling it in the first time. */
+static bool site_ready(struct log_site *site, const char *fmt) {
+    unsigned char state = atomic_load_explicit(&site->state, memory_order_acquire);
+    if (state == LOG_SITE_NEW &&
+        atomic_compare_exchange_strong(&site->state, &state, LOG_SITE_BUSY))
+    {
+        state = parse_site(site, fmt) ? LOG_SITE_READY : LOG_SITE_UNSUPPORTED;
+        atomic_store_explicit(&site->state, state, memory_order_release);
+    }
+    return state == LOG_SITE_READY;
+}
+
+/* Append len bytes at src to the record being built at *p, up to end. */
+static void put(char **p, const char *end, const void *src, size_t len) {
+    if (len <= (size_t)(end - *p)) {
+        memcpy(*p, src, len);
+        *p += len;
+    }
+}
+
+/*
+ * Encode a message as a binary record into buf, first logging its format
+ * string if this process has not. Returns the length of the record.
+ */
+static size_t format_binary(char *buf, struct log_site *site, enum log_level level,
+                            const char *fmt, va_list args) {
+    struct logbin_header h = {.magic=LOGBIN_MAGIC, .time=monotonic_ns()};
+    char *p = buf + sizeof h;
+    const char *end = buf + LOG_LINE_MAX;
+    if (!site_ready(site, fmt)) {
+        h.kind = LOGBIN_KIND(LOGBIN_TEXT, level);
+        int n = vsnprintf(p, end - p, fmt, args);
+        p += n < 0 ? 0 : (size_t)n < (size_t)(end - p) ? (size_t)n : (size_t)(end - p) - 1;
+    } else {
+        if (!atomic_load_explicit(&site->defined, memory_order_relaxed)) {
+            char def[LOG_LINE_MAX];
+            size_t len = strlen(fmt);
+            len = len < sizeof def - sizeof h ? len : sizeof def - sizeof h;
+            struct logbin_header dh = {.magic=LOGBIN_MAGIC, .kind=LOGBIN_KIND(LOGBIN_FORMAT, 0),
+                                       .len=len, .id=site->id, .time=h.time};
+            memcpy(def, &dh, sizeof dh);
+            memcpy(&def[sizeof dh], fmt, len);
+            if (submit(level, def, sizeof dh + len)) {
+                atomic_store_explicit(&site->defined, true, memory_order_relaxed);
+            }
+        }
+        h.kind = LOGBIN_KIND(LOGBIN_MESSAGE, level);
+        h.id = site->id;
+        for (unsigned i = 0; i < site->nargs; i++) {
+            union {
+                int i;
+                int64_t ll;
+                double d;
+                uint64_t ptr;
+            } v;
+            switch ((enum logbin_arg)site->args[i]) {
+            case LOGBIN_ARG_INT:
+                v.i = va_arg(args, int);
+                put(&p, end, &v.i, sizeof v.i);
+                continue;
+            case LOGBIN_ARG_LONG:    v.ll = va_arg(args, long); break;
+            case LOGBIN_ARG_LLONG:   v.ll = va_arg(args, long long); break;
+            case LOGBIN_ARG_SIZE:    v.ll = va_arg(args, size_t); break;
+            case LOGBIN_ARG_INTMAX:  v.ll = va_arg(args, intmax_t); break;
+            case LOGBIN_ARG_PTRDIFF: v.ll = va_arg(args, ptrdiff_t); break;
+            case LOGBIN_ARG_DOUBLE:  v.d = va_arg(args, double); break;
+            case LOGBIN_ARG_PTR:     v.ptr = (uintptr_t)va_arg(args, void *); break;
+            case LOGBIN_ARG_STR: {
+                const char *str = va_arg(args, const char *);
+                str = str ? str : "(null)";
+                size_t room = end - p >= 2 ? end - p - 2 : 0;
+                size_t n = strnlen(str, room < UINT16_MAX ? room : UINT16_MAX);
+                uint16_t n16 = n;
+                put(&p, end, &n16, sizeof n16);
+                put(&p, end, str, n);
+                continue;
+            }
+            }
+            put(&p, end, &v, sizeof(int64_t));
+        }
+    }
+    h.len = p - (buf + sizeof h);
+    memcpy(buf, &h, sizeof h);
+    return p - buf;
+}
+
+/* Log a message. */
+void logmsg(struct log_site *site, enum log_level level, const char *fmt, ...) {
+    if (level < log_threshold) {
+        return;
+    }
+    char buf[LOG_LINE_MAX];
+    size_t len;
     va_list args;
     va_start(args, fmt);
-    vfprintf(logfile, fmt, args);
+    if (atomic_load_explicit(&log_format, memory_order_relaxed) == LOG_FORMAT_BINARY) {
+        len = format_binary(buf, site, level, fmt, args);
+    } else {
+        len = format_text(buf, level, fmt, args);
+    }
     va_end(args);
-    suffix();
+    submit(level, buf, len);
 }
@@ -9,6 +9,42 @@
 #ifndef COMMON_LOG_H
 #define COMMON_LOG_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Severity of a log message, from least to most severe. */
+enum log_level {
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+};
+
+/* How messages are written to the logfile. */
+enum log_format {
+    LOG_FORMAT_TEXT,    /* One line of text per message */
+    LOG_FORMAT_BINARY,  /* Records described in logbin.h, read with ftps-logdump */
+};
+
+/* Most arguments a message logged in binary can have. */
+#define LOG_SITE_MAX_ARGS (16U)
+
+/*
+ * What the binary format needs to know about the format string of one call
+ * to the macros below. Filled in the first time the call logs a binary
+ * message.
+ */
+struct log_site {
+    _Atomic unsigned char state;  /* Whether the fields below are filled in */
+    atomic_bool defined;          /* Format string written to the logfile */
+    unsigned char nargs;
+    unsigned char args[LOG_SITE_MAX_ARGS];  /* enum logbin_arg of each argument */
+    uint32_t id;
+};
+
+/* Messages less severe than this are discarded. Set with logsetlevel(). */
+extern enum log_level log_threshold;
+
 /*
  * Initialize the logging subsystem with a path to a logfile.
  *
@@ -16,28 +52,64 @@
  */
 void loginit(const char *const path);
 
+/* Discard messages less severe than level from now on. */
+void logsetlevel(enum log_level level);
+
+/*
+ * Write messages logged from now on in format. Text lines already in the
+ * logfile are kept, and ftps-logdump passes them through.
+ */
+void logsetformat(enum log_format format);
+
+/*
+ * Write every message logged so far to the logfile. Messages are otherwise
+ * written in the background, so this must be called before _exit(2).
+ */
+void logflush(void);
+
+/* Return the number of messages dropped because the log could not keep up. */
+unsigned long logdropped(void);
+
+/*
+ * Log a message with the given level. fmt is specified just like it is for
+ * printf family functions and must always be the same for a given site. Use
+ * the macros below instead.
+ */
+void logmsg(struct log_site *site, enum log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
 /*
  * Log an information message. fmt is specified just like it is for printf
- * family functions.
+ * family functions. The arguments are not evaluated if information messages
+ * are discarded.
  *
  * Precondition: loginit has been called and initialized with a path to a logfile
  */
-void loginfo(const char *fmt, ...);
+#define loginfo(...) do { \
+        static struct log_site log_site_; \
+        if (log_threshold <= LOG_LEVEL_INFO) logmsg(&log_site_, LOG_LEVEL_INFO, __VA_ARGS__); \
+    } while (0)
 
 /*
- * Log an information message. fmt is specified just like it is for printf
- * family functions.
+ * Log a warning message. fmt is specified just like it is for printf family
+ * functions. The arguments are not evaluated if warnings are discarded.
  *
  * Precondition: loginit has been called and initialized with a path to a logfile
  */
-void logwarn(const char *fmt, ...);
+#define logwarn(...) do { \
+        static struct log_site log_site_; \
+        if (log_threshold <= LOG_LEVEL_WARN) logmsg(&log_site_, LOG_LEVEL_WARN, __VA_ARGS__); \
+    } while (0)
 
 /*
- * Log an information message. fmt is specified just like it is for printf
- * family functions.
+ * Log an error message. fmt is specified just like it is for printf family
+ * functions. Errors are never discarded.
  *
  * Precondition: loginit has been called and initialized with a path to a logfile
  */
-void logerr(const char *fmt, ...);
+#define logerr(...) do { \
+        static struct log_site log_site_; \
+        logmsg(&log_site_, LOG_LEVEL_ERROR, __VA_ARGS__); \
+    } while (0)
 
 #endif /* COMMON_LOG_H */
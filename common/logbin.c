@@ -0,0 +1,86 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * logbin.c
+ *
+ * This module holds what the logger and the log decoder must agree on to
+ * read and write binary logs: how format strings are identified, how their
+ * conversions are taken apart and how levels are shown as text.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "logbin.h"
+
+const char *const logbin_level_tags[3] = {"[INFO] ", "[WARN] ", "[ERROR] "};
+
+/* Find the next conversion in fmt. */
+int logbin_next_conv(const char *fmt, const char **start, const char **end,
+                     enum logbin_arg *type, unsigned *stars) {
+    const char *p = fmt;
+    for (;;) {
+        p = strchr(p, '%');
+        if (!p) {
+            return 0;
+        } else if (p[1] == '%') {
+            p += 2;
+        } else {
+            break;
+        }
+    }
+    *start = p++;
+    *stars = 0;
+    p += strspn(p, "-+ #0");
+    for (unsigned i = 0; i < 2; i++) {  /* Width, then precision */
+        if (i == 1) {
+            if (*p != '.') {
+                break;
+            }
+            p++;
+        }
+        if (*p == '*') {
+            (*stars)++;
+            p++;
+        } else {
+            p += strspn(p, "0123456789");
+        }
+    }
+
+    enum logbin_arg arg = LOGBIN_ARG_INT;
+    if (p[0] == 'h') {
+        p += p[1] == 'h' ? 2 : 1;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        arg = LOGBIN_ARG_LLONG;
+        p += 2;
+    } else if (*p == 'l' || *p == 'z' || *p == 'j' || *p == 't') {
+        arg = *p == 'l' ? LOGBIN_ARG_LONG : *p == 'z' ? LOGBIN_ARG_SIZE :
+              *p == 'j' ? LOGBIN_ARG_INTMAX : LOGBIN_ARG_PTRDIFF;
+        p++;
+    } else if (*p == 'L') {
+        return -1;  /* long double */
+    }
+    if (*p && strchr("diouxXc", *p)) {
+        /* The length modifier decides */
+    } else if (*p && strchr("feEgGaA", *p) && arg == LOGBIN_ARG_INT) {
+        arg = LOGBIN_ARG_DOUBLE;
+    } else if (*p == 's' && arg == LOGBIN_ARG_INT) {
+        arg = LOGBIN_ARG_STR;
+    } else if (*p == 'p' && arg == LOGBIN_ARG_INT) {
+        arg = LOGBIN_ARG_PTR;
+    } else {
+        return -1;  /* %n, wide strings and anything malformed */
+    }
+    *end = p + 1;
+    *type = arg;
+    return 1;
+}
+
+/* Return the ID of fmt. */
+uint32_t logbin_format_id(const char *fmt) {
+    uint32_t h = 2166136261U;  /* FNV-1a */
+    for (const char *p = fmt; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619U;
+    }
+    return h;
+}
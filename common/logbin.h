@@ -0,0 +1,81 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * logbin.h
+ *
+ * Header for logbin.c
+ *
+ * A binary log is a sequence of records, each a struct logbin_header followed
+ * by len bytes, all in host byte order. Text lines may appear between records,
+ * since messages logged before the binary format is selected are still text;
+ * a text line never starts with LOGBIN_MAGIC.
+ *
+ * LOGBIN_ANCHOR   Payload is the wall clock time as int64 seconds and int64
+ *                 nanoseconds, taken when time was read from the monotonic
+ *                 clock. Written before any other record of a server run.
+ * LOGBIN_FORMAT   Payload is the format string with ID id. The ID is a hash
+ *                 of the string, so a format may be defined more than once and
+ *                 anywhere in the log.
+ * LOGBIN_MESSAGE  A message with format id. The payload holds its arguments in
+ *                 order: int as 4 bytes, other integers, doubles and pointers
+ *                 as 8 bytes, and strings as a uint16 length and the bytes.
+ * LOGBIN_TEXT     A message that could not be encoded, already formatted.
+ */
+
+#ifndef COMMON_LOGBIN_H
+#define COMMON_LOGBIN_H
+
+#include <stdint.h>
+
+#define LOGBIN_MAGIC (0xFBU)
+
+enum logbin_type {
+    LOGBIN_ANCHOR = 1,
+    LOGBIN_FORMAT,
+    LOGBIN_MESSAGE,
+    LOGBIN_TEXT,
+};
+
+struct logbin_header {
+    uint8_t magic;  /* LOGBIN_MAGIC */
+    uint8_t kind;   /* enum logbin_type, and enum log_level << 4 for messages */
+    uint16_t len;   /* Bytes of payload following the header */
+    uint32_t id;    /* Format ID */
+    uint64_t time;  /* CLOCK_MONOTONIC nanoseconds when logged */
+};
+
+#define LOGBIN_KIND(type, level) ((uint8_t)((type) | (level) << 4))
+#define LOGBIN_TYPE(kind) ((kind) & 0x0F)
+#define LOGBIN_LEVEL(kind) ((kind) >> 4)
+
+/* How an argument of a format string is passed and stored. */
+enum logbin_arg {
+    LOGBIN_ARG_INT,      /* int and anything promoted to it; 4 bytes */
+    LOGBIN_ARG_LONG,     /* The rest are 8 bytes except LOGBIN_ARG_STR */
+    LOGBIN_ARG_LLONG,
+    LOGBIN_ARG_SIZE,
+    LOGBIN_ARG_INTMAX,
+    LOGBIN_ARG_PTRDIFF,
+    LOGBIN_ARG_DOUBLE,
+    LOGBIN_ARG_PTR,
+    LOGBIN_ARG_STR,
+};
+
+/* Tag following the time in a text message, indexed by enum log_level. */
+extern const char *const logbin_level_tags[3];
+
+/*
+ * Find the next conversion in the printf format string fmt. On success,
+ * returns 1 and sets start and end to the bounds of the conversion, including
+ * the '%', type to how its value is passed and stars to the number of int
+ * arguments taken by '*' width and precision before the value. "%%" is not a
+ * conversion and is skipped. Returns 0 if there are no more conversions and -1
+ * if the conversion at start cannot be stored in a binary log.
+ */
+int logbin_next_conv(const char *fmt, const char **start, const char **end,
+                     enum logbin_arg *type, unsigned *stars);
+
+/* Return the ID of the format string fmt. */
+uint32_t logbin_format_id(const char *fmt);
+
+#endif /* COMMON_LOGBIN_H */
@@ -10,7 +10,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -20,7 +22,7 @@
 
 /* Converts struct sockaddr_storage to an ipv4 or ipv6 string with port. */
 char *addrtostr(struct sockaddr_storage *const addr) {
-    static char str[INET6_ADDRSTRLEN+7];
+    static __thread char str[INET6_ADDRSTRLEN+7];
     struct sockaddr_in *addrv4;
     struct sockaddr_in6 *addrv6;
     char *ptr = NULL;
@@ -67,12 +69,63 @@ int getchar_from_sock(int sockfd, struct sockbuf *buf) {
     return buf->data[(buf->i)++];
 }
 
-/*
- * Wrapper around strcmp to be used in bsearch(3).
- * https://stackoverflow.com/a/15824981/2981420
- */
-int bsearch_strcmp(const void *s1, const void *s2) {
-  const char *key = s1;
-  const char *const *arg = s2;
-  return strcmp(key, *arg);
+/* Return true if buf holds at least one complete line. */
+bool sockbuf_line_ready(const struct sockbuf *buf) {
+    assert(buf);
+    return memchr(&buf->data[buf->i], '\n', buf->size - buf->i) != NULL;
+}
+
+/* Take the next complete line out of buf and store a view of it in line. */
+bool sockbuf_next_line(struct sockbuf *buf, struct sockline *line) {
+    assert(buf);
+    assert(line);
+    const uint8_t *start = &buf->data[buf->i];
+    const uint8_t *nl = memchr(start, '\n', buf->size - buf->i);
+    if (!nl) {
+        return false;
+    }
+    line->text = (const char *)start;
+    line->len = nl - start;
+    buf->i += line->len + 1;
+    return true;
+}
+
+/* Receive more data from the socket file descriptor into buf. */
+ssize_t sockbuf_fill(int sockfd, struct sockbuf *buf, int flags) {
+    assert(buf);
+    if (buf->i > 0) {
+        /* Keep a partial line at the front so it can grow contiguously */
+        memmove(buf->data, &buf->data[buf->i], buf->size - buf->i);
+        buf->size -= buf->i;
+        buf->i = 0;
+    }
+    if (buf->size == sizeof buf->data) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t read = recv(sockfd, &buf->data[buf->size], sizeof buf->data - buf->size, flags);
+    if (read > 0) {
+        buf->size += read;
+    }
+    return read;
+}
+
+/* Receive from the socket file descriptor until buf holds a complete line. */
+int sockbuf_read_line(int sockfd, struct sockbuf *buf, struct sockline *line) {
+    while (!sockbuf_next_line(buf, line)) {
+        ssize_t read = sockbuf_fill(sockfd, buf, 0);
+        if (read == 0) {
+            return 0;
+        } else if (read == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* Return the current CLOCK_MONOTONIC time in nanoseconds. */
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
 }
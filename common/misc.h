@@ -10,6 +10,9 @@
 #define COMMON_MISC_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 /* Stores data in between calls when getting data from a socket. */
 struct sockbuf {
@@ -18,7 +21,20 @@ struct sockbuf {
     size_t size;
 };
 
-/* Converts struct sockaddr_storage to an ipv4 or ipv6 string with port. */
+/*
+ * A line held in a struct sockbuf. text is not null-terminated and len counts
+ * every byte before the '\n', including a trailing '\r' if there is one. The
+ * view is only valid until the sockbuf is refilled.
+ */
+struct sockline {
+    const char *text;
+    size_t len;
+};
+
+/*
+ * Converts struct sockaddr_storage to an ipv4 or ipv6 string with port. The
+ * string is overwritten by the next call from the same thread.
+ */
 char *addrtostr(struct sockaddr_storage *const addr);
 /*
  * Get a character from the socket file descriptor. buf is used to buffer any
@@ -26,10 +42,30 @@ char *addrtostr(struct sockaddr_storage *const addr);
  * again. Returns 0 on EOF or -1 on error, otherwise, the character is returned.
  */
 int getchar_from_sock(int sockfd, struct sockbuf *buf);
+/* Return true if buf holds at least one complete line. */
+bool sockbuf_line_ready(const struct sockbuf *buf);
+/*
+ * Take the next complete line out of buf and store a view of it in line.
+ * Returns false, leaving buf unchanged, if buf does not hold a complete line.
+ */
+bool sockbuf_next_line(struct sockbuf *buf, struct sockline *line);
+/*
+ * Receive more data from the socket file descriptor into buf, keeping any data
+ * not yet taken out of buf. flags is passed on to recv(2). Returns the number
+ * of bytes received, 0 on EOF or -1 on error. If buf is already full, -1 is
+ * returned with errno set to ENOBUFS.
+ */
+ssize_t sockbuf_fill(int sockfd, struct sockbuf *buf, int flags);
+/*
+ * Receive from the socket file descriptor until buf holds a complete line and
+ * take it out of buf as sockbuf_next_line() does. Returns 1 when a line is
+ * stored, 0 on EOF or -1 on error.
+ */
+int sockbuf_read_line(int sockfd, struct sockbuf *buf, struct sockline *line);
 /*
- * Wrapper around strcmp to be used in bsearch(3).
- * https://stackoverflow.com/a/15824981/2981420
+ * Return the current CLOCK_MONOTONIC time in nanoseconds. Callers wanting
+ * coarser units divide the result.
  */
-int bsearch_strcmp(const void *s1, const void *s2);
+uint64_t monotonic_ns(void);
 
 #endif /* COMMON_MISC_H */
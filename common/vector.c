@@ -8,6 +8,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "vector.h"
@@ -47,9 +48,22 @@ void vector_append(struct vector *vec, const char ch) {
 /* Append a string str to a vector. */
 void vector_append_str(struct vector *vec, const char *str) {
     assert(vec);
-    for (const char *p = str; *p; p++) {
-        vector_append(vec, *p);
+    size_t len = strlen(str);
+    if (vec->size + len > vec->capacity) {
+        size_t capacity = vec->capacity;
+        while (capacity < vec->size + len) {
+            capacity = (size_t) (capacity * vec->scale) + 1;
+        }
+        vec->arr = reallocarray(vec->arr, capacity, sizeof *(vec->arr));
+        if (!(vec->arr)) {
+            logerr("Failed to reallocate memory for vector");
+            puts("A fatal error occurred. See log for details");
+            exit(EXIT_FAILURE);
+        }
+        vec->capacity = capacity;
     }
+    memcpy(&vec->arr[vec->size], str, len);
+    vec->size += len;
 }
 
 /* Free dynamically allocated data used by the vector. */
@@ -0,0 +1,257 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * main.c
+ *
+ * This module is the main entry point for ftps-bench, a load generator for
+ * ftps. It starts the requested number of sessions, lets them run for the
+ * requested time and prints what they measured as JSON on stdout.
+ * Percentiles are exact, computed from every latency recorded.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "session.h"
+
+#define DEFAULT_SESSIONS (4U)
+#define DEFAULT_SECONDS (10U)
+#define DEFAULT_SIZE (65536U)
+#define RETR_FILE "ftps-bench.retr"
+
+static const char *const op_names[NOPS] = {
+    [OP_LOGIN]="login", [OP_LIST]="list", [OP_RETR]="retr", [OP_STOR]="stor",
+};
+
+/* Prints usage information about how to invoke the application. */
+static void usage(void) {
+    fputs("usage: ftps-bench [-c SESSIONS] [-t SECONDS] [-m MIX] [-r PATH | -R BYTES]\n"
+          "                  [-s BYTES] [-u USER] [-p PASS] [-P] HOST PORT\n"
+          "    -c SESSIONS - Concurrent sessions (default 4)\n"
+          "    -t SECONDS - How long to run (default 10)\n"
+          "    -m MIX - Relative weights of operations, e.g. 'login=1,list=2,retr=4,stor=1'.\n"
+          "             Operations left out are not run (default all 1)\n"
+          "    -r PATH - File to RETR, which must exist on the server\n"
+          "    -R BYTES - Upload a file of this size to RETR before starting (default 65536)\n"
+          "    -s BYTES - Size of each STOR (default 65536)\n"
+          "    -u USER, -p PASS - Account to log in with (default alice, blowfish)\n"
+          "    -P - Use PORT instead of PASV\n",
+          stderr);
+}
+
+/* Parse a non-negative number from str into n. Returns false if str is not one. */
+static bool parse_num(const char *str, unsigned long long *n) {
+    char *end;
+    errno = 0;
+    *n = strtoull(str, &end, 10);
+    return *str >= '0' && *str <= '9' && *end == '\0' && errno == 0;
+}
+
+/* Parse a mix like "list=2,retr=1" into cfg. Returns false if it is malformed. */
+static bool parse_mix(char *mix, struct bench_config *cfg) {
+    memset(cfg->weights, 0, sizeof cfg->weights);
+    cfg->total_weight = 0;
+    char *save;
+    for (char *item = strtok_r(mix, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        unsigned long long weight;
+        if (!eq || !parse_num(eq + 1, &weight) || weight > 1000) {
+            return false;
+        }
+        *eq = '\0';
+        enum bench_op op = 0;
+        while (op < NOPS && strcasecmp(item, op_names[op]) != 0) {
+            op++;
+        }
+        if (op == NOPS) {
+            return false;
+        }
+        cfg->total_weight += weight - cfg->weights[op];
+        cfg->weights[op] = weight;
+    }
+    return cfg->total_weight > 0;
+}
+
+/* Resolve host and port into cfg->server. Returns false on error. */
+static bool resolve(const char *host, const char *port, struct bench_config *cfg) {
+    struct addrinfo hints = {.ai_family=AF_INET, .ai_socktype=SOCK_STREAM}, *info;
+    int err = getaddrinfo(host, port, &hints, &info);
+    if (err != 0) {
+        fprintf(stderr, "ftps-bench: cannot resolve %s:%s: %s\n", host, port, gai_strerror(err));
+        return false;
+    }
+    memcpy(&cfg->server, info->ai_addr, sizeof cfg->server);
+    freeaddrinfo(info);
+    return true;
+}
+
+/* Compare two latencies for qsort(). */
+static int cmp_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Return the q quantile of the n sorted latencies, in milliseconds. */
+static double quantile(const uint64_t *ns, size_t n, double q) {
+    size_t rank = (size_t)(q * n + 0.5);
+    rank = rank == 0 ? 1 : rank;
+    return ns[rank-1] / 1e6;
+}
+
+/* Print the latencies of one command as a JSON object. */
+static void print_command(const char *name, struct samples *s, double seconds, bool last) {
+    printf("    \"%s\": {\"count\": %zu, \"errors\": %"PRIu64", \"per_s\": %.1f",
+           name, s->len, s->errors, s->len / seconds);
+    if (s->len > 0) {
+        qsort(s->ns, s->len, sizeof *s->ns, cmp_ns);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < s->len; i++) {
+            sum += s->ns[i];
+        }
+        printf(", \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, "
+               "\"max_ms\": %.3f", sum / 1e6 / s->len, quantile(s->ns, s->len, 0.5),
+               quantile(s->ns, s->len, 0.99), quantile(s->ns, s->len, 0.999),
+               s->ns[s->len-1] / 1e6);
+    }
+    printf("}%s\n", last ? "" : ",");
+}
+
+/* Append the latencies of src to dst. */
+static void merge(struct samples *dst, const struct samples *src) {
+    if (dst->len + src->len > dst->cap) {
+        dst->cap = dst->len + src->len;
+        dst->ns = realloc(dst->ns, dst->cap * sizeof *dst->ns);
+        if (!dst->ns) {
+            fputs("ftps-bench: out of memory\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (src->len > 0) {
+        memcpy(&dst->ns[dst->len], src->ns, src->len * sizeof *src->ns);
+    }
+    dst->len += src->len;
+    dst->errors += src->errors;
+}
+
+/* Main entry point. */
+int main(int argc, char *argv[]) {
+    atomic_bool stop = false;
+    struct bench_config cfg = {
+        .user="alice", .pass="blowfish", .retr_path=NULL, .stor_size=DEFAULT_SIZE,
+        .weights={1, 1, 1, 1}, .total_weight=NOPS, .stop=&stop,
+    };
+    unsigned long long sessions = DEFAULT_SESSIONS, seconds = DEFAULT_SECONDS;
+    unsigned long long retr_size = DEFAULT_SIZE, stor_size = DEFAULT_SIZE;
+    int opt;
+    while ((opt=getopt(argc, argv, "c:t:m:r:R:s:u:p:P")) != -1) {
+        bool ok = true;
+        switch (opt) {
+            case 'c': ok = parse_num(optarg, &sessions) && sessions > 0 && sessions <= 10000; break;
+            case 't': ok = parse_num(optarg, &seconds) && seconds > 0; break;
+            case 'm': ok = parse_mix(optarg, &cfg); break;
+            case 'r': cfg.retr_path = optarg; break;
+            case 'R': ok = parse_num(optarg, &retr_size); break;
+            case 's': ok = parse_num(optarg, &stor_size); cfg.stor_size = stor_size; break;
+            case 'u': cfg.user = optarg; break;
+            case 'p': cfg.pass = optarg; break;
+            case 'P': cfg.port_mode = true; break;
+            default: ok = false; break;
+        }
+        if (!ok) {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (!resolve(argv[optind], argv[optind+1], &cfg)) {
+        return EXIT_FAILURE;
+    }
+    if (!cfg.retr_path && cfg.weights[OP_RETR] > 0) {
+        cfg.retr_path = RETR_FILE;
+        if (!upload_file(&cfg, cfg.retr_path, retr_size)) {
+            fputs("ftps-bench: failed to upload "RETR_FILE"; use -r to RETR an existing file\n",
+                  stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct session_arg *args = calloc(sessions, sizeof *args);
+    pthread_t *threads = calloc(sessions, sizeof *threads);
+    if (!args || !threads) {
+        fputs("ftps-bench: out of memory\n", stderr);
+        return EXIT_FAILURE;
+    }
+    uint64_t start = monotonic_ns();
+    unsigned started = 0;
+    for (; started < sessions; started++) {
+        args[started].cfg = &cfg;
+        args[started].id = started;
+        int err = pthread_create(&threads[started], NULL, run_session, &args[started]);
+        if (err != 0) {
+            fprintf(stderr, "ftps-bench: pthread_create: %s\n", strerror(err));
+            break;
+        }
+    }
+    if (started == sessions) {
+        sleep(seconds);
+    }
+    atomic_store(&stop, true);
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t end = monotonic_ns();
+    if (started < sessions) {
+        return EXIT_FAILURE;
+    }
+    double elapsed = (end - start) / 1e9;
+
+    struct session_result total = {0};
+    for (unsigned i = 0; i < started; i++) {
+        struct session_result *res = &args[i].result;
+        for (unsigned c = 0; c < NCMDS; c++) {
+            merge(&total.cmds[c], &res->cmds[c]);
+            free(res->cmds[c].ns);
+        }
+        total.bytes_in += res->bytes_in;
+        total.bytes_out += res->bytes_out;
+        total.ops += res->ops;
+        total.reconnects += res->reconnects;
+    }
+
+    printf("{\n  \"sessions\": %llu,\n  \"seconds\": %.3f,\n  \"mode\": \"%s\",\n",
+           sessions, elapsed, cfg.port_mode ? "PORT" : "PASV");
+    printf("  \"mix\": {");
+    for (unsigned op = 0; op < NOPS; op++) {
+        printf("\"%s\": %u%s", op_names[op], cfg.weights[op], op + 1 < NOPS ? ", " : "");
+    }
+    printf("},\n  \"ops\": %"PRIu64",\n  \"ops_per_s\": %.1f,\n  \"reconnects\": %"PRIu64",\n",
+           total.ops, total.ops / elapsed, total.reconnects);
+    printf("  \"bytes_in\": %"PRIu64",\n  \"bytes_out\": %"PRIu64",\n"
+           "  \"throughput_mib_s\": %.2f,\n  \"commands\": {\n", total.bytes_in,
+           total.bytes_out, (total.bytes_in + total.bytes_out) / elapsed / (1 << 20));
+    for (unsigned c = 0; c < NCMDS; c++) {
+        print_command(cmd_names[c], &total.cmds[c], elapsed, c + 1 == NCMDS);
+        free(total.cmds[c].ns);
+    }
+    printf("  }\n}\n");
+    free(args);
+    free(threads);
+    return total.ops > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,392 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * session.c
+ *
+ * This module runs one benchmark session: a control connection that logs in
+ * and then runs operations picked at random from the configured mix until it
+ * is told to stop, timing every command. A session that hits an error drops
+ * its connection and logs in again, so one bad reply does not end the run.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "misc.h"
+#include "session.h"
+
+#define LINE_MAX_LEN (512U)
+#define IO_BUF_SIZE (65536U)
+#define DATA_ACCEPT_TIMEOUT_MS (10000)
+#define RECONNECT_DELAY_NS (100000000L)
+
+const char *const cmd_names[NCMDS] = {
+    [CMD_USER]="USER", [CMD_PASS]="PASS", [CMD_PASV]="PASV", [CMD_PORT]="PORT",
+    [CMD_LIST]="LIST", [CMD_RETR]="RETR", [CMD_STOR]="STOR",
+};
+
+/* A control connection. */
+struct conn {
+    int sock;
+    char buf[4096];   /* Received but not yet read */
+    size_t start;
+    size_t end;
+    char line[LINE_MAX_LEN];  /* Last line of the last reply */
+};
+
+/* Record a latency of ns nanoseconds. */
+static void add_sample(struct samples *s, uint64_t ns) {
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->ns = realloc(s->ns, s->cap * sizeof *s->ns);
+        if (!s->ns) {
+            fputs("ftps-bench: out of memory\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->ns[s->len++] = ns;
+}
+
+/* Send all of buf. Returns false on error. */
+static bool send_all(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Read a line from the server into c->line, without its CRLF. Returns false on error. */
+static bool read_line(struct conn *c) {
+    size_t len = 0;
+    for (;;) {
+        while (c->start < c->end) {
+            char ch = c->buf[c->start++];
+            if (ch == '\n') {
+                if (len > 0 && c->line[len-1] == '\r') {
+                    len--;
+                }
+                c->line[len] = '\0';
+                return true;
+            } else if (len < sizeof c->line - 1) {
+                c->line[len++] = ch;
+            }
+        }
+        ssize_t n = recv(c->sock, c->buf, sizeof c->buf, 0);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        c->start = 0;
+        c->end = n;
+    }
+}
+
+/* Read a possibly multiline reply. Returns its code or -1 on error. */
+static int read_reply(struct conn *c) {
+    if (!read_line(c) || strlen(c->line) < 4) {
+        return -1;
+    }
+    int code = atoi(c->line);
+    if (c->line[3] == '-') {
+        char end[5];
+        memcpy(end, c->line, 3);
+        end[3] = ' ';
+        end[4] = '\0';
+        do {
+            if (!read_line(c)) {
+                return -1;
+            }
+        } while (strncmp(c->line, end, 4) != 0);
+    }
+    return code;
+}
+
+/* Send a command formatted from fmt. Returns false on error. */
+static bool send_cmd(struct conn *c, const char *fmt, ...) {
+    char cmd[LINE_MAX_LEN];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(cmd, sizeof cmd - 2, fmt, args);
+    va_end(args);
+    if (len < 0 || (size_t)len >= sizeof cmd - 2) {
+        return false;
+    }
+    memcpy(&cmd[len], "\r\n", 2);
+    return send_all(c->sock, cmd, len + 2);
+}
+
+/*
+ * Send the command with argument arg (if not NULL), wait for a reply with
+ * code expect and record its latency under cmd. Returns false on error.
+ */
+static bool timed_cmd(struct conn *c, struct session_result *res, enum bench_cmd cmd,
+                      const char *arg, int expect) {
+    uint64_t start = monotonic_ns();
+    bool ok = (arg ? send_cmd(c, "%s %s", cmd_names[cmd], arg) :
+                     send_cmd(c, "%s", cmd_names[cmd])) &&
+              read_reply(c) == expect;
+    if (ok) {
+        add_sample(&res->cmds[cmd], monotonic_ns() - start);
+    } else {
+        res->cmds[cmd].errors++;
+    }
+    return ok;
+}
+
+/* Log in on c. Returns false on error. */
+static bool login(const struct bench_config *cfg, struct conn *c, struct session_result *res) {
+    return timed_cmd(c, res, CMD_USER, cfg->user, 331) &&
+           timed_cmd(c, res, CMD_PASS, cfg->pass, 230);
+}
+
+/* Connect to the server and log in. Returns false on error. */
+static bool open_control(const struct bench_config *cfg, struct conn *c,
+                         struct session_result *res) {
+    c->start = c->end = 0;
+    c->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->sock == -1) {
+        return false;
+    }
+    const int on = 1;
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    if (connect(c->sock, (const struct sockaddr *)&cfg->server, sizeof cfg->server) == -1 ||
+        read_reply(c) != 220 || !login(cfg, c, res))
+    {
+        close(c->sock);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Prepare a data connection with PASV or PORT. Returns the connected data
+ * socket for PASV or the listening socket for PORT, or -1 on error.
+ */
+static int prepare_data(const struct bench_config *cfg, struct conn *c,
+                        struct session_result *res) {
+    uint64_t start = monotonic_ns();
+    if (!cfg->port_mode) {
+        unsigned h[4], p[2];
+        const char *open = NULL;
+        int sock = -1;
+        if (send_cmd(c, "PASV") && read_reply(c) == 227 && (open=strchr(c->line, '(')) &&
+            sscanf(open, "(%u,%u,%u,%u,%u,%u)", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) == 6)
+        {
+            struct sockaddr_in addr = {.sin_family=AF_INET};
+            addr.sin_addr.s_addr = htonl(h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3]);
+            addr.sin_port = htons(p[0] << 8 | p[1]);
+            sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (sock != -1 && connect(sock, (struct sockaddr *)&addr, sizeof addr) == -1) {
+                close(sock);
+                sock = -1;
+            }
+        }
+        if (sock == -1) {
+            res->cmds[CMD_PASV].errors++;
+        } else {
+            add_sample(&res->cmds[CMD_PASV], monotonic_ns() - start);
+        }
+        return sock;
+    }
+
+    /* Listen on the address the server already reaches us at */
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1 || getsockname(c->sock, (struct sockaddr *)&addr, &addrlen) == -1) {
+        goto err;
+    }
+    addr.sin_port = 0;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(sock, 1) == -1 ||
+        getsockname(sock, (struct sockaddr *)&addr, &addrlen) == -1)
+    {
+        goto err;
+    }
+    uint32_t ip = ntohl(addr.sin_addr.s_addr);
+    uint16_t port = ntohs(addr.sin_port);
+    if (!send_cmd(c, "PORT %u,%u,%u,%u,%u,%u", ip >> 24, (ip >> 16) & 0xFF, (ip >> 8) & 0xFF,
+                  ip & 0xFF, port >> 8, port & 0xFF) || read_reply(c) != 200)
+    {
+        goto err;
+    }
+    add_sample(&res->cmds[CMD_PORT], monotonic_ns() - start);
+    return sock;
+
+    err:
+    res->cmds[CMD_PORT].errors++;
+    if (sock != -1) {
+        close(sock);
+    }
+    return -1;
+}
+
+/*
+ * Return the data connection once the server has been told to use it,
+ * accepting it in PORT mode. Returns -1 on error.
+ */
+static int finish_data(const struct bench_config *cfg, int sock) {
+    if (!cfg->port_mode) {
+        return sock;
+    }
+    struct pollfd pfd = {.fd=sock, .events=POLLIN};
+    int data = -1;
+    if (poll(&pfd, 1, DATA_ACCEPT_TIMEOUT_MS) == 1) {
+        data = accept(sock, NULL, NULL);
+    }
+    close(sock);
+    return data;
+}
+
+/*
+ * Run a transfer command over a new data connection, sending size bytes if
+ * upload is true or reading everything the server sends otherwise. The
+ * latency covers the command up to its final reply. Returns false on error.
+ */
+static bool transfer(const struct bench_config *cfg, struct conn *c, struct session_result *res,
+                     enum bench_cmd cmd, const char *arg, bool upload, size_t size) {
+    static const char payload[IO_BUF_SIZE];
+    int sock = prepare_data(cfg, c, res);
+    if (sock == -1) {
+        return false;
+    }
+    uint64_t start = monotonic_ns();
+    bool ok = false;
+    int code;
+    if ((arg ? send_cmd(c, "%s %s", cmd_names[cmd], arg) : send_cmd(c, "%s", cmd_names[cmd])) &&
+        ((code=read_reply(c)) == 150 || code == 125) && (sock=finish_data(cfg, sock)) != -1)
+    {
+        ok = true;
+        if (upload) {
+            for (size_t left = size; ok && left > 0; ) {
+                size_t n = left < sizeof payload ? left : sizeof payload;
+                ok = send_all(sock, payload, n);
+                left -= n;
+            }
+            res->bytes_out += ok ? size : 0;
+        } else {
+            char buf[IO_BUF_SIZE];
+            ssize_t n;
+            while ((n=recv(sock, buf, sizeof buf, 0)) > 0 || (n == -1 && errno == EINTR)) {
+                res->bytes_in += n > 0 ? n : 0;
+            }
+            ok = n == 0;
+        }
+    }
+    if (sock != -1) {
+        close(sock);
+    }
+    ok = ok && read_reply(c) == 226;
+    if (ok) {
+        add_sample(&res->cmds[cmd], monotonic_ns() - start);
+    } else {
+        res->cmds[cmd].errors++;
+    }
+    return ok;
+}
+
+/* Pick an operation at random according to the configured weights. */
+static enum bench_op pick_op(const struct bench_config *cfg, unsigned *seed) {
+    unsigned r = rand_r(seed) % cfg->total_weight;
+    enum bench_op op = 0;
+    while (r >= cfg->weights[op]) {
+        r -= cfg->weights[op++];
+    }
+    return op;
+}
+
+/* Store a file of size bytes at path on the server. Returns false on error. */
+bool upload_file(const struct bench_config *cfg, const char *path, size_t size) {
+    struct session_result res = {0};
+    struct conn c;
+    bool ok = open_control(cfg, &c, &res);
+    if (ok) {
+        ok = transfer(cfg, &c, &res, CMD_STOR, path, true, size);
+        if (send_cmd(&c, "QUIT")) {
+            read_reply(&c);
+        }
+        close(c.sock);
+    }
+    for (unsigned i = 0; i < NCMDS; i++) {
+        free(res.cmds[i].ns);
+    }
+    return ok;
+}
+
+/* Run one session. */
+void *run_session(void *arg) {
+    struct session_arg *a = arg;
+    const struct bench_config *cfg = a->cfg;
+    struct session_result *res = &a->result;
+    unsigned seed = a->id * 2654435761U ^ (unsigned)monotonic_ns();
+    char stor_name[64];
+    snprintf(stor_name, sizeof stor_name, "ftps-bench.%u.tmp", a->id);
+
+    struct conn c;
+    bool connected = false;
+    while (!atomic_load(cfg->stop)) {
+        if (!connected) {
+            connected = open_control(cfg, &c, res);
+            if (!connected) {
+                res->reconnects++;
+                nanosleep(&(struct timespec){.tv_nsec=RECONNECT_DELAY_NS}, NULL);
+                continue;
+            }
+        }
+        bool ok = false;
+        switch (pick_op(cfg, &seed)) {
+            case OP_LOGIN:
+                ok = login(cfg, &c, res);
+                break;
+            case OP_LIST:
+                ok = transfer(cfg, &c, res, CMD_LIST, NULL, false, 0);
+                break;
+            case OP_RETR:
+                ok = transfer(cfg, &c, res, CMD_RETR, cfg->retr_path, false, 0);
+                break;
+            case OP_STOR:
+                ok = transfer(cfg, &c, res, CMD_STOR, stor_name, true, cfg->stor_size);
+                break;
+            case NOPS:
+                break;
+        }
+        if (ok) {
+            res->ops++;
+        } else {
+            close(c.sock);
+            connected = false;
+            res->reconnects++;
+        }
+    }
+    if (connected) {
+        if (send_cmd(&c, "QUIT")) {
+            read_reply(&c);
+        }
+        close(c.sock);
+    }
+    return NULL;
+}
@@ -0,0 +1,87 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * session.h
+ *
+ * Header for session.c
+ */
+
+#ifndef FTPB_SESSION_H
+#define FTPB_SESSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+/* Operations a session can be told to run. */
+enum bench_op {
+    OP_LOGIN,  /* USER and PASS again on the open connection */
+    OP_LIST,   /* LIST of the working directory */
+    OP_RETR,   /* RETR of the configured file */
+    OP_STOR,   /* STOR of a file of the configured size */
+    NOPS,
+};
+
+/* Commands whose latency is measured. */
+enum bench_cmd {
+    CMD_USER,
+    CMD_PASS,
+    CMD_PASV,
+    CMD_PORT,
+    CMD_LIST,
+    CMD_RETR,
+    CMD_STOR,
+    NCMDS,
+};
+
+/* Settings shared by every session. */
+struct bench_config {
+    struct sockaddr_in server;
+    const char *user;
+    const char *pass;
+    const char *retr_path;    /* File fetched by OP_RETR */
+    size_t stor_size;         /* Bytes sent by OP_STOR */
+    bool port_mode;           /* Use PORT instead of PASV */
+    unsigned weights[NOPS];   /* Relative frequency of each operation */
+    unsigned total_weight;
+    atomic_bool *stop;        /* Set when sessions should finish */
+};
+
+/* Latencies of one command, in nanoseconds. */
+struct samples {
+    uint64_t *ns;
+    size_t len;
+    size_t cap;
+    uint64_t errors;
+};
+
+/* What one session measured. */
+struct session_result {
+    struct samples cmds[NCMDS];
+    uint64_t bytes_in;   /* Data connection bytes received */
+    uint64_t bytes_out;  /* Data connection bytes sent */
+    uint64_t ops;        /* Operations completed without error */
+    uint64_t reconnects; /* Control connections reopened after an error */
+};
+
+/* A session thread; see run_session(). */
+struct session_arg {
+    const struct bench_config *cfg;
+    unsigned id;
+    struct session_result result;
+};
+
+/* Names of the commands in enum bench_cmd order. */
+extern const char *const cmd_names[NCMDS];
+
+/* Store a file of size bytes at path on the server. Returns false on error. */
+bool upload_file(const struct bench_config *cfg, const char *path, size_t size);
+/*
+ * Thread function running one session against the server until cfg->stop is
+ * set. The argument is a struct session_arg whose result is filled in.
+ */
+void *run_session(void *arg);
+
+#endif /* FTPB_SESSION_H */
@@ -20,7 +20,6 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
-#include <regex.h>
 #include <pthread.h>
 #include <errno.h>
 #include <string.h>
@@ -31,24 +30,49 @@
 #include "vector.h"
 #include "misc.h"
 
-/* Socket buffer for the PI. */
-static struct sockbuf pi_buf = {0};
+/* Socket buffer for the PI. Each thread runs at most one control connection. */
+static __thread struct sockbuf pi_buf = {0};
+
+/* True on threads set up by ftp_worker_init(). */
+static __thread bool worker;
+
+/* Set up the calling thread to run its own control connection. */
+void ftp_worker_init(void) {
+    pi_buf.i = 0;
+    pi_buf.size = 0;
+    worker = true;
+}
 
 /*
- * Wrapper function for getting characters from the PI.
+ * Wrapper function for getting the next line from the PI. The trailing "\r",
+ * if any, is excluded from line. Returns -1 if the connection failed on a
+ * worker thread.
  */
-static char pi_getchar(int sockfd) {
-    int ret = getchar_from_sock(sockfd, &pi_buf);
-    if (ret == 0) {
+static int pi_getline(int sockfd, struct sockline *line) {
+    int ret = sockbuf_read_line(sockfd, &pi_buf, line);
+    if (ret <= 0 && worker) {
+        logwarn("Worker control connection failed");
+        return -1;
+    } else if (ret == 0) {
         loginfo("user-server PI connection closed by server");
         puts("Connection closed by server");
         exit(EXIT_SUCCESS);
-    } else if (ret < -1) {
+    } else if (ret < 0) {
         perror(FTPC_EXE_NAME": Error while reading socket");
         logerr("Error while reading data from user-PI socket");
         exit(EXIT_FAILURE);
     }
-    return ret;
+    if (line->len > 0 && line->text[line->len-1] == '\r') {
+        line->len--;
+    }
+    return 0;
+}
+
+/* Append len bytes of text to vec. */
+static void append_text(struct vector *vec, const char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        vector_append(vec, text[i]);
+    }
 }
 
 /* Thread function to accept a connection and return the connecting socket. */
@@ -119,9 +143,9 @@ static int do_PASV(int sockpi) {
     socklen_t addrlen;
     if (ftp_pos_completion(code)) {
         parse_remote_sockaddr(reply_msg.arr, &addr, &addrlen);
-        puts(reply_msg.arr);
+        if (!worker) puts(reply_msg.arr);
     } else {
-        puts("Error executing command. See log");
+        if (!worker) puts("Error executing command. See log");
         close(sockdtp);
         sockdtp = -1;
         goto exit;
@@ -157,12 +181,12 @@ static int do_EPSV(int sockpi, const char *ipstr) {
     /* Send EPSV and wait for reply */
     enum reply_code code = ftp_EPSV(sockpi, &reply_msg);
     if (ftp_pos_completion(code)) {
-        puts(reply_msg.arr);
+        if (!worker) puts(reply_msg.arr);
         strtok(reply_msg.arr, "|");
         char *port_str = strtok(NULL, "|");
         port = atoi(port_str);
     } else {
-        puts("Error executing command. See log");
+        if (!worker) puts("Error executing command. See log");
         close(sockdtp);
         sockdtp = -1;
         goto exit;
@@ -357,71 +381,40 @@ int accept_server(int sockpi, unsigned int delivery_option, pthread_t *tid) {
     return 0;
 }
 
-/* Parse multi-line reply from FTP Server. */
-static void parse_multi_line_reply(struct vector *reply_msg, int sockfd, enum reply_code code) {
-    regex_t pattern_buf;
-    char pattern[64];  /* Generous considering code will only be 3 characters */
-    sprintf(pattern, "\n%d .*\r$", code);
-    if (regcomp(&pattern_buf, pattern, REG_EXTENDED | REG_NOSUB)) {
-        fputs(FTPC_EXE_NAME": Invalid regex", stderr);
-        exit(EXIT_FAILURE);
-    }
-    char ch;
-    while (true) {
-        ch = pi_getchar(sockfd);
-        if (ch == '\n') {
-            /* Check buffered message for the appropriate end sequence */
-            vector_append(reply_msg, '\0');
-            if (!regexec(&pattern_buf, reply_msg->arr, 0, NULL, 0)) {
-                /* We've found the end sequence; replace '\r' with '\0' */
-                (reply_msg->size) -= 2;
-                vector_append(reply_msg, '\0');
-                break;
-            }
-            (reply_msg->size)--;
-        }
-        vector_append(reply_msg, ch);
-    }
-    regfree(&pattern_buf);
-}
-
-/* Parse single-line reply from FTP Server. */
-static void parse_single_line_reply(struct vector *reply_msg, int sockfd) {
-    char ch;
-    while (true) {
-        ch = pi_getchar(sockfd);
-        if (ch == '\n' && reply_msg->arr[reply_msg->size-1] == '\r') {
-            /* We've found "\r\n"! Replace '\r' with '\0' */
-            reply_msg->size--;
-            vector_append(reply_msg, '\0');
-            break;
-        }
-        vector_append(reply_msg, ch);
-    }
-}
-
 /*
  * Wait for a reply from the server and return the reply code. Optionally, a
  * struct vector may be passed in to get the reply message text.
  */
 enum reply_code wait_for_reply(const int sockfd, struct vector *out_msg) {
-    char reply_code_buf[4];
-    reply_code_buf[3] = '\0';
     struct vector reply_msg;
     vector_create(&reply_msg, 64, 2);
 
-    /* Get first 3 characters to get reply code */
-    for (int i = 0; i < 3; i++) {
-        reply_code_buf[i] = pi_getchar(sockfd);
+    /* The first line starts with the reply code */
+    struct sockline line;
+    if (pi_getline(sockfd, &line) == -1) {
+        vector_free(&reply_msg);
+        return FTP_NO_REPLY;
     }
+    char reply_code_buf[4] = {0};
+    memcpy(reply_code_buf, line.text, line.len < 3 ? line.len : 3);
     enum reply_code code = atoi(reply_code_buf);
 
-    /* Parse reply text */
-    if (pi_getchar(sockfd) == '-') {
-        parse_multi_line_reply(&reply_msg, sockfd, code);
-    } else {
-        parse_single_line_reply(&reply_msg, sockfd);
+    /* Parse reply text; a multi-line reply ends with a line starting "<code> " */
+    bool multiline = line.len > 3 && line.text[3] == '-';
+    if (line.len > 4) {
+        append_text(&reply_msg, &line.text[4], line.len - 4);
+    }
+    while (multiline) {
+        if (pi_getline(sockfd, &line) == -1) {
+            vector_free(&reply_msg);
+            return FTP_NO_REPLY;
+        }
+        append_text(&reply_msg, "\r\n", 2);
+        append_text(&reply_msg, line.text, line.len);
+        multiline = !(line.len >= 4 && memcmp(line.text, reply_code_buf, 3) == 0 &&
+                      line.text[3] == ' ');
     }
+    vector_append(&reply_msg, '\0');
     loginfo("Received: %u %s", code, reply_msg.arr);
     if (out_msg) {
         vector_append_str(out_msg, reply_msg.arr);
@@ -431,7 +424,7 @@ enum reply_code wait_for_reply(const int sockfd, struct vector *out_msg) {
 
     /* Handle FTP_SERVER_NA here since this should always mean the client
        should quit */
-    if (code == FTP_SERVER_NA) {
+    if (code == FTP_SERVER_NA && !worker) {
         puts("Server not available or is shutting down");
         exit(EXIT_SUCCESS);
     }
@@ -640,3 +633,50 @@ enum reply_code ftp_EPSV(int sockfd, struct vector *out_msg) {
     send(sockfd, msg, strlen(msg), 0);
     return wait_for_reply(sockfd, out_msg);
 }
+
+/* Send a MODE request and await a reply. mode is the transfer mode letter. */
+enum reply_code ftp_MODE(int sockfd, char mode) {
+    char msg[] = "MODE ?\r\n";
+    msg[5] = mode;
+    loginfo("Sent: MODE %c", mode);
+    send(sockfd, msg, strlen(msg), 0);
+    return wait_for_reply(sockfd, NULL);
+}
+
+/*
+ * Send a SIZE request and await a reply. On a positive reply the size of the
+ * remote file is stored in size.
+ */
+enum reply_code ftp_SIZE(int sockfd, const char *path, uint64_t *size) {
+    struct vector msg, reply_msg;
+    vector_create(&msg, 64, 2);
+    vector_create(&reply_msg, 32, 2);
+    vector_append_str(&msg, "SIZE ");
+    vector_append_str(&msg, path);
+    vector_append(&msg, '\0');
+    loginfo("Sent: %s", msg.arr);
+    msg.size--;
+    vector_append_str(&msg, "\r\n");
+    send(sockfd, msg.arr, msg.size, 0);
+    vector_free(&msg);
+    enum reply_code reply = wait_for_reply(sockfd, &reply_msg);
+    if (ftp_pos_completion(reply)) {
+        char *end;
+        *size = strtoull(reply_msg.arr, &end, 10);
+        if (end == reply_msg.arr) {
+            logwarn("Malformed SIZE reply");
+            reply = FTP_NO_REPLY;
+        }
+    }
+    vector_free(&reply_msg);
+    return reply;
+}
+
+/* Send a REST request and await a reply. */
+enum reply_code ftp_REST(int sockfd, uint64_t offset) {
+    char msg[32];
+    snprintf(msg, sizeof msg, "REST %"PRIu64"\r\n", offset);
+    loginfo("Sent: REST %"PRIu64, offset);
+    send(sockfd, msg, strlen(msg), 0);
+    return wait_for_reply(sockfd, NULL);
+}
@@ -35,12 +35,15 @@
 
 /* FTP server reply codes. */
 enum reply_code {
+    FTP_NO_REPLY = 0,  /* Control connection failed in a worker thread */
     FTP_SERVER_BUSY = 120,
     FTP_SUPERFLUOUS = 202,
     FTP_SERVER_READY = 220,
     FTP_USER_LOGGED_IN = 230,
+    FTP_FILE_STATUS = 213,
     FTP_NEED_PASS = 331,
     FTP_NEED_ACCT = 332,
+    FTP_FILE_PENDING = 350,
     FTP_SERVER_NA = 421,
     FTP_NO_DATA_CONN = 425,
     FTP_CONN_CLOSED = 426,
@@ -52,6 +55,13 @@ enum reply_code {
     FTP_USER_LOGIN_FAIL = 530,
 };
 
+/*
+ * Prepare the calling thread to run a control connection of its own. Data
+ * buffered from an earlier connection on the thread is dropped, and from now
+ * on a failed connection makes functions return FTP_NO_REPLY or -1 instead of
+ * exiting, and nothing is printed.
+ */
+void ftp_worker_init(void);
 int connect_to_dtp(int sockpi, unsigned int delivery_option, const char *ripstr);
 int accept_server(int sockpi, unsigned int deliv_opt, pthread_t *tid);
 enum reply_code wait_for_reply(const int sockfd, struct vector *out_msg);
@@ -69,5 +79,8 @@ enum reply_code ftp_RETR(int sockfd, const char *path, struct vector *reply_msg)
 enum reply_code ftp_STOR(int sockfd, const char *path, struct vector *reply_msg);
 enum reply_code ftp_EPRT(int sockfd, int family, const char *ipstr, const uint16_t port);
 enum reply_code ftp_EPSV(int sockfd, struct vector *out_msg);
+enum reply_code ftp_MODE(int sockfd, char mode);
+enum reply_code ftp_SIZE(int sockfd, const char *path, uint64_t *size);
+enum reply_code ftp_REST(int sockfd, uint64_t offset);
 
 #endif /* FTPC_FTP_H */
@@ -133,7 +133,7 @@ static void init_conn(struct addrinfo *const addrlist) {
         }
     }
     char msg[] = "Failed to connect to any address";
-    logerr(msg);
+    logerr("%s", msg);
     printf(FTPC_EXE_NAME": %s\n", msg);
     exit(EXIT_FAILURE);
 }
@@ -161,6 +161,11 @@ int main(int argc, char *argv[]) {
     if (sigaction(SIGINT, &action, NULL)) {
         logwarn("Error setting signal handler for SIGINT");
     }
+    /* A dropped connection should fail the command, not kill the client */
+    action.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &action, NULL)) {
+        logwarn("Error ignoring SIGPIPE");
+    }
     struct addrinfo *addrlist;
     resolve_domain(hostname, &addrlist, port);
     init_conn(addrlist);
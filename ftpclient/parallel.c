@@ -0,0 +1,495 @@
+/*
+ * CS472 HW 2
+ * Jason R. Carrete
+ * parallel.c
+ *
+ * This module runs transfers over several extra control connections at once,
+ * each on its own thread. pget splits one download across TCP streams and
+ * batch transfers spread many files over a pool of sessions.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parallel.h"
+#include "ftp.h"
+#include "log.h"
+#include "vector.h"
+
+/* Attempts made at each range before giving up. */
+#define PGET_MAX_TRIES (3U)
+/* Smallest range worth its own session. */
+#define PGET_MIN_RANGE (1U << 20)
+/* Size of the receive buffer of each range. */
+#define PGET_BUFSIZ (256U << 10)
+/* Attempts made at each file of a batch, each on a fresh session. */
+#define BATCH_MAX_TRIES (2U)
+/* Size of the data buffer of each batch session. */
+#define BATCH_BUFSIZ (64U << 10)
+/* How often batch progress is printed. */
+#define BATCH_PROGRESS_NS (250000000L)
+
+/* A part of the remote file fetched by one session. */
+struct range {
+    const struct server_login *login;
+    const char *path;
+    int fd;           /* Local file the range is written into */
+    uint64_t start;   /* Offset of the range in the file */
+    uint64_t len;     /* Length of the range */
+    uint64_t done;    /* Bytes of the range saved so far */
+    int ret;          /* 0 once the whole range is saved, else -1 */
+};
+
+/* Files shared by the sessions of a batch transfer. */
+struct batch {
+    const struct server_login *login;
+    enum batch_dir dir;
+    char *const *paths;
+    size_t npaths;
+    size_t next;          /* Next file to hand out; guarded by lock */
+    pthread_mutex_t lock;
+    pthread_cond_t finished;  /* Signalled under lock when done changes */
+    size_t done;          /* Files finished, including failures; guarded by lock */
+    size_t failed;        /* Files that could not be transferred; atomic */
+    uint64_t bytes;       /* Bytes transferred so far; atomic */
+};
+
+/* Open a control connection to the server in login and log in. */
+int session_open(const struct server_login *login) {
+    ftp_worker_init();
+    int sock = socket(login->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        logwarn("Failed to create socket for extra session (socket: %s)", strerror(errno));
+        return -1;
+    }
+    if (connect(sock, (const struct sockaddr *)&login->addr, login->addrlen) == -1) {
+        logwarn("Failed to open extra session (connect: %s)", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    enum reply_code reply;
+    do {
+        reply = wait_for_reply(sock, NULL);
+    } while (reply == FTP_SERVER_BUSY);
+    if (reply == FTP_SERVER_READY) {
+        reply = ftp_USER(sock, login->uname);
+        if (ftp_pos_intermediate(reply)) {
+            reply = ftp_PASS(sock, login->passwd);
+        }
+    }
+    if (!ftp_pos_completion(reply)) {
+        logwarn("Failed to log in on extra session (reply %d)", reply);
+        close(sock);
+        return -1;
+    }
+    if (login->cwd) {
+        reply = ftp_CWD(sock, login->cwd);
+        if (!ftp_pos_completion(reply)) {
+            logwarn("Failed to change directory on extra session (reply %d)", reply);
+            close(sock);
+            return -1;
+        }
+    }
+    return sock;
+}
+
+/* Write len bytes of buf to fd at off. Returns -1 on error. */
+static int pwrite_all(int fd, const uint8_t *buf, size_t len, uint64_t off) {
+    for (size_t written = 0; written < len;) {
+        ssize_t n = pwrite(fd, &buf[written], len - written, off + written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            logerr("Failed to save some data to file (pwrite: %s)", strerror(errno));
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+/*
+ * Fetch the rest of range r on the logged in session sock, using buf
+ * (PGET_BUFSIZ bytes) for received data. Returns 0 once the whole range is
+ * saved, otherwise -1.
+ */
+static int fetch_range(int sock, struct range *r, uint8_t *buf) {
+    enum reply_code reply = ftp_REST(sock, r->start + r->done);
+    if (!ftp_pos_intermediate(reply)) {
+        return -1;
+    }
+    int sockdtp = connect_to_dtp(sock, FTPC_DO_PASV, NULL);
+    if (sockdtp < 0) {
+        return -1;
+    }
+    struct vector reply_msg;
+    vector_create(&reply_msg, 64, 2);
+    reply = ftp_RETR(sock, r->path, &reply_msg);
+    vector_free(&reply_msg);
+    if (!ftp_pos_preliminary(reply)) {
+        close(sockdtp);
+        return -1;
+    }
+    while (r->done < r->len) {
+        size_t want = r->len - r->done < PGET_BUFSIZ ? r->len - r->done : PGET_BUFSIZ;
+        ssize_t nread = recv(sockdtp, buf, want, 0);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        } else if (nread <= 0) {
+            logwarn("Data for %s ended %"PRIu64" bytes early",
+                    r->path, r->len - r->done);
+            break;
+        }
+        if (pwrite_all(r->fd, buf, nread, r->start + r->done) == -1) {
+            break;
+        }
+        r->done += nread;
+    }
+    /* Closing early ends the server's RETR with an error reply, which is fine */
+    close(sockdtp);
+    if (wait_for_reply(sock, NULL) == FTP_NO_REPLY) {
+        return -1;
+    }
+    return r->done == r->len ? 0 : -1;
+}
+
+/*
+ * Thread function fetching the range passed in arg, retrying it on a new
+ * session when an attempt fails.
+ */
+static void *fetch_range_worker(void *arg) {
+    struct range *r = arg;
+    r->ret = -1;
+    uint8_t *buf = malloc(PGET_BUFSIZ);
+    if (!buf) {
+        logerr("Failed to allocate buffer for range at %"PRIu64, r->start);
+        return NULL;
+    }
+    for (unsigned tries = 0; tries < PGET_MAX_TRIES && r->ret == -1; tries++) {
+        if (tries > 0) {
+            logwarn("Retrying range at %"PRIu64" of %s from byte %"PRIu64,
+                    r->start, r->path, r->start + r->done);
+        }
+        int sock = session_open(r->login);
+        if (sock == -1) {
+            continue;
+        }
+        r->ret = fetch_range(sock, r, buf);
+        if (r->ret == 0) {
+            ftp_QUIT(sock);
+        }
+        close(sock);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Download a remote file over several sessions at once. */
+int pget(const struct server_login *login, const char *path, uint64_t size,
+         const char *localpath, unsigned nstreams) {
+    int fd = open(localpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    /* Small files are not worth an extra session per range */
+    if (size / PGET_MIN_RANGE < nstreams) {
+        nstreams = size / PGET_MIN_RANGE > 0 ? size / PGET_MIN_RANGE : 1;
+    }
+    struct range *ranges = calloc(nstreams, sizeof *ranges);
+    pthread_t *tids = calloc(nstreams, sizeof *tids);
+    bool *started = calloc(nstreams, sizeof *started);
+    if (!ranges || !tids || !started) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    loginfo("Fetching %s (%"PRIu64" bytes) over %u sessions", path, size, nstreams);
+
+    /* Split the file evenly; the last range also takes the remainder */
+    const uint64_t per_range = size / nstreams;
+    for (unsigned i = 0; i < nstreams; i++) {
+        ranges[i] = (struct range){
+            .login=login,
+            .path=path,
+            .fd=fd,
+            .start=i * per_range,
+            .len=i + 1 < nstreams ? per_range : size - i * per_range,
+        };
+        if (pthread_create(&tids[i], NULL, fetch_range_worker, &ranges[i]) == 0) {
+            started[i] = true;
+        } else {
+            logerr("Failed to start thread for range %u", i);
+            ranges[i].ret = -1;
+        }
+    }
+    int ret = 0;
+    for (unsigned i = 0; i < nstreams; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+        if (ranges[i].ret == -1) {
+            logerr("Failed to fetch bytes %"PRIu64"-%"PRIu64" of %s", ranges[i].start,
+                   ranges[i].start + ranges[i].len, path);
+            ret = -1;
+        }
+    }
+    free(started);
+    free(tids);
+    free(ranges);
+    if (close(fd) == -1) {
+        perror("close");
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Return the part of path after the last '/'. */
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/* Send len bytes of buf on sockdtp. Returns -1 on error. */
+static int send_all(int sockdtp, const uint8_t *buf, size_t len) {
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = send(sockdtp, &buf[sent], len - sent, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            logwarn("Failed to send some data (send: %s)", strerror(errno));
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+/*
+ * Download the remote file path into the local working directory on the
+ * session sock. Returns -1 on error.
+ */
+static int batch_get(int sock, struct batch *b, const char *path, uint8_t *buf) {
+    int sockdtp = connect_to_dtp(sock, FTPC_DO_PASV, NULL);
+    if (sockdtp < 0) {
+        return -1;
+    }
+    struct vector reply_msg;
+    vector_create(&reply_msg, 64, 2);
+    enum reply_code reply = ftp_RETR(sock, path, &reply_msg);
+    vector_free(&reply_msg);
+    if (!ftp_pos_preliminary(reply)) {
+        close(sockdtp);
+        return -1;
+    }
+    int ret = 0;
+    int fd = open(base_name(path), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        logerr("Failed to open %s for writing (open: %s)", base_name(path), strerror(errno));
+        ret = -1;
+    }
+    uint64_t off = 0;
+    ssize_t nread;
+    while (ret == 0 && (nread=recv(sockdtp, buf, BATCH_BUFSIZ, 0)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            logwarn("Error receiving %s (recv: %s)", path, strerror(errno));
+            ret = -1;
+        } else if (pwrite_all(fd, buf, nread, off) == -1) {
+            ret = -1;
+        } else {
+            off += nread;
+            __atomic_fetch_add(&b->bytes, nread, __ATOMIC_RELAXED);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    close(sockdtp);
+    reply = wait_for_reply(sock, NULL);
+    if (!ftp_pos_completion(reply)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Upload the local file path into the remote working directory on the session
+ * sock. Returns -1 on error.
+ */
+static int batch_put(int sock, struct batch *b, const char *path, uint8_t *buf) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        logerr("Failed to open %s for reading (open: %s)", path, strerror(errno));
+        return -1;
+    }
+    int sockdtp = connect_to_dtp(sock, FTPC_DO_PASV, NULL);
+    if (sockdtp < 0) {
+        close(fd);
+        return -1;
+    }
+    struct vector reply_msg;
+    vector_create(&reply_msg, 64, 2);
+    enum reply_code reply = ftp_STOR(sock, base_name(path), &reply_msg);
+    vector_free(&reply_msg);
+    if (!ftp_pos_preliminary(reply)) {
+        close(sockdtp);
+        close(fd);
+        return -1;
+    }
+    int ret = 0;
+    ssize_t nread;
+    while (ret == 0 && (nread=read(fd, buf, BATCH_BUFSIZ)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            logerr("Error reading %s (read: %s)", path, strerror(errno));
+            ret = -1;
+        } else if (send_all(sockdtp, buf, nread) == -1) {
+            ret = -1;
+        } else {
+            __atomic_fetch_add(&b->bytes, nread, __ATOMIC_RELAXED);
+        }
+    }
+    close(fd);
+    close(sockdtp);
+    reply = wait_for_reply(sock, NULL);
+    if (!ftp_pos_completion(reply)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Thread function running one session of a batch. It takes files until none
+ * are left, moving to a fresh session after a failure.
+ */
+static void *batch_worker(void *arg) {
+    struct batch *b = arg;
+    uint8_t *buf = malloc(BATCH_BUFSIZ);
+    if (!buf) {
+        logerr("Failed to allocate buffer for batch session");
+        return NULL;
+    }
+    int sock = -1;
+    while (true) {
+        pthread_mutex_lock(&b->lock);
+        size_t i = b->next < b->npaths ? b->next++ : b->npaths;
+        pthread_mutex_unlock(&b->lock);
+        if (i == b->npaths) {
+            break;
+        }
+        int ret = -1;
+        for (unsigned tries = 0; tries < BATCH_MAX_TRIES && ret == -1; tries++) {
+            if (sock == -1 && (sock=session_open(b->login)) == -1) {
+                continue;
+            }
+            if (b->dir == BATCH_GET) {
+                ret = batch_get(sock, b, b->paths[i], buf);
+            } else {
+                ret = batch_put(sock, b, b->paths[i], buf);
+            }
+            if (ret == -1) {
+                /* The session may be in any state now; start over on a new one */
+                close(sock);
+                sock = -1;
+            }
+        }
+        if (ret == -1) {
+            logerr("Failed to transfer %s", b->paths[i]);
+            __atomic_fetch_add(&b->failed, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_lock(&b->lock);
+        b->done++;
+        pthread_cond_signal(&b->finished);
+        pthread_mutex_unlock(&b->lock);
+    }
+    if (sock != -1) {
+        ftp_QUIT(sock);
+        close(sock);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Print the progress of batch b on the current line. Called with lock held. */
+static void print_batch_progress(struct batch *b) {
+    printf("\r%zu/%zu files, %"PRIu64" bytes", b->done, b->npaths,
+           __atomic_load_n(&b->bytes, __ATOMIC_RELAXED));
+    fflush(stdout);
+}
+
+/* Transfer many files over a pool of sessions. */
+size_t batch_transfer(const struct server_login *login, enum batch_dir dir,
+                      char *const paths[], size_t npaths, unsigned nsessions) {
+    struct batch b = {
+        .login=login,
+        .dir=dir,
+        .paths=paths,
+        .npaths=npaths,
+    };
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.finished, NULL);
+    if (nsessions > npaths) {
+        nsessions = npaths;
+    }
+    pthread_t *tids = calloc(nsessions, sizeof *tids);
+    if (!tids) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    loginfo("Transferring %zu files over %u sessions", npaths, nsessions);
+    unsigned started = 0;
+    for (; started < nsessions; started++) {
+        if (pthread_create(&tids[started], NULL, batch_worker, &b) != 0) {
+            logwarn("Failed to start batch session %u", started);
+            break;
+        }
+    }
+    if (started == 0) {
+        logerr("Failed to start any batch session");
+        free(tids);
+        pthread_cond_destroy(&b.finished);
+        pthread_mutex_destroy(&b.lock);
+        return npaths;
+    }
+
+    /* Report progress as files finish, and at least every BATCH_PROGRESS_NS */
+    pthread_mutex_lock(&b.lock);
+    while (b.done < npaths) {
+        print_batch_progress(&b);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += BATCH_PROGRESS_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&b.finished, &b.lock, &deadline);
+    }
+    print_batch_progress(&b);
+    pthread_mutex_unlock(&b.lock);
+    putchar('\n');
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    pthread_cond_destroy(&b.finished);
+    pthread_mutex_destroy(&b.lock);
+    return b.failed;
+}
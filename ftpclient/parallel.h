@@ -0,0 +1,55 @@
+/*
+ * CS472 HW 2
+ * Jason R. Carrete
+ * parallel.h
+ *
+ * Header for parallel.c
+ */
+
+#ifndef FTPC_PARALLEL_H
+#define FTPC_PARALLEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* Server and account used to open extra control connections. */
+struct server_login {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    const char *uname;
+    const char *passwd;
+    const char *cwd;  /* Remote directory to change to, or NULL */
+};
+
+/*
+ * Open a control connection to the server in login and log in. The calling
+ * thread is set up with ftp_worker_init() first, so it must not be the REPL's
+ * thread. Returns the connected socket or -1 on failure.
+ */
+int session_open(const struct server_login *login);
+/*
+ * Download the size bytes of the remote file path into localpath over nstreams
+ * extra sessions, each fetching its own range with REST and RETR. A range that
+ * fails is resumed where it stopped on a new session, up to a few times.
+ * Returns 0 on success or -1 if any range could not be fetched.
+ */
+int pget(const struct server_login *login, const char *path, uint64_t size,
+         const char *localpath, unsigned nstreams);
+
+/* Direction of a batch transfer. */
+enum batch_dir {
+    BATCH_GET,  /* Download remote paths into the local working directory */
+    BATCH_PUT,  /* Upload local paths into the remote working directory */
+};
+
+/*
+ * Transfer every file in paths over a pool of nsessions extra sessions, each
+ * taking the next file when it finishes one. Files keep their base name at the
+ * destination. Progress is printed as files complete. Returns the number of
+ * files that could not be transferred.
+ */
+size_t batch_transfer(const struct server_login *login, enum batch_dir dir,
+                      char *const paths[], size_t npaths, unsigned nsessions);
+
+#endif  /* FTPC_PARALLEL_H */
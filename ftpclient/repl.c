@@ -15,7 +15,6 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
-#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -24,12 +23,22 @@
 #include <unistd.h>
 #include <string.h>
 #include <inttypes.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 #include "repl.h"
 #include "log.h"
 #include "vector.h"
 #include "ftp.h"
 #include "misc.h"
+#include "parallel.h"
+
+/* Default and largest number of extra sessions used by pget, mget and mput. */
+#define DEFAULT_SESSIONS (4U)
+#define MAX_SESSIONS (16U)
 
 /* Socket file descriptor for the user-PI. */
 static int sockpi;
@@ -49,6 +58,19 @@ static unsigned int delivery_option = FTPC_DO_PASV;
 /* Buffer for DTP data. */
 static struct sockbuf dtp_buf = {0};
 
+/* Credentials of the logged in user, used to open extra sessions. */
+static char *login_uname;
+static char *login_passwd;
+
+/* Number of extra sessions used by pget, mget and mput. */
+static unsigned nsessions = DEFAULT_SESSIONS;
+
+/* True if data transfers are compressed (MODE Z). */
+static bool compress_data = false;
+
+/* Size of the blocks passed to zlib when compressing or decompressing data. */
+#define DEFLATE_CHUNK (256U << 10)
+
 /* Read user input from stdin into the vector. Return 1 if EOF was reached. */
 static void get_input_str(struct vector *str) {
     int ch;
@@ -79,6 +101,8 @@ static enum reply_code login_with_credentials(void) {
     printf("Username: ");
     get_input_str(&str);
     enum reply_code reply = ftp_USER(sockpi, str.arr);
+    free(login_uname);
+    login_uname = strdup(str.arr);
     if (ftp_pos_completion(reply)) {
         puts("Username OK");
     } else if (ftp_pos_intermediate(reply)) {
@@ -87,6 +111,8 @@ static enum reply_code login_with_credentials(void) {
         str.size = 0;  /* Reset array */
         get_input_str(&str);  /* TODO Don't echo the password */
         reply = ftp_PASS(sockpi, str.arr);
+        free(login_passwd);
+        login_passwd = strdup(str.arr);
         if (ftp_pos_completion(reply)) {
             puts("Password OK");
         } else if (ftp_pos_intermediate(reply)) {
@@ -158,6 +184,110 @@ static void handle_system(void) {
     vector_free(&reply_msg);
 }
 
+/*
+ * Decompress the deflate stream received on sockdtp into out. Returns -1 on
+ * error.
+ */
+static int recv_inflate(int sockdtp, FILE *out) {
+    z_stream strm = {0};
+    uint8_t *in = malloc(DEFLATE_CHUNK);
+    uint8_t *buf = malloc(DEFLATE_CHUNK);
+    if (!in || !buf || inflateInit(&strm) != Z_OK) {
+        logerr("Failed to set up decompression");
+        free(in);
+        free(buf);
+        return -1;
+    }
+    int ret = 0;
+    int zret = Z_OK;
+    while (zret != Z_STREAM_END) {
+        ssize_t nread = recv(sockdtp, in, DEFLATE_CHUNK, 0);
+        if (nread <= 0) {
+            if (nread < 0) perror("recv");
+            logerr("Compressed data from server-DTP ended early");
+            ret = -1;
+            break;
+        }
+        strm.next_in = in;
+        strm.avail_in = nread;
+        do {
+            strm.next_out = buf;
+            strm.avail_out = DEFLATE_CHUNK;
+            zret = inflate(&strm, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+                logerr("Received corrupt compressed data");
+                ret = -1;
+                goto done;
+            }
+            size_t len = DEFLATE_CHUNK - strm.avail_out;
+            if (fwrite(buf, 1, len, out) < len) {
+                logwarn("May have failed to save all data to file");
+                ret = -1;
+                goto done;
+            }
+        } while (strm.avail_out == 0 && zret != Z_STREAM_END);
+    }
+
+    done:
+    inflateEnd(&strm);
+    free(in);
+    free(buf);
+    return ret;
+}
+
+/* Compress everything read from in and send it on sockdtp. Returns -1 on error. */
+static int send_deflate(FILE *in, int sockdtp) {
+    z_stream strm = {0};
+    uint8_t *buf = malloc(DEFLATE_CHUNK);
+    uint8_t *out = malloc(DEFLATE_CHUNK);
+    if (!buf || !out || deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        logerr("Failed to set up compression");
+        free(buf);
+        free(out);
+        return -1;
+    }
+    int ret = 0;
+    int flush;
+    do {
+        size_t nread = fread(buf, 1, DEFLATE_CHUNK, in);
+        if (ferror(in)) {
+            /* Leave the stream unfinished so the server does not take it as whole */
+            perror("fread");
+            logerr("Failed to read the file being uploaded");
+            ret = -1;
+            goto done;
+        }
+        flush = nread < DEFLATE_CHUNK ? Z_FINISH : Z_NO_FLUSH;
+        strm.next_in = buf;
+        strm.avail_in = nread;
+        do {
+            strm.next_out = out;
+            strm.avail_out = DEFLATE_CHUNK;
+            if (deflate(&strm, flush) == Z_STREAM_ERROR) {
+                logerr("Failed to compress data (deflate: %s)", strm.msg);
+                ret = -1;
+                goto done;
+            }
+            size_t len = DEFLATE_CHUNK - strm.avail_out;
+            for (size_t sent = 0; sent < len;) {
+                ssize_t n = send(sockdtp, &out[sent], len - sent, 0);
+                if (n <= 0) {
+                    perror("send");
+                    ret = -1;
+                    goto done;
+                }
+                sent += n;
+            }
+        } while (strm.avail_out == 0);
+    } while (flush != Z_FINISH);
+
+    done:
+    deflateEnd(&strm);
+    free(buf);
+    free(out);
+    return ret;
+}
+
 /* Handle ls repl command. */
 static void handle_ls(const char *path) {
     const bool rpassive = (delivery_option & FTPC_DO_PASV) == 1;
@@ -195,7 +325,10 @@ static void handle_ls(const char *path) {
         reply_msg.size = 0;
         reply = wait_for_reply(sockpi, &reply_msg);
     }
-    if (ftp_pos_completion(reply) || ftp_trans_neg(reply)) {
+    if ((ftp_pos_completion(reply) || ftp_trans_neg(reply)) && compress_data) {
+        recv_inflate(sockdtp, stdout);
+        puts(reply_msg.arr);
+    } else if (ftp_pos_completion(reply) || ftp_trans_neg(reply)) {
         int ch;
         /* Read stream of bytes from server-DTP */
         while ((ch=getchar_from_sock(sockdtp, &dtp_buf))) {
@@ -260,6 +393,17 @@ static void handle_extend(void) {
     print_delivery_opt();
 }
 
+/* Handle compress repl command. Toggles between MODE S and MODE Z. */
+static void handle_compress(void) {
+    enum reply_code reply = ftp_MODE(sockpi, compress_data ? 'S' : 'Z');
+    if (ftp_pos_completion(reply)) {
+        compress_data = !compress_data;
+        puts(compress_data ? "Compressed transfers enabled" : "Compressed transfers disabled");
+    } else {
+        puts("Server refused to change the transfer mode. See log");
+    }
+}
+
 /* Handle get repl command. path points to a remote file. */
 static void handle_get(const char *path) {
     if (!path) {
@@ -316,6 +460,13 @@ static void handle_get(const char *path) {
     while (ftp_pos_preliminary(reply)) {
         puts(reply_msg.arr);
         reply_msg.size = 0;
+        if (compress_data) {
+            if (recv_inflate(sockdtp, file) == -1) {
+                goto exit;
+            }
+            reply = wait_for_reply(sockpi, &reply_msg);
+            continue;
+        }
         ssize_t read;
         /* Read stream of bytes from server-DTP */
         while ((read=recv(sockdtp, databuf, BUFSIZ, 0))) {
@@ -343,6 +494,109 @@ static void handle_get(const char *path) {
     vector_free(&reply_msg);
 }
 
+/*
+ * Parse str as a number of extra sessions and store it in n. Prints an error
+ * and returns false if it is out of range.
+ */
+static bool parse_sessions(const char *str, unsigned *n) {
+    char *end;
+    unsigned long val = strtoul(str, &end, 10);
+    if (*end != '\0' || val < 1 || val > MAX_SESSIONS) {
+        printf("Number of sessions must be between 1 and %u\n", MAX_SESSIONS);
+        return false;
+    }
+    *n = val;
+    return true;
+}
+
+/*
+ * Fill login with the server address, credentials and working directory of
+ * this session for opening extra sessions. Returns false on error.
+ */
+static bool get_login(struct server_login *login) {
+    static char cwd[PATH_MAX];
+    login->addrlen = sizeof login->addr;
+    login->uname = login_uname ? login_uname : "";
+    login->passwd = login_passwd ? login_passwd : "";
+    login->cwd = NULL;
+    if (getpeername(sockpi, (struct sockaddr *)&login->addr, &login->addrlen) == -1) {
+        perror("getpeername");
+        return false;
+    }
+
+    /* The directory is the first line of the PWD reply, possibly quoted */
+    struct vector reply_msg;
+    vector_create(&reply_msg, 128, 2);
+    enum reply_code reply = ftp_PWD(sockpi, &reply_msg);
+    if (ftp_pos_completion(reply)) {
+        const char *dir = reply_msg.arr;
+        size_t len = strcspn(dir, "\r\n");
+        if (len >= 2 && dir[0] == '"') {
+            const char *quote = memchr(dir + 1, '"', len - 1);
+            dir++;
+            len = quote ? (size_t)(quote - dir) : len - 1;
+        }
+        if (len > 0 && len < sizeof cwd) {
+            memcpy(cwd, dir, len);
+            cwd[len] = '\0';
+            login->cwd = cwd;
+        }
+    }
+    vector_free(&reply_msg);
+    if (!login->cwd) {
+        puts("Could not get the remote working directory. See log");
+        return false;
+    }
+    return true;
+}
+
+/* Handle sessions repl command. Shows or sets the number of extra sessions. */
+static void handle_sessions(const char *nstr) {
+    if (nstr && !parse_sessions(nstr, &nsessions)) {
+        return;
+    }
+    printf("pget, mget and mput use %u sessions\n", nsessions);
+}
+
+/*
+ * Handle pget repl command. path points to a remote file downloaded over nstr
+ * extra sessions at once (the sessions setting if NULL).
+ */
+static void handle_pget(const char *path, const char *nstr) {
+    if (!path) {
+        puts("Path must not be NULL");
+        return;
+    }
+    unsigned nstreams = nsessions;
+    if (nstr && !parse_sessions(nstr, &nstreams)) {
+        return;
+    }
+    uint64_t size;
+    enum reply_code reply = ftp_SIZE(sockpi, path, &size);
+    if (!ftp_pos_completion(reply)) {
+        puts("Could not get the size of the remote file. See log");
+        return;
+    }
+    struct server_login login;
+    if (!get_login(&login)) {
+        return;
+    }
+
+    /* Ask for file save location */
+    printf("Save location: ");
+    struct vector in;
+    vector_create(&in, 128, 2);
+    get_input_str(&in);
+    uint64_t start = monotonic_ns();
+    if (pget(&login, path, size, in.arr, nstreams) == 0) {
+        double secs = (monotonic_ns() - start) / 1e9;
+        printf("Downloaded %"PRIu64" bytes in %.2f s\n", size, secs);
+    } else {
+        puts("Download failed. See log");
+    }
+    vector_free(&in);
+}
+
 /* Handle send repl command. path points to local file. */
 static void handle_send(const char *localpath) {
     /* Validate args and init variables */
@@ -397,8 +651,17 @@ static void handle_send(const char *localpath) {
     while (ftp_pos_preliminary(reply)) {
         puts(reply_msg.arr);
         reply_msg.size = 0;
+        if (compress_data && send_deflate(in_file, sockdtp) == -1) {
+            /* The server refuses the cut-short upload; read its reply before giving up */
+            close(sockdtp);
+            sockdtp = -1;
+            wait_for_reply(sockpi, &reply_msg);
+            puts(reply_msg.arr);
+            puts("Upload failed. See log");
+            goto exit;
+        }
         size_t read;
-        while ((read=fread(databuf, sizeof *databuf, BUFSIZ, in_file)) > 0) {
+        while (!compress_data && (read=fread(databuf, sizeof *databuf, BUFSIZ, in_file)) > 0) {
             if (send(sockdtp, databuf, read, 0) <= 0) {
                 perror("send");
                 goto exit;
@@ -419,6 +682,201 @@ static void handle_send(const char *localpath) {
     vector_free(&in);
 }
 
+/*
+ * Run LIST on path and return the listing in a temporary file positioned at
+ * its start, or NULL on error.
+ */
+static FILE *fetch_listing(const char *path) {
+    const bool rpassive = (delivery_option & FTPC_DO_PASV) == 1;
+    FILE *listing = tmpfile();
+    if (!listing) {
+        perror("tmpfile");
+        return NULL;
+    }
+
+    /* Connect to or wait for server */
+    enum reply_code reply;
+    struct vector reply_msg;
+    vector_create(&reply_msg, 128, 2);
+    int sockdtp = -1;
+    if (rpassive) {
+        sockdtp = connect_to_dtp(sockpi, delivery_option, ripstr);
+        if (sockdtp < 0) {
+            goto err;
+        }
+        reply = ftp_LIST(sockpi, path, &reply_msg);
+    } else {
+        pthread_t tid;
+        if (accept_server(sockpi, delivery_option, &tid) < 0) {
+            logerr("Error during accept_server");
+            goto err;
+        }
+        reply = ftp_LIST(sockpi, path, &reply_msg);
+        int *ret;
+        if (pthread_join(tid, (void **)&ret)) {
+            logerr("Error waiting for thread in join");
+            goto err;
+        }
+        sockdtp = *ret;
+        free(ret);
+    }
+    if (!ftp_pos_preliminary(reply)) {
+        goto err;
+    }
+
+    /* Save the listing, then wait for the transfer to complete */
+    if (compress_data) {
+        if (recv_inflate(sockdtp, listing) == -1) {
+            goto err;
+        }
+    } else {
+        int ch;
+        while ((ch=getchar_from_sock(sockdtp, &dtp_buf)) > 0) {
+            fputc(ch, listing);
+        }
+    }
+    reply_msg.size = 0;
+    reply = wait_for_reply(sockpi, &reply_msg);
+    if (!ftp_pos_completion(reply)) {
+        goto err;
+    }
+    close(sockdtp);
+    vector_free(&reply_msg);
+    rewind(listing);
+    return listing;
+
+    err:
+    if (sockdtp >= 0)
+        close(sockdtp);
+    vector_free(&reply_msg);
+    fclose(listing);
+    return NULL;
+}
+
+/* Free the npaths strings of paths and then paths. */
+static void free_paths(char **paths, size_t npaths) {
+    for (size_t i = 0; i < npaths; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+/* Run a batch transfer of paths and report how it went. */
+static void run_batch(enum batch_dir dir, char **paths, size_t npaths) {
+    if (npaths == 0) {
+        puts("No files match");
+        return;
+    }
+    struct server_login login;
+    if (!get_login(&login)) {
+        return;
+    }
+    uint64_t start = monotonic_ns();
+    size_t failed = batch_transfer(&login, dir, paths, npaths, nsessions);
+    double secs = (monotonic_ns() - start) / 1e9;
+    printf("%zu files transferred in %.2f s", npaths - failed, secs);
+    if (failed > 0) {
+        printf("; %zu failed. See log", failed);
+    }
+    putchar('\n');
+}
+
+/*
+ * Handle mget repl command. Downloads every remote file matching pattern, whose
+ * last component may contain glob(7) wildcards, into the working directory.
+ */
+static void handle_mget(const char *pattern) {
+    if (!pattern) {
+        puts("Pattern must not be NULL");
+        return;
+    }
+    /* Split into the directory to list and the pattern matched in it */
+    char dir[PATH_MAX] = "";
+    const char *name_pattern = pattern;
+    const char *slash = strrchr(pattern, '/');
+    if (slash) {
+        size_t len = slash - pattern + 1;
+        if (len >= sizeof dir) {
+            puts("Pattern too long");
+            return;
+        }
+        memcpy(dir, pattern, len);
+        dir[len] = '\0';
+        name_pattern = slash + 1;
+    }
+    FILE *listing = fetch_listing(slash ? dir : NULL);
+    if (!listing) {
+        puts("Failed to list remote directory. See log");
+        return;
+    }
+
+    char **paths = NULL;
+    size_t npaths = 0, cap = 0;
+    char name[PATH_MAX];
+    while (fgets(name, sizeof name, listing)) {
+        name[strcspn(name, "\r\n")] = '\0';
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+            fnmatch(name_pattern, name, FNM_PERIOD) != 0)
+        {
+            continue;
+        }
+        char *path = malloc(strlen(dir) + strlen(name) + 1);
+        if (!path) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(path, dir);
+        strcat(path, name);
+        if (npaths == cap) {
+            cap = cap ? cap * 2 : 64;
+            paths = realloc(paths, cap * sizeof *paths);
+            if (!paths) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        paths[npaths++] = path;
+    }
+    fclose(listing);
+    run_batch(BATCH_GET, paths, npaths);
+    free_paths(paths, npaths);
+}
+
+/*
+ * Handle mput repl command. Uploads every local regular file matching the
+ * glob(7) pattern into the remote working directory.
+ */
+static void handle_mput(const char *pattern) {
+    if (!pattern) {
+        puts("Pattern must not be NULL");
+        return;
+    }
+    glob_t matches;
+    int ret = glob(pattern, 0, NULL, &matches);
+    if (ret == GLOB_NOMATCH) {
+        puts("No files match");
+        return;
+    } else if (ret != 0) {
+        puts("Failed to expand pattern");
+        return;
+    }
+    char **paths = calloc(matches.gl_pathc, sizeof *paths);
+    if (!paths) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t npaths = 0;
+    for (size_t i = 0; i < matches.gl_pathc; i++) {
+        struct stat st;
+        if (stat(matches.gl_pathv[i], &st) == 0 && S_ISREG(st.st_mode)) {
+            paths[npaths++] = matches.gl_pathv[i];
+        }
+    }
+    run_batch(BATCH_PUT, paths, npaths);
+    free(paths);
+    globfree(&matches);
+}
+
 /* Start the REPL for the user-PI. */
 void repl(const int sockfd, const char *ipstr) {
     sockpi = sockfd;
@@ -461,9 +919,23 @@ void repl(const int sockfd, const char *ipstr) {
             handle_passive();
         } else if (strcmp(token, "extend") == 0) {
             handle_extend();
+        } else if (strcmp(token, "compress") == 0) {
+            handle_compress();
         } else if (strcmp(token, "get") == 0) {
             token = strtok(NULL, " \t");
             handle_get(token);
+        } else if (strcmp(token, "sessions") == 0) {
+            token = strtok(NULL, " \t");
+            handle_sessions(token);
+        } else if (strcmp(token, "mget") == 0) {
+            token = strtok(NULL, " \t");
+            handle_mget(token);
+        } else if (strcmp(token, "mput") == 0) {
+            token = strtok(NULL, " \t");
+            handle_mput(token);
+        } else if (strcmp(token, "pget") == 0) {
+            token = strtok(NULL, " \t");
+            handle_pget(token, strtok(NULL, " \t"));
         } else if (strcmp(token, "send") == 0) {
             token = strtok(NULL, " \t");
             handle_send(token);
@@ -5,59 +5,373 @@
  *
  * This module serves as an interface for authenticating clients attempting
  * to connect to the FTP server.
+ *
+ * The password file is compiled into an index file holding an open
+ * addressing hash table, which every process maps read-only and so shares
+ * through the page cache. A lookup hashes the name and probes the table in
+ * place without copying anything. On SIGHUP the index is compiled again and
+ * renamed over the old one, and each process maps the new file the next time
+ * it looks up a user.
  */
 
-#include "config.h"
-
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
-#include <search.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "log.h"
 #include "auth.h"
 
 #define AUTH_FILE "out/etc/ftps_passwd"
+#define AUTH_DB AUTH_FILE ".db"
+#define AUTH_DB_MAGIC "FTPSUDB1"
+#define MAX_FIELD_LEN (UINT16_MAX)
 
-/* Read passwords from the password file into a hashtable. */
-void auth_read_passwd(void) {
+/*
+ * Index file layout: a header, nslots slots and then the entries they point
+ * to. Each entry is a uint16_t name length, a uint16_t password length, the
+ * name, a null byte, the password and a null byte. Offsets are from the
+ * start of the file, so 0 marks an empty slot.
+ */
+struct db_header {
+    char magic[8];
+    uint32_t nslots;  /* A power of two, at least twice the number of users */
+    uint32_t nusers;
+    uint64_t size;    /* Size of the whole file */
+};
+
+struct db_slot {
+    uint32_t hash;
+    uint32_t offset;
+};
+
+/* A user read from the password file. */
+struct user {
+    char *name;
+    char *passwd;
+    uint16_t name_len;
+    uint16_t passwd_len;
+    uint32_t hash;
+};
+
+/* Number of times the index was compiled; shared by every process. */
+static _Atomic uint64_t *generation;
+/* This process's mapping of the index and the generation it was mapped at. */
+static const char *db;
+static size_t db_size;
+static uint64_t db_generation;
+
+/* Return the hash of the len bytes at name. */
+static uint32_t hash_name(const char *name, size_t len) {
+    uint32_t h = 2166136261U;  /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    }
+    return h;
+}
+
+/*
+ * Read the users in the password file into *users and store their number in
+ * count. Returns false on error.
+ */
+static bool read_users(struct user **users, size_t *count) {
     FILE *passwd_file = fopen(AUTH_FILE, "r");
     if (!passwd_file) {
-        logerr("Failed to open passwd file");
+        logerr("Main: failed to open passwd file (fopen: %s)", strerror(errno));
+        return false;
+    }
+    size_t n = 0, cap = 0;
+    struct user *list = NULL;
+    char *line = NULL;
+    size_t linecap = 0;
+    unsigned lineno = 0;
+    bool ok = true;
+    while (ok && getline(&line, &linecap, passwd_file) != -1) {
+        lineno++;
+        char *name = line;
+        while (isspace((unsigned char)*name)) {
+            name++;
+        }
+        if (*name == '\0') {
+            continue;
+        }
+        char *comma = strchr(name, ',');
+        if (!comma) {
+            logwarn("Main: ignoring line %u of passwd file; expected 'name,password'", lineno);
+            continue;
+        }
+        char *passwd = comma + 1;
+        size_t name_len = comma - name, passwd_len = strcspn(passwd, " \t\r\n");
+        if (name_len > MAX_FIELD_LEN || passwd_len > MAX_FIELD_LEN) {
+            logwarn("Main: ignoring line %u of passwd file; field too long", lineno);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct user *bigger = reallocarray(list, cap, sizeof *list);
+            if (!bigger) {
+                ok = false;
+                break;
+            }
+            list = bigger;
+        }
+        struct user *u = &list[n];
+        u->name = strndup(name, name_len);
+        u->passwd = strndup(passwd, passwd_len);
+        u->name_len = name_len;
+        u->passwd_len = passwd_len;
+        u->hash = hash_name(name, name_len);
+        if (!u->name || !u->passwd) {
+            free(u->name);
+            free(u->passwd);
+            ok = false;
+            break;
+        }
+        n++;
+    }
+    free(line);
+    if (ferror(passwd_file)) {
+        logerr("Main: failed to read passwd file");
+        ok = false;
+    } else if (!ok) {
+        logerr("Main: failed to allocate memory for users");
+    }
+    fclose(passwd_file);
+    *users = list;
+    *count = n;
+    return ok;
+}
+
+/*
+ * Look up the len bytes at name in the index at base of size bytes. Returns
+ * the entry or NULL if there is none.
+ */
+static const char *find_entry(const char *base, size_t size, const char *name, size_t len) {
+    const struct db_header *h = (const struct db_header *)base;
+    const struct db_slot *slots = (const struct db_slot *)(h + 1);
+    uint32_t hash = hash_name(name, len), mask = h->nslots - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t probes = 0; probes < h->nslots && slots[i].offset != 0; probes++) {
+        const char *entry = base + slots[i].offset;
+        uint16_t name_len;
+        if (slots[i].hash == hash && slots[i].offset + 2 * sizeof(uint16_t) + len < size) {
+            memcpy(&name_len, entry, sizeof name_len);
+            if (name_len == len && memcmp(entry + 2 * sizeof(uint16_t), name, len) == 0) {
+                return entry;
+            }
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Write the index of count users. Returns false on error. */
+static bool write_db(const struct user *users, size_t count) {
+    uint32_t nslots = 16;
+    while (nslots < 2 * count) {
+        nslots *= 2;
+    }
+    size_t size = sizeof(struct db_header) + (size_t)nslots * sizeof(struct db_slot);
+    for (size_t i = 0; i < count; i++) {
+        size += 2 * sizeof(uint16_t) + users[i].name_len + users[i].passwd_len + 2;
+    }
+    if (size > UINT32_MAX) {
+        logerr("Main: too many users in passwd file");
+        return false;
+    }
+    char *buf = calloc(1, size);
+    if (!buf) {
+        logerr("Main: failed to allocate memory for user index");
+        return false;
+    }
+    struct db_header *h = (struct db_header *)buf;
+    struct db_slot *slots = (struct db_slot *)(h + 1);
+    memcpy(h->magic, AUTH_DB_MAGIC, sizeof h->magic);
+    h->nslots = nslots;
+    h->size = size;
+    size_t end = sizeof *h + (size_t)nslots * sizeof *slots;
+    for (size_t i = 0; i < count; i++) {
+        const struct user *u = &users[i];
+        if (find_entry(buf, size, u->name, u->name_len)) {
+            logwarn("Main: user '%s' is listed more than once; using the first", u->name);
+            continue;
+        }
+        uint32_t j = u->hash & (nslots - 1);
+        while (slots[j].offset != 0) {
+            j = (j + 1) & (nslots - 1);
+        }
+        slots[j].hash = u->hash;
+        slots[j].offset = end;
+        memcpy(&buf[end], &u->name_len, sizeof u->name_len);
+        memcpy(&buf[end+2], &u->passwd_len, sizeof u->passwd_len);
+        end += 2 * sizeof(uint16_t);
+        memcpy(&buf[end], u->name, u->name_len + 1);
+        end += u->name_len + 1;
+        memcpy(&buf[end], u->passwd, u->passwd_len + 1);
+        end += u->passwd_len + 1;
+        h->nusers++;
+    }
+    h->size = end;
+
+    /* Replace the index atomically so a process mapping it never sees it half written */
+    const char *tmp = AUTH_DB ".tmp";
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd != -1;
+    for (size_t written = 0; ok && written < end; ) {
+        ssize_t n = write(fd, &buf[written], end - written);
+        ok = n != -1 || errno == EINTR;
+        written += n > 0 ? n : 0;
+    }
+    if (fd != -1 && close(fd) == -1) {
+        ok = false;
+    }
+    if (!ok || rename(tmp, AUTH_DB) == -1) {
+        logerr("Main: failed to write user index '%s' (%s)", AUTH_DB, strerror(errno));
+        unlink(tmp);
+        ok = false;
+    } else {
+        loginfo("Main: compiled %u users into '%s'", h->nusers, AUTH_DB);
+    }
+    free(buf);
+    return ok;
+}
+
+/* Compile the password file into the index. Returns false on error. */
+static bool compile_db(void) {
+    struct user *users;
+    size_t count;
+    bool ok = read_users(&users, &count) && write_db(users, count);
+    for (size_t i = 0; i < count; i++) {
+        free(users[i].name);
+        free(users[i].passwd);
+    }
+    free(users);
+    return ok;
+}
+
+/*
+ * Map the index in place of the current mapping. Returns false, keeping the
+ * current mapping, on error.
+ */
+static bool map_db(void) {
+    int fd = open(AUTH_DB, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        logerr("Main: failed to open user index (open: %s)", strerror(errno));
+        return false;
+    }
+    struct stat st;
+    const struct db_header *h = NULL;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof *h) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    h = map;
+    if (map == MAP_FAILED || memcmp(h->magic, AUTH_DB_MAGIC, sizeof h->magic) != 0 ||
+        h->size != (uint64_t)st.st_size || h->nslots == 0 || (h->nslots & (h->nslots - 1)) ||
+        sizeof *h + (uint64_t)h->nslots * sizeof(struct db_slot) > h->size)
+    {
+        logerr("Main: user index '%s' is invalid", AUTH_DB);
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        return false;
+    }
+    if (db) {
+        munmap((void *)db, db_size);
+    }
+    db = map;
+    db_size = st.st_size;
+    return true;
+}
+
+/* Return the entry for uname, after mapping the index again if it was recompiled. */
+static const char *lookup(const char *uname) {
+    uint64_t current = atomic_load_explicit(generation, memory_order_acquire);
+    if (current != db_generation) {
+        if (map_db()) {
+            loginfo("Main: reloaded user index in process %d", (int)getpid());
+        }
+        db_generation = current;  /* Don't retry a bad index on every lookup */
+    }
+    return find_entry(db, db_size, uname, strlen(uname));
+}
+
+/* Compile the index again each time SIGHUP arrives. */
+static void *run_reloader(__attribute__((unused)) void *arg) {
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    for (;;) {
+        int sig;
+        if (sigwait(&hup, &sig) != 0) {
+            continue;
+        }
+        loginfo("Main: got SIGHUP; reloading users");
+        if (compile_db()) {
+            atomic_fetch_add_explicit(generation, 1, memory_order_release);
+        } else {
+            logwarn("Main: keeping the previous users");
+        }
+    }
+    return NULL;
+}
+
+/* Compile the password file into the index, map it and reload it on SIGHUP. */
+void auth_read_passwd(void) {
+    generation = mmap(NULL, sizeof *generation, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (generation == MAP_FAILED) {
+        logerr("Main: failed to map user index generation (mmap: %s)", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    if (!hcreate(FTPS_MAX_USERS)) {
-        logerr("Failed to create user hash table");
+    if (!compile_db() || !map_db()) {
         exit(EXIT_FAILURE);
     }
-    char *uname, *passwd;
-    while (fscanf(passwd_file, " %m[^,],%ms", &uname, &passwd) != EOF) {
-        ENTRY item = {.key=uname, .data=passwd};
-        if (!hsearch(item, ENTER)) {
-            logerr("Too many users in ftps_passwd");
-            exit(EXIT_FAILURE);
-        }
-        /* Do not free uname and passwd. They need to exist for the
-           duration of the program */
+
+    /* Only the reloader takes SIGHUP; processes forked later inherit the mask */
+    sigset_t hup, all, old;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, run_reloader, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        logwarn("Main: users will not be reloaded on SIGHUP (pthread_create: %s)",
+                strerror(err));
+    } else {
+        pthread_detach(tid);
     }
-    fclose(passwd_file);
 }
 
 /* Return true if the uname is in the passwd database. */
 bool valid_user(const char *uname) {
-    char cpy[strlen(uname)+1];
-    strcpy(cpy, uname);
-    ENTRY sk = {.key=cpy};
-    ENTRY *found = hsearch(sk, FIND);
-    return (bool)found;
+    return lookup(uname) != NULL;
 }
 
 /* Return true if the passwd is correct for the given uname. */
 bool valid_password(const char *uname, const char *passwd) {
-    char cpy[strlen(uname)+1];
-    strcpy(cpy, uname);
-    ENTRY sk = {.key=cpy};
-    ENTRY *found = hsearch(sk, FIND);
-    return found && strcmp(found->data, passwd) == 0;
+    const char *entry = lookup(uname);
+    if (!entry) {
+        return false;
+    }
+    uint16_t name_len, passwd_len;
+    memcpy(&name_len, entry, sizeof name_len);
+    memcpy(&passwd_len, entry + sizeof name_len, sizeof passwd_len);
+    const char *stored = entry + 2 * sizeof(uint16_t) + name_len + 1;
+    return strlen(passwd) == passwd_len && memcmp(stored, passwd, passwd_len) == 0;
 }
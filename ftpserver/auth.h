@@ -11,9 +11,18 @@
 
 #include <stdbool.h>
 
-/* Read passwords from the password file into a hashtable. */
+/*
+ * Compile the password file into an index file and map it, and start a
+ * thread that compiles it again on SIGHUP. SIGHUP is blocked in the calling
+ * thread and every process forked from it afterwards. Must be called before
+ * forking. Quits with an error on failure.
+ */
 void auth_read_passwd(void);
-/* Return true if the uname is in the passwd database. */
+/*
+ * Return true if the uname is in the passwd database. The functions below
+ * map the index again first if it was recompiled, so they must not be called
+ * from two threads of a process at once.
+ */
 bool valid_user(const char *uname);
 /* Return true if the passwd is correct for the given uname. */
 bool valid_password(const char *uname, const char *passwd);
@@ -19,10 +19,38 @@
 
 #define CFG_FILE "out/etc/ftps.conf"
 #define MAX_LINE_LEN (128U)
+#define MAX_WORKERS (1024U)
+#define MAX_PORT (65535U)
+#define MAX_DEFLATE_LEVEL (9U)
+#define MAX_LIST_CACHE_SIZE (1048576U)
+#define MAX_METRICS_INTERVAL (86400U)
+#define MAX_RATE (1000000U)
+#define MAX_BURST (10000U)
+#define MAX_USER_SESSIONS (65535U)
+#define MAX_BANDWIDTH (100000000U)
 
 struct config ftps_config = {
     .port_mode_enabled=true,
-    .pasv_mode_enabled=true
+    .pasv_mode_enabled=true,
+    .server_mode=SERVER_MODE_FORK,
+    .workers=0,
+    .io_engine=IO_ENGINE_ZEROCOPY,
+    .pasv_min_port=0,
+    .pasv_max_port=0,
+    .deflate_level=6,
+    .list_cache_size=4096,
+    .log_level=LOG_LEVEL_INFO,
+    .log_format=LOG_FORMAT_TEXT,
+    .metrics_file=NULL,
+    .metrics_interval=10,
+    .ip_conn_rate=0,
+    .ip_conn_burst=10,
+    .ip_login_rate=0,
+    .ip_login_burst=10,
+    .user_max_sessions=0,
+    .session_rate=0,
+    .user_rate=0,
+    .global_rate=0
 };
 
 /* Return true if line is blank, otherwise false. */
@@ -50,6 +78,78 @@ static bool parse_value(const char *value, unsigned lineno) {
     }
 }
 
+/* Parse a value argument as an unsigned integer no greater than max. */
+static unsigned parse_unsigned(const char *value, unsigned max, unsigned lineno) {
+    char *end;
+    errno = 0;
+    unsigned long val = strtoul(value, &end, 10);
+    if (errno || *end != '\0' || !isdigit(*value) || val > max) {
+        logerr("Main: config file line %u invalid value '%s'", lineno, value);
+        exit(EXIT_FAILURE);
+    }
+    return val;
+}
+
+/*
+ * Parse a value argument as a server mode, FORK, EPOLL or PREFORK (ignores
+ * case).
+ */
+static enum server_mode parse_server_mode(const char *value, unsigned lineno) {
+    if (strcasecmp(value, "FORK") == 0) {
+        return SERVER_MODE_FORK;
+    } else if (strcasecmp(value, "EPOLL") == 0) {
+        return SERVER_MODE_EPOLL;
+    } else if (strcasecmp(value, "PREFORK") == 0) {
+        return SERVER_MODE_PREFORK;
+    } else {
+        logerr("Main: config file line %u invalid value '%s'", lineno, value);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Parse a value argument as an I/O engine, BLOCKING, ZEROCOPY or URING
+ * (ignores case).
+ */
+static enum io_engine parse_io_engine(const char *value, unsigned lineno) {
+    if (strcasecmp(value, "BLOCKING") == 0) {
+        return IO_ENGINE_BLOCKING;
+    } else if (strcasecmp(value, "ZEROCOPY") == 0) {
+        return IO_ENGINE_ZEROCOPY;
+    } else if (strcasecmp(value, "URING") == 0) {
+        return IO_ENGINE_URING;
+    } else {
+        logerr("Main: config file line %u invalid value '%s'", lineno, value);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Parse a value argument as a log level, INFO, WARN or ERROR (ignores case). */
+static enum log_level parse_log_level(const char *value, unsigned lineno) {
+    if (strcasecmp(value, "INFO") == 0) {
+        return LOG_LEVEL_INFO;
+    } else if (strcasecmp(value, "WARN") == 0) {
+        return LOG_LEVEL_WARN;
+    } else if (strcasecmp(value, "ERROR") == 0) {
+        return LOG_LEVEL_ERROR;
+    } else {
+        logerr("Main: config file line %u invalid value '%s'", lineno, value);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Parse a value argument as a log format, TEXT or BINARY (ignores case). */
+static enum log_format parse_log_format(const char *value, unsigned lineno) {
+    if (strcasecmp(value, "TEXT") == 0) {
+        return LOG_FORMAT_TEXT;
+    } else if (strcasecmp(value, "BINARY") == 0) {
+        return LOG_FORMAT_BINARY;
+    } else {
+        logerr("Main: config file line %u invalid value '%s'", lineno, value);
+        exit(EXIT_FAILURE);
+    }
+}
+
 /* Update ftps_config key with value. */
 static void update_cfg(const char *key, const char *value, unsigned lineno) {
     if (!(key && value)) {
@@ -60,6 +160,49 @@ static void update_cfg(const char *key, const char *value, unsigned lineno) {
         ftps_config.port_mode_enabled = parse_value(value, lineno);
     } else if (strcmp(key, "pasv_mode") == 0) {
         ftps_config.pasv_mode_enabled = parse_value(value, lineno);
+    } else if (strcmp(key, "server_mode") == 0) {
+        ftps_config.server_mode = parse_server_mode(value, lineno);
+    } else if (strcmp(key, "workers") == 0) {
+        ftps_config.workers = parse_unsigned(value, MAX_WORKERS, lineno);
+    } else if (strcmp(key, "io_engine") == 0) {
+        ftps_config.io_engine = parse_io_engine(value, lineno);
+    } else if (strcmp(key, "pasv_min_port") == 0) {
+        ftps_config.pasv_min_port = parse_unsigned(value, MAX_PORT, lineno);
+    } else if (strcmp(key, "pasv_max_port") == 0) {
+        ftps_config.pasv_max_port = parse_unsigned(value, MAX_PORT, lineno);
+    } else if (strcmp(key, "deflate_level") == 0) {
+        ftps_config.deflate_level = parse_unsigned(value, MAX_DEFLATE_LEVEL, lineno);
+    } else if (strcmp(key, "list_cache_size") == 0) {
+        ftps_config.list_cache_size = parse_unsigned(value, MAX_LIST_CACHE_SIZE, lineno);
+    } else if (strcmp(key, "log_level") == 0) {
+        ftps_config.log_level = parse_log_level(value, lineno);
+    } else if (strcmp(key, "log_format") == 0) {
+        ftps_config.log_format = parse_log_format(value, lineno);
+    } else if (strcmp(key, "metrics_file") == 0) {
+        free(ftps_config.metrics_file);
+        ftps_config.metrics_file = strdup(value);
+        if (!ftps_config.metrics_file) {
+            logerr("Main: failed to allocate memory for config");
+            exit(EXIT_FAILURE);
+        }
+    } else if (strcmp(key, "metrics_interval") == 0) {
+        ftps_config.metrics_interval = parse_unsigned(value, MAX_METRICS_INTERVAL, lineno);
+    } else if (strcmp(key, "ip_conn_rate") == 0) {
+        ftps_config.ip_conn_rate = parse_unsigned(value, MAX_RATE, lineno);
+    } else if (strcmp(key, "ip_conn_burst") == 0) {
+        ftps_config.ip_conn_burst = parse_unsigned(value, MAX_BURST, lineno);
+    } else if (strcmp(key, "ip_login_rate") == 0) {
+        ftps_config.ip_login_rate = parse_unsigned(value, MAX_RATE, lineno);
+    } else if (strcmp(key, "ip_login_burst") == 0) {
+        ftps_config.ip_login_burst = parse_unsigned(value, MAX_BURST, lineno);
+    } else if (strcmp(key, "user_max_sessions") == 0) {
+        ftps_config.user_max_sessions = parse_unsigned(value, MAX_USER_SESSIONS, lineno);
+    } else if (strcmp(key, "session_rate") == 0) {
+        ftps_config.session_rate = parse_unsigned(value, MAX_BANDWIDTH, lineno);
+    } else if (strcmp(key, "user_rate") == 0) {
+        ftps_config.user_rate = parse_unsigned(value, MAX_BANDWIDTH, lineno);
+    } else if (strcmp(key, "global_rate") == 0) {
+        ftps_config.global_rate = parse_unsigned(value, MAX_BANDWIDTH, lineno);
     }
 }
 
@@ -86,5 +229,20 @@ void read_cfg(void) {
         logerr("Main: at least one of port_mode or pasv_mode must be enabled in configuration");
         exit(EXIT_FAILURE);
     }
+    if ((ftps_config.pasv_min_port == 0) != (ftps_config.pasv_max_port == 0) ||
+        ftps_config.pasv_min_port > ftps_config.pasv_max_port)
+    {
+        logerr("Main: pasv_min_port and pasv_max_port must both be set with "
+               "pasv_min_port <= pasv_max_port");
+        exit(EXIT_FAILURE);
+    }
+    if (ftps_config.metrics_interval == 0) {
+        logerr("Main: metrics_interval must be at least 1");
+        exit(EXIT_FAILURE);
+    }
+    if (ftps_config.ip_conn_burst == 0 || ftps_config.ip_login_burst == 0) {
+        logerr("Main: ip_conn_burst and ip_login_burst must be at least 1");
+        exit(EXIT_FAILURE);
+    }
     loginfo("Main: configuration file loaded");
 }
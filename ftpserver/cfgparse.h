@@ -9,9 +9,44 @@
 #ifndef FTPS_CFGPARSE_H
 #define FTPS_CFGPARSE_H
 
+#include "log.h"
+
+/* How the server handles concurrent client connections. */
+enum server_mode {
+    SERVER_MODE_FORK,   /* One forked process per connection */
+    SERVER_MODE_EPOLL,  /* One process serving every connection with epoll */
+    SERVER_MODE_PREFORK,  /* Pre-forked epoll workers sharing the control port */
+};
+
+/* How file data is moved over the data connection. */
+enum io_engine {
+    IO_ENGINE_BLOCKING,  /* read(2)/send(2) one buffer at a time */
+    IO_ENGINE_ZEROCOPY,  /* sendfile(2)/splice(2) for regular files, otherwise BLOCKING */
+    IO_ENGINE_URING,     /* Batched io_uring(7) requests on registered buffers */
+};
+
 struct config {
     bool port_mode_enabled;
     bool pasv_mode_enabled;
+    enum server_mode server_mode;
+    unsigned workers;  /* Number of workers in prefork mode; 0 for one per CPU */
+    enum io_engine io_engine;
+    unsigned pasv_min_port;  /* First port of the passive port pool; 0 for none */
+    unsigned pasv_max_port;  /* Last port of the passive port pool */
+    unsigned deflate_level;  /* zlib compression level used in MODE Z */
+    unsigned list_cache_size;  /* KiB of listings cached per EPOLL/PREFORK process; 0 for none */
+    enum log_level log_level;  /* Least severe messages written to the log */
+    enum log_format log_format;
+    char *metrics_file;        /* Where metrics are exported; NULL for nowhere */
+    unsigned metrics_interval; /* Seconds between metrics exports */
+    unsigned ip_conn_rate;     /* Connections per minute from one address; 0 for no limit */
+    unsigned ip_conn_burst;    /* Connections from one address allowed at once */
+    unsigned ip_login_rate;    /* Login attempts per minute from one address; 0 for no limit */
+    unsigned ip_login_burst;   /* Login attempts from one address allowed at once */
+    unsigned user_max_sessions;  /* Sessions logged in as one user; 0 for no limit */
+    unsigned session_rate;     /* KiB/s of file data moved by one session; 0 for no limit */
+    unsigned user_rate;        /* KiB/s of file data moved as one user; 0 for no limit */
+    unsigned global_rate;      /* KiB/s of file data moved by the server; 0 for no limit */
 };
 
 /* Contains configuration information read from the ftps config. */
@@ -6,6 +6,8 @@
  * This module handles communication with a single connected client.
  */
 
+#define _GNU_SOURCE  /* O_PATH */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -17,10 +19,15 @@
 #include <limits.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -30,26 +37,46 @@
 #include "auth.h"
 #include "misc.h"
 #include "cfgparse.h"
+#include "transfer.h"
+#include "pasv.h"
+#include "facts.h"
+#include "listcache.h"
+#include "sandbox.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "shaper.h"
+#include "cmds_hash.h"
 
 #define DATA_ROOT_PREFIX "./out/srv/ftps"
 #define MAX_ARG_LEN (2048U)
 #define MAX_LOGIN_ATTEMPTS (3U)
+#define TELNET_IAC (255U)
+#define DATA_CONN_TIMEOUT_MS (30000)  /* How long PASV waits for the client to connect */
+
+/* Whether a command takes an argument. */
+enum cmd_args {
+    CMD_ARGS_NONE,
+    CMD_ARGS_ANY,
+};
+
+/* Command dispatch table entry; see cmds.def. */
+struct command {
+    char name[5];
+    void (*handler)(struct session *s, char *arg);
+    enum cmd_args args;
+    bool auth;      /* Must be logged in */
+    bool transfer;  /* Refused while a transfer is running */
+};
 
-/* Sorted (ascending) list of supported commands. */
-static const char *supported_cmds[] = {
-    "CDUP",
-    "CWD",
-    "EPRT",
-    "EPSV",
-    "LIST",
-    "PASS",
-    "PASV",
-    "PORT",
-    "PWD",
-    "QUIT",
-    "RETR",
-    "STOR",
-    "USER",
+#define FTP_CMD(verb, args, auth, transfer) static void handle_##verb(struct session *s, char *arg);
+#include "cmds.def"
+#undef FTP_CMD
+
+/* Supported commands in cmds.def order, indexed through cmd_hash_slots. */
+static const struct command commands[] = {
+#define FTP_CMD(verb, args, auth, transfer) {#verb, handle_##verb, args, auth, transfer},
+#include "cmds.def"
+#undef FTP_CMD
 };
 
 /* Server reply codes. */
@@ -59,9 +86,12 @@ enum reply_code {
     OPENING_CONN    = 150,
     COMMAND_OK      = 200,
     SUPERFLUOUS     = 202,
+    SYSTEM_STATUS   = 211,
+    FILE_STATUS     = 213,
     SYST_TYPE       = 215,
     SERVER_READY    = 220,
     CLOSING_CONN    = 221,
+    ABORT_OK        = 225,
     TX_COMPLETE     = 226,
     PASV_MODE       = 227,
     EPSV_MODE       = 229,
@@ -69,6 +99,7 @@ enum reply_code {
     FILE_ACT_OK     = 250,
     PATH_CREATED    = 257,
     NEED_PASS       = 331,
+    FILE_PENDING    = 350,
     SERVER_NA       = 421,
     NO_DATA_CONN    = 425,
     CONN_CLOSED     = 426,
@@ -78,34 +109,71 @@ enum reply_code {
     SYNTAX_ERR_ARGS = 501,
     CMD_NOT_IMPL    = 502,
     BAD_SEQ         = 503,
+    ARG_NOT_IMPL    = 504,
     EXTENDED_ERR    = 522,
     USER_LOGIN_FAIL = 530,
     NO_ACTION_PERM  = 550,
 };
 
-/* Buffer for data received from server-PI. */
-static struct sockbuf pi_buf = {0};
-
-/* True while the loop is running. Set to false to stop the loop. */
-static bool loop_running = true;
+/* Kinds of transfer run over the data connection. */
+enum transfer_kind {
+    XFER_LIST,
+    XFER_MLSD,
+    XFER_RETR,
+    XFER_STOR,
+};
 
-/* Absolute path of the server data directory */
-static char root[PATH_MAX];
-/* State for the client connection. */
-static struct {
+/* State for a single client connection. */
+struct session {
+    struct sockbuf pi_buf;    /* Buffer for data received from user-PI */
+    struct vector replies;    /* Replies not yet sent; guarded by reply_lock */
     char cwd[PATH_MAX];       /* Current working directory */
+    int cwd_fd;               /* cwd, open with O_PATH */
     char uname[MAX_ARG_LEN];  /* Username */
     struct sockaddr_storage port_addr;  /* Address used when PORT variant is issued */
     int id;                   /* Connection ID */
     int sockpi;               /* sockfd for protocol interpreter */
+    int pasv_sock;            /* Listen socket used in (e)passive mode */
+    int pasv_slot;            /* Passive port pool slot of pasv_sock or -1 */
+    int wake_fd;              /* eventfd written to interrupt a transfer waiting to accept */
     unsigned failed_logins;   /* Number of failed login attempts */
-    pthread_t listen_tid;     /* pthread ID for the thread listening in (e)passive mode */
+    uint64_t user_ticket;     /* Releases the session's count under user_max_sessions */
+    off_t rest_offset;        /* Offset set by REST for the next RETR or STOR */
+    unsigned cmd;             /* Index in commands of the command being handled */
+    uint64_t cmd_start;       /* When it was received, in microseconds */
+    pthread_mutex_t reply_lock;  /* Keeps replies from the control loop and transfer apart */
+    /*
+     * A transfer runs on xfer_tid so the control loop keeps handling commands.
+     * xfer_lock guards xfer_sock, xfer_aborted, xfer_done and quit_pending
+     * while xfer_pending is true.
+     */
+    pthread_t xfer_tid;
+    pthread_mutex_t xfer_lock;
+    enum transfer_kind xfer_kind;
+    int xfer_fd;              /* File sent or received by the transfer */
+    DIR *xfer_dir;            /* Directory read by the transfer on a cache miss */
+    char *xfer_path;          /* Path of xfer_dir */
+    struct listing *xfer_listing;  /* Cached listing sent by the transfer or NULL */
+    struct listcache_ticket xfer_ticket;  /* Where the listing read from xfer_dir is cached */
+    int xfer_sock;            /* Data connection of the transfer or -1 */
+    uint64_t xfer_bytes;      /* Bytes moved so far; read with an atomic load */
+    struct shaper shaper;     /* Bandwidth limits of file transfers */
+    unsigned xfer_cmd;        /* Index in commands of the command that started it */
+    uint64_t xfer_cmd_start;  /* When that command was received, in microseconds */
+    bool xfer_pending;        /* True while xfer_tid has not been joined */
+    bool cmd_deferred;        /* The transfer records the latency of the command */
+    bool xfer_aborted;        /* Set by ABOR to stop the transfer */
+    bool xfer_done;           /* Set by the transfer once its final reply is sent */
+    bool quit_pending;        /* QUIT arrived during the transfer */
+    bool loop_running;        /* True while the session is running. Set to false to stop */
+    bool pi_overflow;         /* True while discarding a command too long for pi_buf */
     bool dtp_ready;           /* True if the DTP is configured and ready for communication */
     bool passive;             /* True for passive mode, false for port mode */
     bool extended;            /* True for extended mode, false for normal mode */
     bool auth;                /* True when the client is authenticated */
     bool epsv_only;           /* True if EPSV ALL was received from the client */
-} state;
+    bool deflate;             /* True in MODE Z, false in MODE S */
+};
 
 /* Return a default reply string for a given reply code. */
 static char *default_reply_str(enum reply_code code) {
@@ -132,6 +200,8 @@ static char *default_reply_str(enum reply_code code) {
             return "\"PATHNAME\" created.";
         case FILE_ACT_OK:
             return "Requested file action okay, completed.";
+        case FILE_PENDING:
+            return "Requested file action pending further information.";
         case STARTING_TX:
             return "Data connection already open; transfer starting.";
         case TX_COMPLETE:
@@ -144,285 +214,470 @@ static char *default_reply_str(enum reply_code code) {
             return "Requested action aborted: local error in processing.";
         case CMD_NOT_IMPL:
             return "Command not implemented.";
+        case ARG_NOT_IMPL:
+            return "Command not implemented for that parameter.";
         case COMMAND_OK:
             return "Command okay.";
+        case CONN_CLOSED:
+            return "Connection closed; transfer aborted.";
         default:
             return "Acknowledged";
     }
 }
 
 /*
- * Send a reply to the client with the given reply code and optional single or
- * multi line message.
+ * Queue a reply to the client with the given reply code and optional single or
+ * multi line message. Queued replies are sent by flush_replies().
  */
-static void reply_with(enum reply_code code, const char *msg, bool multiline) {
+static void reply_with(struct session *s, enum reply_code code, const char *msg, bool multiline) {
     const char *text = msg ? msg : default_reply_str(code);
     char code_str[4];
     sprintf(code_str, "%d", code);
-    struct vector buf;
-    vector_create(&buf, 128, 2);
-    vector_append_str(&buf, code_str);
+    pthread_mutex_lock(&s->reply_lock);
+    struct vector *buf = &s->replies;
+    vector_append_str(buf, code_str);
     if (multiline) {
-        vector_append(&buf, '-');
+        vector_append(buf, '-');
     } else {
-        vector_append(&buf, ' ');
+        vector_append(buf, ' ');
     }
-    vector_append_str(&buf, text);
-    vector_append_str(&buf, "\r\n");
+    vector_append_str(buf, text);
+    vector_append_str(buf, "\r\n");
     if (multiline) {
-        vector_append_str(&buf, code_str);
-        vector_append(&buf, ' ');
-        vector_append_str(&buf, text);
-        vector_append_str(&buf, "\r\n");
+        vector_append_str(buf, code_str);
+        vector_append(buf, ' ');
+        vector_append_str(buf, text);
+        vector_append_str(buf, "\r\n");
     }
-    if (send(state.sockpi, buf.arr, buf.size, 0) == -1) {
-        logerr("Conn %d: failed to send reply (send: %s)", state.id, strerror(errno));
-    } else {
-        buf.size -= 2;
-        vector_append(&buf, '\0');
-        loginfo("Conn %d: sent reply '%s'", state.id, buf.arr);
+    pthread_mutex_unlock(&s->reply_lock);
+    loginfo("Conn %d: queued reply '%s%c%s'", s->id, code_str, multiline ? '-' : ' ', text);
+}
+
+/*
+ * Queue a multi line reply made of a first line with msg, the lines in body
+ * and a last line with the text End. Every line of body must end in CRLF and
+ * start with a space.
+ */
+static void reply_with_body(struct session *s, enum reply_code code, const char *msg,
+                            const char *body) {
+    char code_str[4];
+    sprintf(code_str, "%d", code);
+    pthread_mutex_lock(&s->reply_lock);
+    struct vector *buf = &s->replies;
+    vector_append_str(buf, code_str);
+    vector_append(buf, '-');
+    vector_append_str(buf, msg);
+    vector_append_str(buf, "\r\n");
+    vector_append_str(buf, body);
+    vector_append_str(buf, code_str);
+    vector_append_str(buf, " End\r\n");
+    pthread_mutex_unlock(&s->reply_lock);
+    loginfo("Conn %d: queued reply '%s-%s'", s->id, code_str, msg);
+}
+
+/*
+ * Send every queued reply to the client at once. If sockpi is non-blocking
+ * and its buffer fills up, the replies not yet sent stay queued for the next
+ * call. Returns true if nothing is left queued.
+ */
+static bool flush_replies(struct session *s) {
+    pthread_mutex_lock(&s->reply_lock);
+    struct vector *buf = &s->replies;
+    size_t sent = 0;
+    while (sent < buf->size) {
+        ssize_t n = send(s->sockpi, &buf->arr[sent], buf->size - sent, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            logerr("Conn %d: failed to send reply (send: %s)", s->id, strerror(errno));
+            sent = buf->size;
+            break;
+        }
+        sent += n;
     }
-    vector_free(&buf);
+    memmove(buf->arr, &buf->arr[sent], buf->size - sent);
+    buf->size -= sent;
+    bool flushed = buf->size == 0;
+    pthread_mutex_unlock(&s->reply_lock);
+    return flushed;
 }
 
-/* Wrapper for getchar_from_sock(.) that handles errors. */
-static char pi_getchar() {
-    int ch = getchar_from_sock(state.sockpi, &pi_buf);
-    if (ch == -1 && errno != EINTR) {
-        logerr("Conn %d: error in getchar_from_sock(.) (recv: %s)",
-               state.id, strerror(errno));
-        _exit(EXIT_FAILURE);
-    } else if (ch == 0) {
-        loginfo("Conn %d: connection closed by client", state.id);
-        _exit(EXIT_SUCCESS);
+/*
+ * Receive more data from the user-PI into pi_buf without discarding any data
+ * that has not been parsed yet. flags is passed on to recv(2). Returns the
+ * number of bytes received, 0 on EOF or -1 on error.
+ */
+static ssize_t pi_recv(struct session *s, int flags) {
+    ssize_t read = sockbuf_fill(s->sockpi, &s->pi_buf, flags);
+    if (read == -1 && errno == ENOBUFS) {
+        /* Drop what there is; the rest of the line is dropped once it arrives */
+        logwarn("Conn %d: command too long; discarding it", s->id);
+        s->pi_buf.i = 0;
+        s->pi_buf.size = 0;
+        s->pi_overflow = true;
+        read = sockbuf_fill(s->sockpi, &s->pi_buf, flags);
+    }
+    return read;
+}
+
+/*
+ * Open path, relative to the working directory, inside the server root with
+ * sandbox_open() and store its virtual path in vpath. Returns the file
+ * descriptor or -1 with errno set.
+ */
+static int open_path(struct session *s, const char *path, int flags, mode_t mode,
+                     char vpath[PATH_MAX]) {
+    int fd = sandbox_open(s->cwd_fd, s->cwd, path, flags, mode, vpath);
+    if (fd == -1) {
+        logwarn("Conn %d: failed to open '%s' (openat2: %s)", s->id, path, strerror(errno));
     }
-    return ch;
+    return fd;
+}
+
+/* Return true if err from open_path() means the path names nothing usable. */
+static bool bad_path(int err) {
+    return err == ENOENT || err == ENAMETOOLONG || err == EXDEV || err == ELOOP;
+}
+
+/* Stop listening for a passive data connection, if listening. */
+static void release_pasv(struct session *s) {
+    if (s->pasv_slot >= 0) {
+        pasv_release(s->pasv_slot);
+        s->pasv_slot = -1;
+    } else if (s->pasv_sock >= 0) {
+        close(s->pasv_sock);
+    }
+    s->pasv_sock = -1;
 }
 
 /*
- * Construct a valid path from the specified path into dst. Return 0 if path
- * is valid, otherwise return -1.
+ * Set pasv_sock to a socket listening for a data connection of address family
+ * af. A listener is leased from the passive port pool when one is configured.
+ * Returns 0 on success or -1 after replying to the client on error.
  */
-static int construct_valid_path(char dst[PATH_MAX], const char path[MAX_ARG_LEN]) {
-    strcpy(dst, root);
-    if (path[0] != '/') {
-        strcat(dst, state.cwd);
-    }
-    strcat(dst, path);
-    char buf[PATH_MAX];
-    if (!realpath(dst, buf)) {
-        logwarn("Conn %d: failed canonicalizing '%s' (realpath: %s)",
-                state.id, dst, strerror(errno));
+static int open_pasv_listener(struct session *s, int af) {
+    release_pasv(s);
+    if (ftps_config.pasv_min_port != 0) {
+        s->pasv_sock = pasv_lease(af, &s->pasv_slot);
+        if (s->pasv_sock != -1) {
+            return 0;
+        }
+        if (af != AF_INET) {
+            reply_with(s, EXTENDED_ERR, "Network protocol not supported, use (1)", false);
+        } else {
+            logwarn("Conn %d: no free passive port", s->id);
+            reply_with(s, NO_DATA_CONN, "No passive port available; try again later", false);
+        }
         return -1;
     }
-    strcpy(dst, buf);
-
-    /* Make sure path doesn't go below root */
-    char *common = strstr(dst, root);
-    if (common && strncmp(common, root, strlen(root)) == 0) {
-        return 0;   /* Valid path */
-    } else {
-        return -1;  /* Invalid path */
+    s->pasv_sock = socket(af, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->pasv_sock == -1) {
+        logerr("Conn %d: failed to create listen socket (socket: %s)",
+               s->id, strerror(errno));
+        reply_with(s, SYNTAX_ERR, "Server error", false);
+        return -1;
+    }
+    if (listen(s->pasv_sock, 10) == -1) {
+        logerr("Conn %d: failed to listen on socket (listen: %s)",
+               s->id, strerror(errno));
+        reply_with(s, SYNTAX_ERR, "Server error", false);
+        release_pasv(s);
+        return -1;
     }
+    return 0;
 }
 
-/* Thread function returning an accepted socket. */
-static void *accept_connection(void *arg) {
-    int *socklisten = arg;
-    int *sockdtp = malloc(sizeof *sockdtp);
-    loginfo("Conn %d: waiting for connection from client...", state.id);
-    *sockdtp = accept(*socklisten, NULL, NULL);
-    if (*sockdtp) {
-        loginfo("Conn %d: client data connection established", state.id);
+/* Return true if a and b hold the same IP address. */
+static bool same_host(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) {
+        return false;
+    } else if (a->ss_family == AF_INET) {
+        return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+               ((struct sockaddr_in *)b)->sin_addr.s_addr;
+    } else if (a->ss_family == AF_INET6) {
+        return memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+                      &((struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+    }
+    return false;
+}
+
+/*
+ * Wait for the client to connect to pasv_sock and return the data socket, or
+ * -1 on error, timeout or ABOR. Connections from any host other than the
+ * client are refused. The listener is released before returning.
+ */
+static int accept_pasv(struct session *s) {
+    struct sockaddr_storage client_addr;
+    socklen_t addrlen = sizeof client_addr;
+    if (getpeername(s->sockpi, (struct sockaddr *)&client_addr, &addrlen) == -1) {
+        logerr("Conn %d: failed to get client address (getpeername: %s)",
+               s->id, strerror(errno));
+        release_pasv(s);
+        return -1;
     }
-    close(*socklisten);
-    free(socklisten);
+    loginfo("Conn %d: waiting for connection from client...", s->id);
+    struct pollfd pfds[2] = {
+        {.fd=s->pasv_sock, .events=POLLIN},
+        {.fd=s->wake_fd, .events=POLLIN},  /* Written by ABOR */
+    };
+    int sockdtp = -1;
+    while (sockdtp == -1) {
+        int nready = poll(pfds, 2, DATA_CONN_TIMEOUT_MS);
+        if (nready == -1) {
+            if (errno == EINTR) continue;
+            logerr("Conn %d: error waiting for data connection (poll: %s)",
+                   s->id, strerror(errno));
+            break;
+        } else if (nready == 0) {
+            logwarn("Conn %d: timed out waiting for data connection", s->id);
+            break;
+        } else if (pfds[1].revents) {
+            break;  /* Aborted */
+        }
+        struct sockaddr_storage addr;
+        addrlen = sizeof addr;
+        int sock = accept(s->pasv_sock, (struct sockaddr *)&addr, &addrlen);
+        if (sock == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED)
+            {
+                logerr("Conn %d: error accepting data connection (accept: %s)",
+                       s->id, strerror(errno));
+                break;
+            }
+        } else if (!same_host(&addr, &client_addr)) {
+            logwarn("Conn %d: refused data connection from %s", s->id, addrtostr(&addr));
+            close(sock);
+        } else {
+            loginfo("Conn %d: client data connection established", s->id);
+            sockdtp = sock;
+        }
+    }
+    release_pasv(s);
     return sockdtp;
 }
 
-/* Connect to the client DTP and return the socket or -1 on error. */
-static int connect_to_dtp() {
+/*
+ * Connect to the client DTP and return the socket or -1 on error. The socket
+ * is published as xfer_sock before connecting so ABOR can interrupt it.
+ */
+static int connect_to_dtp(struct session *s) {
     int sockdtp = -1;
-    socklen_t addrlen = state.port_addr.ss_family == AF_INET ?
+    socklen_t addrlen = s->port_addr.ss_family == AF_INET ?
                         sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
-    if ((sockdtp=socket(state.port_addr.ss_family, SOCK_STREAM, 0)) == -1) {
-        logerr("Conn %d: failed to create socket (socket: %s)", state.id, strerror(errno));
-        sockdtp = -1;
+    if ((sockdtp=socket(s->port_addr.ss_family, SOCK_STREAM, 0)) == -1) {
+        logerr("Conn %d: failed to create socket (socket: %s)", s->id, strerror(errno));
+        return -1;
     }
-    if (connect(sockdtp, (struct sockaddr *)&state.port_addr, addrlen) == -1) {
+    pthread_mutex_lock(&s->xfer_lock);
+    s->xfer_sock = sockdtp;
+    pthread_mutex_unlock(&s->xfer_lock);
+    if (connect(sockdtp, (struct sockaddr *)&s->port_addr, addrlen) == -1) {
         logerr("Conn %d: failed to connect to client-dtp (connect: %s)",
-               state.id, strerror(errno));
+               s->id, strerror(errno));
+        pthread_mutex_lock(&s->xfer_lock);
+        s->xfer_sock = -1;
+        pthread_mutex_unlock(&s->xfer_lock);
         close(sockdtp);
         sockdtp = -1;
     }
     return sockdtp;
 }
 
+/* Look up the command whose verb, packed as for CMD_HASH, is verb. */
+static const struct command *find_command(uint32_t verb) {
+    unsigned i = cmd_hash_slots[CMD_HASH(verb)];
+    if (i == 0) {
+        return NULL;
+    }
+    const struct command *cmd = &commands[i-1];
+    uint32_t expected = 0;
+    for (size_t j = 0; cmd->name[j]; j++) {
+        expected |= (uint32_t)(uint8_t)cmd->name[j] << (8 * j);
+    }
+    return expected == verb ? cmd : NULL;
+}
+
 /*
- * Attempt to parse the next command sent from the client. Return -1 if the
- * command is malformed, otherwise return 0 and set cmd, and arg appropriately.
+ * Attempt to parse the next command buffered in pi_buf. Return NULL if the
+ * command is malformed or unsupported, otherwise return the command and set
+ * arg appropriately.
+ *
+ * Precondition: pi_buf holds a complete command line
  */
-static int get_next_cmd(char cmd[5], char arg[], size_t arglen) {
-    assert(cmd);
+static const struct command *get_next_cmd(struct session *s, char arg[], size_t arglen) {
     assert(arg);
-
-    /* Parse command string */
-    cmd[0] = toupper(pi_getchar());
-    cmd[1] = toupper(pi_getchar());
-    cmd[2] = toupper(pi_getchar());
-    cmd[3] = '\0';
-    if (!bsearch(cmd, supported_cmds, sizeof supported_cmds / sizeof *supported_cmds,
-                 sizeof *supported_cmds, bsearch_strcmp))
-    {
-        cmd[3] = toupper(pi_getchar());
-        cmd[4] = '\0';
-        if (!bsearch(cmd, supported_cmds, sizeof supported_cmds / sizeof *supported_cmds,
-                     sizeof *supported_cmds, bsearch_strcmp))
-        {
-            logwarn("Conn %d: unsupported command '%s'; resetting pi_buf", state.id, cmd);
-            pi_buf.i = 0;
-            pi_buf.size = 0;
-            reply_with(CMD_NOT_IMPL, NULL, false);
-            return -1;
-        }
+    struct sockline view;
+    if (!sockbuf_next_line(&s->pi_buf, &view)) {
+        return NULL;  /* Precondition not met; nothing to parse */
+    }
+    const char *line = view.text;
+    size_t len = view.len;
+    if (len == 0 || line[len-1] != '\r') {
+        s->pi_overflow = false;
+        goto err_syntax;
     }
-    char ch = pi_getchar();
-    if (ch == '\r') {
-        if (pi_getchar() == '\n') {
-            arg[0] = '\0';
-            return 0;
-        } else {
-            goto err_syntax;
-        }
+    len--;  /* Exclude "\r" */
+    if (s->pi_overflow) {
+        /* Tail of a command that did not fit in pi_buf */
+        s->pi_overflow = false;
+        goto err_syntax;
     }
-    if (strcmp(cmd, "ACCT") == 0) {
-        reply_with(SUPERFLUOUS, NULL, false);
-        pi_buf.i = 0;
-        pi_buf.size = 0;
-        return -2;
+    /* Skip Telnet commands such as the IP and Synch sent before ABOR */
+    while (len >= 2 && (uint8_t)line[0] == TELNET_IAC) {
+        line += 2;
+        len -= 2;
+    }
+
+    /* Parse command verb, packed into an integer for lookup */
+    char verb[5];
+    uint32_t key = 0;
+    size_t cmdlen;
+    for (cmdlen = 0; cmdlen < 4 && cmdlen < len && line[cmdlen] != ' '; cmdlen++) {
+        verb[cmdlen] = toupper((uint8_t)line[cmdlen]);
+        key |= (uint32_t)(uint8_t)verb[cmdlen] << (8 * cmdlen);
+    }
+    verb[cmdlen] = '\0';
+    const struct command *cmd = find_command(key);
+    if (!cmd) {
+        logwarn("Conn %d: unsupported command '%s'; discarding line", s->id, verb);
+        reply_with(s, CMD_NOT_IMPL, NULL, false);
+        return NULL;
+    }
+    if (cmdlen == len) {
+        arg[0] = '\0';
+        return cmd;
     }
 
     /* Parse optional argument */
-    if (ch != ' ') {
+    if (line[cmdlen] != ' ' || len - cmdlen - 1 >= arglen) {
         goto err_syntax;
     }
-    size_t i;
-    for (i = 0; i < arglen; i++) {
-        char ch = pi_getchar();
-        if (ch == '\n' && arg[i-1] == '\r') {
-            arg[i-1] = '\0';
-            return 0;
-        }
-        arg[i] = ch;
-    }
+    memcpy(arg, &line[cmdlen+1], len - cmdlen - 1);
+    arg[len-cmdlen-1] = '\0';
+    return cmd;
 
     err_syntax:
-    logwarn("Conn %d: invalid command or too long; resetting pi_buf", state.id);
-    /* TODO Instead of resetting the buffer, consider reading until a \r\n */
-    pi_buf.i = 0;
-    pi_buf.size = 0;
-    reply_with(SYNTAX_ERR, NULL, false);
-    return -1;
+    logwarn("Conn %d: invalid command or too long; discarding line", s->id);
+    reply_with(s, SYNTAX_ERR, NULL, false);
+    return NULL;
 }
 
-static void drop_client(void) {
-    reply_with(SERVER_NA, "Too many failed login attempts", false);
-    loop_running = false;
-    logwarn("Conn %d: too many failed login attemps; dropping", state.id);
+static void drop_client(struct session *s) {
+    reply_with(s, SERVER_NA, "Too many failed login attempts", false);
+    s->loop_running = false;
+    logwarn("Conn %d: too many failed login attemps; dropping", s->id);
+}
+
+/* Log the user out, if logged in. */
+static void logout(struct session *s) {
+    s->auth = false;
+    ratelimit_user_release(s->user_ticket);
+    s->user_ticket = 0;
 }
 
 /* Handle USER command from client. */
-static void handle_USER(const char uname[MAX_ARG_LEN]) {
-    state.auth = false;
+static void handle_USER(struct session *s, char *uname) {
+    logout(s);
     if (valid_user(uname)) {
-        strcpy(state.uname, uname);
-        reply_with(NEED_PASS, NULL, false);
+        strcpy(s->uname, uname);
+        reply_with(s, NEED_PASS, NULL, false);
     } else {
-        if (++state.failed_logins >= MAX_LOGIN_ATTEMPTS) {
-            drop_client();
+        metrics_add(METRIC_LOGINS_FAILED, 1);
+        if (++s->failed_logins >= MAX_LOGIN_ATTEMPTS) {
+            drop_client(s);
         } else {
-            reply_with(USER_LOGIN_FAIL, NULL, false);
+            reply_with(s, USER_LOGIN_FAIL, NULL, false);
         }
     }
 }
 
 /* Handle PASS command from client. */
-static void handle_PASS(const char passwd[MAX_ARG_LEN]) {
-    if (strlen(state.uname) > 0) {
-        if (valid_password(state.uname, passwd)) {
-            state.auth = true;
-            reply_with(USER_LOGGED_IN, NULL, false);
+static void handle_PASS(struct session *s, char *passwd) {
+    logout(s);
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof addr;
+    if (ftps_config.ip_login_rate != 0 &&
+        getpeername(s->sockpi, (struct sockaddr *)&addr, &addrlen) == 0 &&
+        !ratelimit_login(&addr))
+    {
+        logwarn("Conn %d: too many login attempts from %s; dropping", s->id, addrtostr(&addr));
+        reply_with(s, SERVER_NA, "Too many login attempts from your address; try again later",
+                   false);
+        s->loop_running = false;
+        return;
+    }
+    if (strlen(s->uname) > 0) {
+        if (valid_password(s->uname, passwd)) {
+            if (!ratelimit_user_acquire(s->uname, &s->user_ticket)) {
+                logwarn("Conn %d: user '%s' has too many sessions; dropping", s->id, s->uname);
+                reply_with(s, SERVER_NA, "Too many sessions for this user", false);
+                s->loop_running = false;
+                return;
+            }
+            s->auth = true;
+            reply_with(s, USER_LOGGED_IN, NULL, false);
         } else {
-            state.auth = false;
-            state.uname[0] = '\0';
-            if (++state.failed_logins >= MAX_LOGIN_ATTEMPTS) {
-                drop_client();
+            s->uname[0] = '\0';
+            metrics_add(METRIC_LOGINS_FAILED, 1);
+            if (++s->failed_logins >= MAX_LOGIN_ATTEMPTS) {
+                drop_client(s);
             } else {
-                reply_with(USER_LOGIN_FAIL, NULL, false);
+                reply_with(s, USER_LOGIN_FAIL, NULL, false);
             }
         }
     } else {
-        state.auth = false;
-        state.uname[0] = '\0';
-        if (++state.failed_logins >= MAX_LOGIN_ATTEMPTS) {
-            drop_client();
+        s->uname[0] = '\0';
+        if (++s->failed_logins >= MAX_LOGIN_ATTEMPTS) {
+            drop_client(s);
         } else {
-            reply_with(BAD_SEQ, NULL, false);
+            reply_with(s, BAD_SEQ, NULL, false);
         }
     }
 }
 
-/* Handle QUIT command from client. */
-static void handle_QUIT(void) {
-    reply_with(CLOSING_CONN, NULL, false);
+/* Handle PWD command from client. */
+static void handle_PWD(struct session *s, char *arg) {
+    reply_with(s, PATH_CREATED, s->cwd, false);
 }
 
-/* Handle PWD command from client. */
-static void handle_PWD(void) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
-        return;
-    }
-    reply_with(PATH_CREATED, state.cwd, false);
+/* Handle CDUP command from client. */
+static void handle_CDUP(struct session *s, char *arg) {
+    handle_CWD(s, "..");
 }
 
 /* Handle CWD command from client. */
-static void handle_CWD(const char path[MAX_ARG_LEN]) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
+static void handle_CWD(struct session *s, char *path) {
+    char vpath[PATH_MAX];
+    int fd = open_path(s, path, O_PATH | O_DIRECTORY, 0, vpath);
+    if (fd == -1 || faccessat(fd, ".", X_OK, 0) == -1) {
+        logwarn("Conn %d: failed to change directory to '%s'", s->id, path);
+        reply_with(s, NO_ACTION_PERM, "Cannot change to that path", false);
+        if (fd != -1) {
+            close(fd);
+        }
         return;
     }
-
-    char dst[PATH_MAX];
-    if (!construct_valid_path(dst, path)) {
-        if (chdir(dst) == 0) {
-            strcpy(state.cwd, dst+strlen(root));
-            strcat(state.cwd, "/");
-            loginfo("Conn %d: changed dir to '%s'; cwd=%s", state.id, dst, state.cwd);
-            reply_with(FILE_ACT_OK, NULL, false);
-        } else {
-            logwarn("Conn %d: failed to change directory (chdir %s)",
-                    state.id, strerror(errno));
-            reply_with(NO_ACTION_PERM, "Cannot change to that path", false);
-        }
-    } else {
-        logwarn("Conn %d: failed to change directory; illegal path '%s'", state.id, dst);
-        reply_with(NO_ACTION_PERM, "Cannot change to that path", false);
+    close(s->cwd_fd);
+    s->cwd_fd = fd;
+    strcpy(s->cwd, vpath);
+    if (vpath[1] != '\0') {
+        strcat(s->cwd, "/");
     }
+    loginfo("Conn %d: changed dir; cwd=%s", s->id, s->cwd);
+    reply_with(s, FILE_ACT_OK, NULL, false);
 }
 
 /* Handle PORT command from client. */
-static void handle_PORT(char *arg) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
-        return;
-    }
-    if (state.epsv_only) {
-        reply_with(SYNTAX_ERR, "Must use EPSV because EPSV ALL was previously specified", false);
+static void handle_PORT(struct session *s, char *arg) {
+    if (s->epsv_only) {
+        reply_with(s, SYNTAX_ERR, "Must use EPSV because EPSV ALL was previously specified", false);
         return;
     }
     if (!ftps_config.port_mode_enabled) {
-        reply_with(SYNTAX_ERR, "PORT is not allowed on the server", false);
+        reply_with(s, SYNTAX_ERR, "PORT is not allowed on the server", false);
         return;
     }
 
@@ -434,7 +689,7 @@ static void handle_PORT(char *arg) {
     char *tok = strtok(arg, ",");
     for (size_t i = 0; i < 4; i++, tok = strtok(NULL, ",")) {
         if (!tok || strlen(tok) > 3) {
-            reply_with(SYNTAX_ERR_ARGS, "Malformed port command", false);
+            reply_with(s, SYNTAX_ERR_ARGS, "Malformed port command", false);
             return;
         }
         strncat(ipv4, tok, 3);
@@ -442,41 +697,38 @@ static void handle_PORT(char *arg) {
             strcat(ipv4, ".");
     }
     if (!tok) {
-        reply_with(SYNTAX_ERR_ARGS, "Malformed port command", false);
+        reply_with(s, SYNTAX_ERR_ARGS, "Malformed port command", false);
         return;
     }
     unsigned msb = atoi(tok);
     tok = strtok(NULL, ",");
     if (!tok) {
-        reply_with(SYNTAX_ERR_ARGS, "Malformed port command", false);
+        reply_with(s, SYNTAX_ERR_ARGS, "Malformed port command", false);
         return;
     }
     unsigned lsb = atoi(tok);
     port = (msb << 8) | lsb;
-    loginfo("Conn %d: PORT address is %s:%"PRIu16, state.id, ipv4, port);
+    loginfo("Conn %d: PORT address is %s:%"PRIu16, s->id, ipv4, port);
 
     /* Update state */
-    state.port_addr.ss_family = AF_INET;
-    inet_pton(AF_INET, ipv4, &((struct sockaddr_in *)&state.port_addr)->sin_addr);
-    ((struct sockaddr_in *)&state.port_addr)->sin_port = htons(port);
-    state.dtp_ready = true;
-    state.passive = false;
-    state.extended = false;
-    reply_with(COMMAND_OK, NULL, false);
+    release_pasv(s);
+    s->port_addr.ss_family = AF_INET;
+    inet_pton(AF_INET, ipv4, &((struct sockaddr_in *)&s->port_addr)->sin_addr);
+    ((struct sockaddr_in *)&s->port_addr)->sin_port = htons(port);
+    s->dtp_ready = true;
+    s->passive = false;
+    s->extended = false;
+    reply_with(s, COMMAND_OK, NULL, false);
 }
 
 /* Handle EPRT command from client. */
-static void handle_EPRT(char *arg) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
-        return;
-    }
-    if (state.epsv_only) {
-        reply_with(SYNTAX_ERR, "Must use EPSV because EPSV ALL was previously specified", false);
+static void handle_EPRT(struct session *s, char *arg) {
+    if (s->epsv_only) {
+        reply_with(s, SYNTAX_ERR, "Must use EPSV because EPSV ALL was previously specified", false);
         return;
     }
     if (!ftps_config.port_mode_enabled) {
-        reply_with(SYNTAX_ERR, "EPRT is not allowed on the server", false);
+        reply_with(s, SYNTAX_ERR, "EPRT is not allowed on the server", false);
         return;
     }
 
@@ -486,84 +738,61 @@ static void handle_EPRT(char *arg) {
     in_port_t port = atoi(strtok(NULL, "|"));
 
     /* Update state */
+    release_pasv(s);
     unsigned af = family == 1 ? AF_INET : AF_INET6;
-    state.port_addr.ss_family = af;
+    s->port_addr.ss_family = af;
     switch (af) {
         case AF_INET:
-            inet_pton(af, ipstr, &((struct sockaddr_in *)&state.port_addr)->sin_addr);
-            ((struct sockaddr_in *)&state.port_addr)->sin_port = htons(port);
+            inet_pton(af, ipstr, &((struct sockaddr_in *)&s->port_addr)->sin_addr);
+            ((struct sockaddr_in *)&s->port_addr)->sin_port = htons(port);
             break;
         case AF_INET6:
-            inet_pton(af, ipstr, &((struct sockaddr_in6 *)&state.port_addr)->sin6_addr);
-            ((struct sockaddr_in *)&state.port_addr)->sin_port = htons(port);
+            inet_pton(af, ipstr, &((struct sockaddr_in6 *)&s->port_addr)->sin6_addr);
+            ((struct sockaddr_in *)&s->port_addr)->sin_port = htons(port);
             break;
     }
-    state.dtp_ready = true;
-    state.passive = false;
-    state.extended = true;
-    reply_with(COMMAND_OK, NULL, false);
+    s->dtp_ready = true;
+    s->passive = false;
+    s->extended = true;
+    reply_with(s, COMMAND_OK, NULL, false);
 }
 
 /* Handle PASV command from client. */
-static void handle_PASV(void) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
-        return;
-    }
-    if (state.epsv_only) {
-        reply_with(SYNTAX_ERR, "Must use EPSV because EPSV ALL was previously specified", false);
+static void handle_PASV(struct session *s, char *arg) {
+    if (s->epsv_only) {
+        reply_with(s, SYNTAX_ERR, "Must use EPSV because EPSV ALL was previously specified", false);
         return;
     }
     if (!ftps_config.pasv_mode_enabled) {
-        reply_with(SYNTAX_ERR, "PASV is not allowed on the server", false);
+        reply_with(s, SYNTAX_ERR, "PASV is not allowed on the server", false);
         return;
     }
 
     /* Create listen socket */
-    int *socklisten = malloc(sizeof *socklisten);
-    *socklisten = socket(AF_INET, SOCK_STREAM, 0);
-    if (*socklisten == -1) {
-        logerr("Conn %d: failed to create listen socket (socket: %s)",
-               state.id, strerror(errno));
-        reply_with(SYNTAX_ERR, "Server error", false);
-        goto err;
-    }
-    if (listen(*socklisten, 10) == -1) {
-        logerr("Conn %d: failed to listen on socket (listen: %s)",
-               state.id, strerror(errno));
-        reply_with(SYNTAX_ERR, "Server error", false);
-        goto err;
-    }
-
-    /* Start listen thread */
-    int err;
-    if ((err=pthread_create(&state.listen_tid, NULL, accept_connection, socklisten)) != 0) {
-        logerr("Conn %d: failed to start listen thread (pthread_create: %s)",
-               state.id, strerror(err));
-        reply_with(SYNTAX_ERR, "Server error", false);
-        goto err;
+    if (open_pasv_listener(s, AF_INET) == -1) {
+        return;
     }
 
     /* Construct reply */
     struct sockaddr_storage addr_for_ip;
     socklen_t addrlen_for_ip = sizeof addr_for_ip;
-    if (getsockname(state.sockpi, (struct sockaddr *)&addr_for_ip, &addrlen_for_ip) == -1) {
+    if (getsockname(s->sockpi, (struct sockaddr *)&addr_for_ip, &addrlen_for_ip) == -1) {
         logerr("Conn %d: failed to get server ip (getsockname: %s)",
-               state.id, strerror(errno));
-        reply_with(SYNTAX_ERR, "Server error", false);
+               s->id, strerror(errno));
+        reply_with(s, SYNTAX_ERR, "Server error", false);
         goto err;
     }
     if (addr_for_ip.ss_family != AF_INET) {
-        logerr("Conn %d: attempt to use PASV mode with IPv6 server not allowed");
-        reply_with(SYNTAX_ERR, "Cannot use PASV mode with IPv6 server", false);
+        logerr("Conn %d: attempt to use PASV mode with IPv6 server not allowed", s->id);
+        reply_with(s, SYNTAX_ERR, "Cannot use PASV mode with IPv6 server", false);
         goto err;
     }
     struct sockaddr_in addr_for_port = {0};
     socklen_t addrlen = sizeof(addr_for_port);
-    if (getsockname(*socklisten, (struct sockaddr *)&addr_for_port, &addrlen) == -1) {
+    if (getsockname(s->pasv_sock, (struct sockaddr *)&addr_for_port, &addrlen) == -1) {
         logerr("Conn %d: failed to get listening port (getsockname: %s)",
-               state.id, strerror(errno));
-        reply_with(SYNTAX_ERR, "Server error", false);
+               s->id, strerror(errno));
+        reply_with(s, SYNTAX_ERR, "Server error", false);
         goto err;
     }
     char reply[128];
@@ -587,26 +816,20 @@ static void handle_PASV(void) {
     strcat(reply, ")");
 
     /* Update state */
-    state.dtp_ready = true;
-    state.passive = true;
-    state.extended = false;
-    reply_with(PASV_MODE, reply, false);
+    s->dtp_ready = true;
+    s->passive = true;
+    s->extended = false;
+    reply_with(s, PASV_MODE, reply, false);
     return;
 
     err:
-    if (*socklisten >= 0)
-        close(*socklisten);
-    pthread_cancel(state.listen_tid);
+    release_pasv(s);
 }
 
 /* Handle EPSV command from client. */
-static void handle_EPSV(const char *arg) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
-        return;
-    }
+static void handle_EPSV(struct session *s, char *arg) {
     if (!ftps_config.pasv_mode_enabled) {
-        reply_with(SYNTAX_ERR, "EPSV is not allowed on the server", false);
+        reply_with(s, SYNTAX_ERR, "EPSV is not allowed on the server", false);
         return;
     }
 
@@ -615,7 +838,7 @@ static void handle_EPSV(const char *arg) {
     if (strlen(arg) == 0) {
         struct sockaddr_storage addr;
         socklen_t addrlen = sizeof addr;
-        getsockname(state.sockpi, (struct sockaddr *)&addr, &addrlen);
+        getsockname(s->sockpi, (struct sockaddr *)&addr, &addrlen);
         af = addr.ss_family;
     } else if (strcmp(arg, "1") == 0) {
         af = AF_INET;
@@ -623,42 +846,23 @@ static void handle_EPSV(const char *arg) {
         af = AF_INET6;
     } else if (strcmp(arg, "ALL") == 0){
         af = AF_INET;
-        state.epsv_only = true;
+        s->epsv_only = true;
     } else {
-        reply_with(SYNTAX_ERR_ARGS, NULL, false);
+        reply_with(s, SYNTAX_ERR_ARGS, NULL, false);
         return;
     }
-    int *socklisten = malloc(sizeof *socklisten);
-    *socklisten = socket(af, SOCK_STREAM, 0);
-    if (*socklisten == -1) {
-        logerr("Conn %d: failed to create listen socket (socket: %s)",
-               state.id, strerror(errno));
-        reply_with(SYNTAX_ERR, "Server error", false);
-        goto err;
-    }
-    if (listen(*socklisten, 10) == -1) {
-        logerr("Conn %d: failed to listen on socket (listen: %s)",
-               state.id, strerror(errno));
-        reply_with(SYNTAX_ERR, "Server error", false);
-        goto err;
-    }
-
-    /* Start listen thread */
-    int err;
-    if ((err=pthread_create(&state.listen_tid, NULL, accept_connection, socklisten)) != 0) {
-        logerr("Conn %d: failed to start listen thread (pthread_create: %s)",
-               state.id, strerror(err));
-        reply_with(SYNTAX_ERR, "Server error", false);
-        goto err;
+    if (open_pasv_listener(s, af) == -1) {
+        s->epsv_only = false;
+        return;
     }
 
     /* Construct reply */
     struct sockaddr_storage addr_for_port = {0};
     socklen_t addrlen = sizeof(addr_for_port);
-    if (getsockname(*socklisten, (struct sockaddr *)&addr_for_port, &addrlen) == -1) {
+    if (getsockname(s->pasv_sock, (struct sockaddr *)&addr_for_port, &addrlen) == -1) {
         logerr("Conn %d: failed to get listening port (getsockname: %s)",
-               state.id, strerror(errno));
-        reply_with(SYNTAX_ERR, "Server error", false);
+               s->id, strerror(errno));
+        reply_with(s, SYNTAX_ERR, "Server error", false);
         goto err;
     }
     char reply[128];
@@ -669,305 +873,757 @@ static void handle_EPSV(const char *arg) {
     strcat(reply, "|)");
 
     /* Update state */
-    state.dtp_ready = true;
-    state.passive = true;
-    state.extended = false;
-    reply_with(EPSV_MODE, reply, false);
+    s->dtp_ready = true;
+    s->passive = true;
+    s->extended = false;
+    reply_with(s, EPSV_MODE, reply, false);
     return;
 
     err:
-    if (*socklisten >= 0)
-        close(*socklisten);
-    pthread_cancel(state.listen_tid);
-    state.epsv_only = false;
+    release_pasv(s);
+    s->epsv_only = false;
 }
 
-/* Handle LIST command from client. */
-static void handle_LIST(const char *path) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
+/* Wait for the transfer thread to exit. */
+static void join_transfer(struct session *s) {
+    int err;
+    if ((err=pthread_join(s->xfer_tid, NULL))) {
+        logerr("Conn %d: error waiting on transfer thread (pthread_join: %s)",
+               s->id, strerror(err));
+    }
+    s->xfer_pending = false;
+}
+
+/*
+ * Return true while a transfer is running. A transfer that has finished is
+ * joined.
+ */
+static bool transfer_busy(struct session *s) {
+    if (!s->xfer_pending) {
+        return false;
+    }
+    pthread_mutex_lock(&s->xfer_lock);
+    bool done = s->xfer_done;
+    pthread_mutex_unlock(&s->xfer_lock);
+    if (done) {
+        join_transfer(s);
+    }
+    return !done;
+}
+
+/*
+ * Stop the running transfer and wait for it to send its final reply. Returns
+ * false if there was no transfer left to stop.
+ */
+static bool abort_transfer(struct session *s) {
+    if (!s->xfer_pending) {
+        return false;
+    }
+    pthread_mutex_lock(&s->xfer_lock);
+    bool running = !s->xfer_done;
+    if (running) {
+        s->xfer_aborted = true;
+        /* Wake the transfer wherever it is blocked on the data connection */
+        if (s->xfer_sock >= 0) {
+            shutdown(s->xfer_sock, SHUT_RDWR);
+        } else {
+            const uint64_t one = 1;
+            write(s->wake_fd, &one, sizeof one);
+        }
+    }
+    pthread_mutex_unlock(&s->xfer_lock);
+    join_transfer(s);
+    return running;
+}
+
+/*
+ * Establish the data connection configured by PORT, PASV, EPRT or EPSV.
+ * Returns the data socket or -1 on error.
+ */
+static int open_data_conn(struct session *s) {
+    if (!s->passive) {
+        return connect_to_dtp(s);
+    }
+    int sockdtp = accept_pasv(s);
+    if (sockdtp != -1) {
+        pthread_mutex_lock(&s->xfer_lock);
+        s->xfer_sock = sockdtp;
+        pthread_mutex_unlock(&s->xfer_lock);
+    }
+    return sockdtp;
+}
+
+/*
+ * Send the cached listing, or else the entries of xfer_dir, over sockdtp,
+ * compressed in MODE Z. MLSD sends the facts of each entry too, gathered
+ * relative to the open directory in the same pass, and leaves out the pdir
+ * entry of the server root. A listing read from
+ * xfer_dir is offered to the cache. Returns 0 on success.
+ */
+static int send_listing(struct session *s, int sockdtp) {
+    if (s->xfer_listing) {
+        size_t len;
+        const char *data = listing_data(s->xfer_listing, &len);
+        if (s->deflate) {
+            return send_buf_deflate(s->id, data, len, sockdtp, ftps_config.deflate_level,
+                                    &s->xfer_bytes);
+        }
+        return send_buf(s->id, data, len, sockdtp, &s->xfer_bytes);
+    }
+    struct vector listing;
+    vector_create(&listing, 4096, 2);
+    int dir_fd = dirfd(s->xfer_dir);
+    const bool at_root = strcmp(s->xfer_path, "/") == 0;
+    for (struct dirent *ent = readdir(s->xfer_dir); ent; ent = readdir(s->xfer_dir)) {
+        if (s->xfer_kind == XFER_MLSD) {
+            /* The parent of the root lies outside the server root */
+            if (at_root && strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            if (append_facts(&listing, dir_fd, ent->d_name, ent->d_name) == -1) {
+                logwarn("Conn %d: skipping '%s' in MLSD (statx: %s)",
+                        s->id, ent->d_name, strerror(errno));
+            }
+            continue;
+        }
+        vector_append_str(&listing, ent->d_name);
+        vector_append_str(&listing, "\r\n");
+    }
+    listcache_insert(s->xfer_path, s->xfer_kind == XFER_MLSD, &s->xfer_ticket,
+                     listing.arr, listing.size);
+    s->xfer_ticket.wd = -1;
+    int ret;
+    if (s->deflate) {
+        ret = send_buf_deflate(s->id, listing.arr, listing.size, sockdtp,
+                               ftps_config.deflate_level, &s->xfer_bytes);
+    } else {
+        ret = send_buf(s->id, listing.arr, listing.size, sockdtp, &s->xfer_bytes);
+    }
+    vector_free(&listing);
+    return ret;
+}
+
+/*
+ * Thread function running the transfer set up by start_transfer() and sending
+ * its final reply.
+ */
+static void *run_transfer(void *arg) {
+    struct session *s = arg;
+    int ret = -1;
+    uint64_t setup_start = monotonic_ns() / 1000;
+    int sockdtp = open_data_conn(s);
+    if (sockdtp != -1) {
+        metrics_data_setup(monotonic_ns() / 1000 - setup_start);
+        pthread_mutex_lock(&s->xfer_lock);
+        bool aborted = s->xfer_aborted;
+        pthread_mutex_unlock(&s->xfer_lock);
+        ret = 0;
+        if (!aborted) {
+            switch (s->xfer_kind) {
+                case XFER_LIST:
+                case XFER_MLSD:
+                    ret = send_listing(s, sockdtp);
+                    break;
+                case XFER_RETR:
+                    if (s->deflate) {
+                        ret = send_file_deflate(s->id, s->xfer_fd, sockdtp,
+                                                ftps_config.deflate_level, &s->shaper,
+                                                &s->xfer_bytes);
+                    } else {
+                        ret = send_file(s->id, s->xfer_fd, sockdtp, &s->shaper, &s->xfer_bytes);
+                    }
+                    break;
+                case XFER_STOR:
+                    if (s->deflate) {
+                        ret = recv_file_inflate(s->id, sockdtp, s->xfer_fd, &s->shaper,
+                                                &s->xfer_bytes);
+                    } else {
+                        ret = recv_file(s->id, sockdtp, s->xfer_fd, &s->shaper, &s->xfer_bytes);
+                    }
+                    break;
+            }
+        }
+        close(sockdtp);
+    }
+    if (s->xfer_kind == XFER_LIST || s->xfer_kind == XFER_MLSD) {
+        if (s->xfer_listing) {
+            listcache_release(s->xfer_listing);
+        } else {
+            /* Give up on caching if the listing was never read */
+            listcache_insert(s->xfer_path, s->xfer_kind == XFER_MLSD, &s->xfer_ticket, NULL, 0);
+            closedir(s->xfer_dir);
+            free(s->xfer_path);
+        }
+    } else {
+        close(s->xfer_fd);
+    }
+
+    /*
+     * Mark the transfer done before the final reply so the client's next
+     * command never finds it busy. ABOR may have cut the transfer short even
+     * if it looks complete.
+     */
+    pthread_mutex_lock(&s->xfer_lock);
+    bool aborted = s->xfer_aborted;
+    bool quit = s->quit_pending;
+    s->xfer_sock = -1;
+    s->xfer_done = true;
+    pthread_mutex_unlock(&s->xfer_lock);
+    metrics_add(s->xfer_kind == XFER_STOR ? METRIC_BYTES_IN : METRIC_BYTES_OUT,
+                s->xfer_bytes);
+    metrics_command(s->xfer_cmd, monotonic_ns() / 1000 - s->xfer_cmd_start);
+    if (aborted) {
+        loginfo("Conn %d: transfer aborted after %"PRIu64" bytes", s->id, s->xfer_bytes);
+        reply_with(s, CONN_CLOSED, NULL, false);
+    } else if (sockdtp == -1) {
+        reply_with(s, s->passive ? ACTION_ABORTED : NO_DATA_CONN, NULL, false);
+    } else if (ret == -1) {
+        reply_with(s, ACTION_ABORTED, NULL, false);
+    } else if (s->xfer_kind == XFER_LIST || s->xfer_kind == XFER_MLSD) {
+        reply_with(s, TX_COMPLETE, "Directory send OK", false);
+    } else {
+        loginfo("Conn %d: %s %"PRIu64" bytes", s->id,
+                s->xfer_kind == XFER_RETR ? "sent" : "received", s->xfer_bytes);
+        reply_with(s, TX_COMPLETE, "File transfer OK", false);
+    }
+    if (quit) {
+        /* QUIT was deferred until now; ending the input stops the control loop */
+        reply_with(s, CLOSING_CONN, NULL, false);
+        flush_replies(s);
+        shutdown(s->sockpi, SHUT_RD);
+    } else {
+        flush_replies(s);
+    }
+    return NULL;
+}
+
+/*
+ * Run a transfer of the given kind on its own thread. The file or directory
+ * must already be open and the preliminary reply sent.
+ */
+static void start_transfer(struct session *s, enum transfer_kind kind) {
+    s->xfer_kind = kind;
+    s->xfer_cmd = s->cmd;
+    s->xfer_cmd_start = s->cmd_start;
+    s->cmd_deferred = true;
+    s->xfer_sock = -1;
+    s->xfer_bytes = 0;
+    s->xfer_aborted = false;
+    s->xfer_done = false;
+    s->dtp_ready = false;
+    shaper_begin(&s->shaper, s->uname);
+    uint64_t wakeups;
+    read(s->wake_fd, &wakeups, sizeof wakeups);  /* Forget an ABOR of an earlier transfer */
+    flush_replies(s);  /* The client may wait for 150 before connecting */
+    int err;
+    if ((err=pthread_create(&s->xfer_tid, NULL, run_transfer, s)) != 0) {
+        logwarn("Conn %d: failed to start transfer thread; transferring inline "
+                "(pthread_create: %s)", s->id, strerror(err));
+        run_transfer(s);
         return;
     }
-    if (!state.dtp_ready) {
-        reply_with(NO_ACTION, "Specify data transfer control command first "
-                              "(i.e. PORT, PASV, EPRT, EPSV)", false);
+    s->xfer_pending = true;
+}
+
+/*
+ * Prepare a LIST or MLSD transfer of the directory at path, served from the
+ * listing cache when possible. Returns -1 with errno set if the directory
+ * cannot be opened.
+ */
+static int open_listing(struct session *s, const char *path, enum transfer_kind kind) {
+    bool facts = kind == XFER_MLSD;
+    char vpath[PATH_MAX];
+    int fd = open_path(s, path, O_RDONLY | O_DIRECTORY, 0, vpath);
+    if (fd == -1) {
+        return -1;
+    }
+    s->xfer_listing = listcache_lookup(vpath, fd, facts, &s->xfer_ticket);
+    if (s->xfer_listing) {
+        loginfo("Conn %d: sending cached listing of '%s'", s->id, vpath);
+        close(fd);
+        return 0;
+    }
+    s->xfer_dir = fdopendir(fd);
+    if (!s->xfer_dir) {
+        int err = errno;
+        listcache_insert(vpath, facts, &s->xfer_ticket, NULL, 0);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    s->xfer_path = strdup(vpath);
+    if (!s->xfer_path) {
+        logerr("Conn %d: failed to allocate listing path", s->id);
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/* Handle LIST command from client. */
+static void handle_LIST(struct session *s, char *path) {
+    if (!s->dtp_ready) {
+        reply_with(s, NO_ACTION, "Specify data transfer control command first "
+                                 "(i.e. PORT, PASV, EPRT, EPSV)", false);
         return;
     }
-    char canon[PATH_MAX];
-    if (construct_valid_path(canon, path) == -1) {
-        reply_with(SYNTAX_ERR_ARGS, "Illegal path", false);
+    s->rest_offset = 0;  /* Listings are always sent whole */
+    if (open_listing(s, path, XFER_LIST) == -1) {
+        if (bad_path(errno)) {
+            reply_with(s, SYNTAX_ERR_ARGS, "Illegal path", false);
+            return;
+        }
+        logerr("Conn %d: error opening directory for listing (opendir: %s)",
+               s->id, strerror(errno));
+        reply_with(s, ACTION_ABORTED, NULL, false);
         return;
     }
-    reply_with(OPENING_CONN, "Here comes the directory listing", false);
+    reply_with(s, OPENING_CONN, "Here comes the directory listing", false);
+    start_transfer(s, XFER_LIST);
+}
 
-    /* Establish data connection */
-    int sockdtp;
-    if (state.passive) {
-        int *ret, err;
-        if ((err=pthread_join(state.listen_tid, (void **)&ret))) {
-            logerr("Conn %d: error waiting on listen thread (pthread_listen: %s)",
-                   state.id, strerror(err));
-            reply_with(ACTION_ABORTED, NULL, false);
+/* Handle MLSD command from client. Lists a directory with the facts of each entry. */
+static void handle_MLSD(struct session *s, char *path) {
+    if (!s->dtp_ready) {
+        reply_with(s, NO_ACTION, "Specify data transfer control command first "
+                                 "(i.e. PORT, PASV, EPRT, EPSV)", false);
+        return;
+    }
+    s->rest_offset = 0;
+    if (open_listing(s, path, XFER_MLSD) == -1) {
+        if (bad_path(errno)) {
+            reply_with(s, NO_ACTION_PERM, "No such directory", false);
             return;
-        }
-        sockdtp = *ret;
-        free(ret);
-    } else {
-        sockdtp = connect_to_dtp();
-        if (sockdtp == -1) {
-            reply_with(NO_DATA_CONN, NULL, false);
+        } else if (errno == ENOTDIR) {
+            reply_with(s, SYNTAX_ERR_ARGS, "Not a directory", false);
             return;
         }
+        logerr("Conn %d: error opening directory for listing (opendir: %s)",
+               s->id, strerror(errno));
+        reply_with(s, ACTION_ABORTED, NULL, false);
+        return;
     }
+    reply_with(s, OPENING_CONN, "Here comes the directory listing", false);
+    start_transfer(s, XFER_MLSD);
+}
 
-    /* Send directory listing */
-    DIR *dir = opendir(canon);
-    if (!dir) {
-        logerr("Conn %d: error opening directory for listing (opendir: %s)",
-               state.id, strerror(errno));
-        reply_with(ACTION_ABORTED, NULL, false);
-        close(sockdtp);
+/* Handle MLST command from client. Replies with the facts of a single path. */
+static void handle_MLST(struct session *s, char *path) {
+    char vpath[PATH_MAX];
+    int fd = open_path(s, path, O_PATH, 0, vpath);
+    if (fd == -1) {
+        reply_with(s, NO_ACTION_PERM, "No such file or directory", false);
         return;
     }
-    for (struct dirent *ent = readdir(dir); ent; ent = readdir(dir)) {
-        char sndbuf[300];
-        strcpy(sndbuf, ent->d_name);
-        strcat(sndbuf, "\r\n");
-        if (send(sockdtp, sndbuf, strlen(sndbuf), 0) == -1) {
-            logwarn("Conn %d: error sending a directory listing (send: %s)",
-                    state.id, strerror(errno));
-        }
+    struct vector body;
+    vector_create(&body, 128, 2);
+    vector_append(&body, ' ');
+    if (append_facts(&body, fd, "", vpath) == -1) {
+        logwarn("Conn %d: failed to examine '%s' (statx: %s)", s->id, vpath, strerror(errno));
+        reply_with(s, NO_ACTION_PERM, "No such file or directory", false);
+    } else {
+        vector_append(&body, '\0');
+        char msg[PATH_MAX + 16];
+        snprintf(msg, sizeof msg, "Listing %s", vpath);
+        reply_with_body(s, FILE_ACT_OK, msg, body.arr);
     }
+    vector_free(&body);
+    close(fd);
+}
 
-    /* Cleanup */
-    closedir(dir);
-    close(sockdtp);
-    reply_with(TX_COMPLETE, "Directory send OK", false);
-    state.dtp_ready = false;
+/*
+ * Open the file at path for STOR or APPE, creating it if needed, and position
+ * it for writing at offset, or at its end if append is true. Replies and
+ * returns -1 on error.
+ */
+static int open_stor_file(struct session *s, char *path, off_t offset, bool append) {
+    /* Keep what is already there when resuming or appending */
+    int flags = O_WRONLY | O_CREAT | (append || offset > 0 ? 0 : O_TRUNC);
+    char vpath[PATH_MAX];
+    s->xfer_fd = open_path(s, path, flags, 0666, vpath);
+    if (s->xfer_fd == -1) {
+        if (bad_path(errno)) {
+            reply_with(s, SYNTAX_ERR_ARGS, "Illegal path", false);
+        } else {
+            reply_with(s, NO_ACTION, "Could not open output file", false);
+        }
+        return -1;
+    }
+    listcache_invalidate_parent(vpath);
+    off_t pos = append ? lseek(s->xfer_fd, 0, SEEK_END) : lseek(s->xfer_fd, offset, SEEK_SET);
+    if (pos == -1) {
+        logerr("Conn %d: failed to seek in output file (lseek: %s)", s->id, strerror(errno));
+        reply_with(s, ACTION_ABORTED, NULL, false);
+        close(s->xfer_fd);
+        return -1;
+    }
+    if (offset > 0) {
+        loginfo("Conn %d: resuming upload at offset %lld", s->id, (long long)offset);
+    }
+    return 0;
 }
 
 /* Handle STOR command from client. */
-static void handle_STOR(char *path) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
+static void handle_STOR(struct session *s, char *path) {
+    if (!s->dtp_ready) {
+        reply_with(s, NO_ACTION, "Specify data transfer control command first "
+                                 "(i.e. PORT, PASV, EPRT, EPSV)", false);
         return;
     }
-    if (!state.dtp_ready) {
-        reply_with(NO_ACTION, "Specify data transfer control command first "
-                              "(i.e. PORT, PASV, EPRT, EPSV)", false);
+    off_t offset = s->rest_offset;
+    s->rest_offset = 0;
+    if (open_stor_file(s, path, offset, false) == -1) {
         return;
     }
+    reply_with(s, OPENING_CONN, "Opening data connection", false);
+    start_transfer(s, XFER_STOR);
+}
 
-    /* Validate path and open file for writing */
-    char canon[PATH_MAX];
-    char filename[PATH_MAX];
-    char *ptr = strrchr(path, '/');
-    if (!ptr) {
-        strcpy(filename, path);
-        *path = '\0';
-    } else {
-        *ptr = '\0';
-        strcpy(filename, ptr + 1);
+/* Handle APPE command from client. */
+static void handle_APPE(struct session *s, char *path) {
+    if (!s->dtp_ready) {
+        reply_with(s, NO_ACTION, "Specify data transfer control command first "
+                                 "(i.e. PORT, PASV, EPRT, EPSV)", false);
+        return;
     }
-    if (construct_valid_path(canon, path) == -1) {
-        reply_with(SYNTAX_ERR_ARGS, "Illegal path", false);
+    s->rest_offset = 0;  /* Appending always starts at the end */
+    if (open_stor_file(s, path, 0, true) == -1) {
         return;
     }
-    strcat(canon, "/");
-    strcat(canon, filename);
-    FILE *outfile = fopen(canon, "w");
-    if (!outfile) {
-        logerr("Conn %d: failed to open output file (fopen: %s)", state.id, strerror(errno));
-        reply_with(NO_ACTION, "Could not open output file", false);
+    reply_with(s, OPENING_CONN, "Opening data connection", false);
+    start_transfer(s, XFER_STOR);
+}
+
+/* Handle RETR command from client. */
+static void handle_RETR(struct session *s, char *path) {
+    if (!s->dtp_ready) {
+        reply_with(s, NO_ACTION, "Specify data transfer control command first "
+                                 "(i.e. PORT, PASV, EPRT, EPSV)", false);
         return;
     }
-    reply_with(OPENING_CONN, "Opening data connection", false);
+    off_t offset = s->rest_offset;
+    s->rest_offset = 0;
 
-    /* Establish data connection */
-    int sockdtp = -1;
-    if (state.passive) {
-        int *ret, err;
-        if ((err=pthread_join(state.listen_tid, (void **)&ret))) {
-            logerr("Conn %d: error waiting on listen thread (pthread_listen: %s)",
-                   state.id, strerror(err));
-            reply_with(ACTION_ABORTED, NULL, false);
-            goto cleanup;
+    /* Validate path and open file for reading */
+    char vpath[PATH_MAX];
+    s->xfer_fd = open_path(s, path, O_RDONLY, 0, vpath);
+    if (s->xfer_fd == -1) {
+        if (bad_path(errno)) {
+            reply_with(s, SYNTAX_ERR_ARGS, "Illegal path", false);
+        } else {
+            reply_with(s, NO_ACTION, "Could not open output file", false);
         }
-        sockdtp = *ret;
-        free(ret);
-    } else {
-        sockdtp = connect_to_dtp();
-        if (sockdtp == -1) {
-            reply_with(NO_DATA_CONN, NULL, false);
-            goto cleanup;
+        return;
+    }
+    struct stat st;
+    if (fstat(s->xfer_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        logwarn("Conn %d: refusing to send '%s'; not a regular file", s->id, path);
+        reply_with(s, NO_ACTION_PERM, "Not a regular file", false);
+        close(s->xfer_fd);
+        return;
+    }
+    if (offset > 0) {
+        if (lseek(s->xfer_fd, offset, SEEK_SET) == -1) {
+            logerr("Conn %d: failed to seek in file (lseek: %s)", s->id, strerror(errno));
+            reply_with(s, ACTION_ABORTED, NULL, false);
+            close(s->xfer_fd);
+            return;
         }
+        loginfo("Conn %d: resuming download at offset %lld", s->id, (long long)offset);
     }
+    reply_with(s, OPENING_CONN, "Opening data connection", false);
+    start_transfer(s, XFER_RETR);
+}
 
-    /* Receive data and write to file */
-    uint8_t buf[BUFSIZ];
-    ssize_t read;
-    while ((read=recv(sockdtp, buf, sizeof buf, 0))) {
-        if (read < 0) {
-            logerr("Conn %d: error receiving data (recv: %s)", state.id, strerror(errno));
-            reply_with(ACTION_ABORTED, NULL, false);
-            goto cleanup;
+/* Handle SIZE command from client. Replies with the size of a regular file. */
+static void handle_SIZE(struct session *s, char *path) {
+    char vpath[PATH_MAX];
+    int fd = open_path(s, path, O_PATH, 0, vpath);
+    if (fd == -1) {
+        if (bad_path(errno)) {
+            reply_with(s, SYNTAX_ERR_ARGS, "Illegal path", false);
         } else {
-            if (fwrite(buf, sizeof *buf, read, outfile) < (size_t)read) {
-                logerr("Conn %d: failed to save some data to file (fwrite: %s)",
-                       state.id, strerror(errno));
-                reply_with(ACTION_ABORTED, NULL, false);
-                goto cleanup;
-            }
+            reply_with(s, NO_ACTION_PERM, "Could not get file size", false);
         }
+        return;
     }
-    reply_with(TX_COMPLETE, "File transfer OK", false);
-
-    /* Cleanup */
-    cleanup:
-    if (outfile) fclose(outfile);
-    if (sockdtp > 0) close(sockdtp);
-    state.dtp_ready = false;
+    struct stat st;
+    int ret = fstat(fd, &st);
+    close(fd);
+    if (ret == -1 || !S_ISREG(st.st_mode)) {
+        reply_with(s, NO_ACTION_PERM, "Could not get file size", false);
+        return;
+    }
+    char reply[32];
+    snprintf(reply, sizeof reply, "%lld", (long long)st.st_size);
+    reply_with(s, FILE_STATUS, reply, false);
 }
 
-/* Handle RETR command from client. */
-static void handle_RETR(char *path) {
-    if (!state.auth) {
-        reply_with(USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
+/*
+ * Handle REST command from client. The offset applies to the next RETR or STOR,
+ * however many PORT or PASV style commands come before it.
+ */
+static void handle_REST(struct session *s, char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long offset = strtoull(arg, &end, 10);
+    if (!isdigit((uint8_t)arg[0]) || *end != '\0' || errno == ERANGE || offset > INT64_MAX) {
+        reply_with(s, SYNTAX_ERR_ARGS, "REST takes a byte offset", false);
         return;
     }
-    if (!state.dtp_ready) {
-        reply_with(NO_ACTION, "Specify data transfer control command first "
-                              "(i.e. PORT, PASV, EPRT, EPSV)", false);
-        return;
+    s->rest_offset = offset;
+    char reply[96];
+    snprintf(reply, sizeof reply, "Restarting at %llu. Send RETR or STOR to resume", offset);
+    reply_with(s, FILE_PENDING, reply, false);
+}
+
+/* Handle ABOR command from client. */
+static void handle_ABOR(struct session *s, char *arg) {
+    if (abort_transfer(s)) {
+        /* The transfer has already replied 426 */
+        reply_with(s, TX_COMPLETE, "Abort successful", false);
+    } else {
+        reply_with(s, ABORT_OK, "No transfer to abort", false);
     }
+}
 
-    /* Validate path and open file for reading */
-    char canon[PATH_MAX];
-    if (construct_valid_path(canon, path) == -1) {
-        reply_with(SYNTAX_ERR_ARGS, "Illegal path", false);
+/* Handle STAT command from client. */
+static void handle_STAT(struct session *s, char *arg) {
+    if (strlen(arg) > 0) {
+        reply_with(s, CMD_NOT_IMPL, "STAT with an argument is not implemented", false);
         return;
     }
-    FILE *infile = fopen(canon, "r");
-    if (!infile) {
-        logerr("Conn %d: failed to open output file (fopen: %s)", state.id, strerror(errno));
-        reply_with(NO_ACTION, "Could not open output file", false);
+    static const char *const names[] = {
+        [XFER_LIST] = "LIST",
+        [XFER_MLSD] = "MLSD",
+        [XFER_RETR] = "RETR",
+        [XFER_STOR] = "STOR",
+    };
+    char reply[128];
+    if (transfer_busy(s)) {
+        snprintf(reply, sizeof reply, "%s in progress; %"PRIu64" bytes transferred",
+                 names[s->xfer_kind], __atomic_load_n(&s->xfer_bytes, __ATOMIC_RELAXED));
+    } else {
+        snprintf(reply, sizeof reply, "Logged in; no transfer in progress");
+    }
+    reply_with(s, SYSTEM_STATUS, reply, false);
+}
+
+/* Handle MODE command from client. Stream (S) and deflate (Z) are supported. */
+static void handle_MODE(struct session *s, char *arg) {
+    if (strlen(arg) != 1) {
+        reply_with(s, SYNTAX_ERR_ARGS, NULL, false);
         return;
     }
-    reply_with(OPENING_CONN, "Opening data connection", false);
+    switch (toupper((uint8_t)arg[0])) {
+        case 'S':
+            s->deflate = false;
+            reply_with(s, COMMAND_OK, "Mode set to S", false);
+            break;
+        case 'Z':
+            s->deflate = true;
+            reply_with(s, COMMAND_OK, "Mode set to Z", false);
+            break;
+        default:
+            reply_with(s, ARG_NOT_IMPL, "Only MODE S and MODE Z are supported", false);
+            break;
+    }
+}
 
-    /* Establish data connection */
-    int sockdtp = -1;
-    if (state.passive) {
-        int *ret, err;
-        if ((err=pthread_join(state.listen_tid, (void **)&ret))) {
-            logerr("Conn %d: error waiting on listen thread (pthread_listen: %s)",
-                   state.id, strerror(err));
-            reply_with(ACTION_ABORTED, NULL, false);
-            goto cleanup;
+/*
+ * Handle QUIT command from client. A running transfer is allowed to finish
+ * first and replies to QUIT itself.
+ */
+static void handle_QUIT(struct session *s, char *arg) {
+    if (s->xfer_pending) {
+        pthread_mutex_lock(&s->xfer_lock);
+        s->quit_pending = !s->xfer_done;
+        pthread_mutex_unlock(&s->xfer_lock);
+        if (s->quit_pending) {
+            loginfo("Conn %d: quitting once the transfer completes", s->id);
+            return;
         }
-        sockdtp = *ret;
-        free(ret);
+        join_transfer(s);
+    }
+    reply_with(s, CLOSING_CONN, NULL, false);
+    s->loop_running = false;  /* We are quitting */
+}
+
+/* Handle FEAT command from client. Lists the extensions to RFC 959 supported. */
+static void handle_FEAT(struct session *s, char *arg) {
+    reply_with_body(s, SYSTEM_STATUS, "Extensions supported:",
+                    " EPRT\r\n"
+                    " EPSV\r\n"
+                    " MLST " FACTS_SUPPORTED "\r\n"
+                    " MODE Z\r\n"
+                    " REST STREAM\r\n"
+                    " SIZE\r\n");
+}
+
+/* Handle NOOP command from client. */
+static void handle_NOOP(struct session *s, char *arg) {
+    reply_with(s, COMMAND_OK, NULL, false);
+}
+
+/* Parse and handle the next command buffered in pi_buf. */
+static void handle_next_cmd(struct session *s) {
+    char arg[MAX_ARG_LEN];
+    uint64_t start = monotonic_ns() / 1000;
+    const struct command *cmd = get_next_cmd(s, arg, MAX_ARG_LEN);
+    if (!cmd) return;
+    loginfo("Conn %d: received %s", s->id, cmd->name);
+    s->cmd = cmd - commands;
+    s->cmd_start = start;
+    s->cmd_deferred = false;
+    if (cmd->transfer && transfer_busy(s)) {
+        reply_with(s, BAD_SEQ, "A transfer is in progress; wait for it or send ABOR", false);
+    } else if (cmd->args == CMD_ARGS_NONE && strlen(arg) > 0) {
+        reply_with(s, SYNTAX_ERR_ARGS, NULL, false);
+    } else if (cmd->auth && !s->auth) {
+        reply_with(s, USER_LOGIN_FAIL, "Must be authenticated to run this command", false);
     } else {
-        sockdtp = connect_to_dtp();
-        if (sockdtp == -1) {
-            reply_with(NO_DATA_CONN, NULL, false);
-            goto cleanup;
-        }
+        cmd->handler(s, arg);
+    }
+    if (!s->cmd_deferred) {
+        metrics_command(s->cmd, monotonic_ns() / 1000 - start);
     }
+}
+
+/*
+ * Handle every complete command currently buffered in pi_buf, then send all of
+ * their replies together.
+ */
+static void handle_buffered_cmds(struct session *s) {
+    while (s->loop_running && !s->quit_pending && sockbuf_line_ready(&s->pi_buf)) {
+        handle_next_cmd(s);
+    }
+    flush_replies(s);
+}
+
+/* Initialize state shared by all client connections. */
+void client_init(void) {
+    sandbox_init(DATA_ROOT_PREFIX);
+}
+
+/*
+ * Create the state for a newly connected client and greet it. Returns NULL if
+ * the session could not be allocated.
+ */
+struct session *session_new(const int id, const int sockpi) {
+    struct session *s = calloc(1, sizeof *s);
+    if (!s) {
+        logerr("Conn %d: failed to allocate memory for session", id);
+        return NULL;
+    }
+    s->id = id;
+    s->sockpi = sockpi;
+    s->pasv_sock = -1;
+    s->pasv_slot = -1;
+    s->xfer_sock = -1;
+    s->loop_running = true;
+    strcpy(s->cwd, "/");
+    char vpath[PATH_MAX];
+    s->cwd_fd = sandbox_open(-1, "/", "/", O_PATH | O_DIRECTORY | O_CLOEXEC, 0, vpath);
+    if (s->cwd_fd == -1) {
+        logerr("Conn %d: failed to open data root (openat2: %s)", id, strerror(errno));
+        free(s);
+        return NULL;
+    }
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->wake_fd == -1) {
+        logerr("Conn %d: failed to create eventfd (eventfd: %s)", id, strerror(errno));
+        close(s->cwd_fd);
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->reply_lock, NULL);
+    pthread_mutex_init(&s->xfer_lock, NULL);
+    /* Keep urgent data sent with ABOR in the command stream */
+    const int on = 1;
+    if (setsockopt(sockpi, SOL_SOCKET, SO_OOBINLINE, &on, sizeof on) == -1) {
+        logwarn("Conn %d: failed to set SO_OOBINLINE (setsockopt: %s)", id, strerror(errno));
+    }
+    /* Replies are complete messages; don't hold one back waiting for an ACK */
+    if (setsockopt(sockpi, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on) == -1) {
+        logwarn("Conn %d: failed to set TCP_NODELAY (setsockopt: %s)", id, strerror(errno));
+    }
+    vector_create(&s->replies, 512, 2);
+    reply_with(s, SERVER_READY, NULL, false);
+    flush_replies(s);
+    metrics_add(METRIC_SESSIONS, 1);
+    metrics_add(METRIC_SESSIONS_ACTIVE, 1);
+    return s;
+}
 
-    /* Send data to client */
-    uint8_t buf[BUFSIZ];
-    size_t read;
-    while ((read=fread(buf, sizeof *buf, BUFSIZ, infile)) > 0) {
-        if (send(sockdtp, buf, read, 0) == -1) {
-            logwarn("Conn %d: failed to send some data (send: %s)", state.id, strerror(errno));
-            reply_with(ACTION_ABORTED, NULL, false);
-            goto cleanup;
+/*
+ * Send queued replies, then receive whatever the client has sent without
+ * blocking and handle every complete command. Stops reading while replies
+ * are left queued so a client that does not read them cannot make the queue
+ * grow. Returns false once the session is finished and should be freed.
+ */
+bool session_on_ready(struct session *s) {
+    while (s->loop_running) {
+        if (!flush_replies(s)) {
+            return true;  /* Called again once sockpi is writable */
+        }
+        ssize_t read = pi_recv(s, MSG_DONTWAIT);
+        if (read > 0) {
+            handle_buffered_cmds(s);
+        } else if (read == 0) {
+            loginfo("Conn %d: connection closed by client", s->id);
+            return false;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else if (errno != EINTR) {
+            logerr("Conn %d: error reading from client (recv: %s)", s->id, strerror(errno));
+            return false;
         }
     }
-    reply_with(TX_COMPLETE, "File transfer OK", false);
+    return false;
+}
 
-    /* Cleanup */
-    cleanup:
-    if (infile) fclose(infile);
-    if (sockdtp > 0) close(sockdtp);
-    state.dtp_ready = false;
+/* Close the client connection and free the session. */
+void session_free(struct session *s) {
+    logout(s);
+    abort_transfer(s);
+    release_pasv(s);
+    flush_replies(s);
+    close(s->wake_fd);
+    close(s->cwd_fd);
+    close(s->sockpi);
+    vector_free(&s->replies);
+    pthread_mutex_destroy(&s->reply_lock);
+    pthread_mutex_destroy(&s->xfer_lock);
+    free(s);
+    metrics_add(METRIC_SESSIONS_ACTIVE, -1);
 }
 
 /* Start handling commands from a newly connected client. */
 void handle_new_client(const int id, const int sockpi) {
-    /* Initialize state */
-    state.id = id;
-    state.sockpi = sockpi;
-    strcpy(state.cwd, "/");
-    if (!realpath(DATA_ROOT_PREFIX, root)) {
-        logerr("Conn %d: cannot get canonical path for data root (realpath: %s)",
-               state.id, strerror(errno));
+    struct session *s = session_new(id, sockpi);
+    if (!s) {
+        close(sockpi);
         _exit(EXIT_FAILURE);
     }
-    if (chdir(root) == -1) {
-        logerr("Conn %d: failed to change directory to data root (chdir: %s)",
-               state.id, strerror(errno));
-        _exit(EXIT_FAILURE);
-    }
-    reply_with(SERVER_READY, NULL, false);
 
     /* Start response loop */
-    char cmd[5], arg[MAX_ARG_LEN];
-    while (loop_running) {
-        if (get_next_cmd(cmd, arg, MAX_ARG_LEN) < 0) continue;
-        loginfo("Conn %d: received %s", state.id, cmd);
-        if (strcmp(cmd, "USER") == 0) {
-            handle_USER(arg);
-        } else if (strcmp(cmd, "PASS") == 0) {
-            handle_PASS(arg);
-        } else if (strcmp(cmd, "QUIT") == 0) {
-            if (strlen(arg) > 0) {
-                /* QUIT should take no arguments */
-                reply_with(SYNTAX_ERR_ARGS, NULL, false);
-            } else {
-                handle_QUIT();
-                break;  /* Break out of loop; we are quitting */
-            }
-        } else if (strcmp(cmd, "PWD") == 0) {
-            if (strlen(arg) > 0) {
-                /* PWD should take no arguments */
-                reply_with(SYNTAX_ERR_ARGS, NULL, false);
-            } else {
-                handle_PWD();
-            }
-        } else if (strcmp(cmd, "CWD") == 0) {
-            handle_CWD(arg);
-        } else if (strcmp(cmd, "CDUP") == 0) {
-            if (strlen(arg) > 0) {
-                /* PWD should take no arguments */
-                reply_with(SYNTAX_ERR_ARGS, NULL, false);
-            } else {
-                handle_CWD("..");
-            }
-        } else if (strcmp(cmd, "PORT") == 0) {
-            handle_PORT(arg);
-        } else if (strcmp(cmd, "EPRT") == 0) {
-            handle_EPRT(arg);
-        } else if (strcmp(cmd, "PASV") == 0) {
-            handle_PASV();
-        } else if (strcmp(cmd, "EPSV") == 0) {
-            handle_EPSV(arg);
-        } else if (strcmp(cmd, "LIST") == 0) {
-            handle_LIST(arg);
-        } else if (strcmp(cmd, "STOR") == 0) {
-            handle_STOR(arg);
-        } else if (strcmp(cmd, "RETR") == 0) {
-            handle_RETR(arg);
-        } else {
-            logwarn("Conn %d: unknown command '%s'", state.id, cmd);
-            reply_with(CMD_NOT_IMPL, NULL, false);
+    int status = EXIT_SUCCESS;
+    while (s->loop_running) {
+        handle_buffered_cmds(s);
+        if (!s->loop_running) {
+            break;
+        }
+        ssize_t read = pi_recv(s, 0);
+        if (read == 0) {
+            loginfo("Conn %d: connection closed by client", s->id);
+            break;
+        } else if (read == -1 && errno != EINTR) {
+            logerr("Conn %d: error reading from client (recv: %s)", s->id, strerror(errno));
+            status = EXIT_FAILURE;
+            break;
         }
-        /* Reset arg and cmd */
-        cmd[0] = '\0';
-        arg[0] = '\0';
     }
 
-    close(state.sockpi);
-    _exit(EXIT_SUCCESS);
+    session_free(s);
+    logflush();
+    _exit(status);
 }
@@ -9,6 +9,27 @@
 #ifndef FTPS_CLIENT_H
 #define FTPS_CLIENT_H
 
+#include <stdbool.h>
+
+/* State for a single client connection. */
+struct session;
+
+/* Initialize state shared by all client connections. */
+void client_init(void);
+/*
+ * Create the state for a newly connected client and greet it. Returns NULL if
+ * the session could not be allocated.
+ */
+struct session *session_new(const int conn_id, const int sockpi);
+/*
+ * Send the replies queued for a client with a non-blocking socket, then
+ * receive whatever it has sent and handle every complete command. Must be
+ * called whenever the socket becomes readable or writable. Returns false
+ * once the session is finished and should be freed.
+ */
+bool session_on_ready(struct session *s);
+/* Close the client connection and free the session. */
+void session_free(struct session *s);
 /* Start handling commands from a newly connected client. */
 void handle_new_client(const int conn_id, const int sockpi);
 
@@ -0,0 +1,115 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * facts.c
+ *
+ * This module formats the machine-readable facts of RFC 3659 sent by MLSD and
+ * MLST. Everything reported about an entry comes from one statx(2) call made
+ * relative to the directory being listed. Symbolic links are not followed,
+ * since their targets may lie outside the server root, and are reported as
+ * links.
+ */
+
+#define _GNU_SOURCE  /* statx(2) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vector.h"
+#include "facts.h"
+
+/* Fields requested from statx(2). */
+#define FACTS_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | \
+                          STATX_SIZE | STATX_MTIME)
+
+/*
+ * Return the read, write and execute permission bits (4, 2, 1) the server
+ * process has on an entry with the given owner and mode.
+ */
+static unsigned access_bits(const struct statx *stx) {
+    static bool init = false;
+    static uid_t euid;
+    static gid_t egid;
+    if (!init) {
+        euid = geteuid();
+        egid = getegid();
+        init = true;
+    }
+    if (euid == 0) {
+        return 07;
+    } else if (stx->stx_uid == euid) {
+        return (stx->stx_mode >> 6) & 07;
+    } else if (stx->stx_gid == egid) {
+        return (stx->stx_mode >> 3) & 07;
+    } else {
+        return stx->stx_mode & 07;
+    }
+}
+
+/*
+ * Append the perm fact for an entry. Only the operations this server
+ * implements are listed: RETR (r), STOR (w), APPE (a), CWD (e), LIST and MLSD
+ * (l) and creating files with STOR (c).
+ */
+static void append_perm(struct vector *out, const struct statx *stx) {
+    unsigned bits = access_bits(stx);
+    vector_append_str(out, "perm=");
+    if (S_ISLNK(stx->stx_mode)) {
+        /* What the link allows depends on a target that is not examined */
+    } else if (S_ISDIR(stx->stx_mode)) {
+        if ((bits & 03) == 03) vector_append(out, 'c');
+        if (bits & 01) vector_append(out, 'e');
+        if ((bits & 05) == 05) vector_append(out, 'l');
+    } else {
+        if (bits & 04) vector_append(out, 'r');
+        if (bits & 02) {
+            vector_append(out, 'w');
+            vector_append(out, 'a');
+        }
+    }
+    vector_append(out, ';');
+}
+
+/* Format and append the facts of an entry. */
+int append_facts(struct vector *out, int dirfd, const char *name, const char *display) {
+    struct statx stx;
+    int flags = AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW | (name[0] == '\0' ? AT_EMPTY_PATH : 0);
+    if (statx(dirfd, name, flags, FACTS_STATX_MASK, &stx) == -1) {
+        return -1;
+    }
+
+    const char *type;
+    if (strcmp(name, ".") == 0) {
+        type = "cdir";
+    } else if (strcmp(name, "..") == 0) {
+        type = "pdir";
+    } else if (S_ISDIR(stx.stx_mode)) {
+        type = "dir";
+    } else if (S_ISREG(stx.stx_mode)) {
+        type = "file";
+    } else if (S_ISLNK(stx.stx_mode)) {
+        type = "OS.unix=slink";
+    } else {
+        type = "OS.unix=special";
+    }
+    char buf[96];
+    struct tm tm;
+    time_t mtime = stx.stx_mtime.tv_sec;
+    gmtime_r(&mtime, &tm);
+    snprintf(buf, sizeof buf, "type=%s;size=%llu;modify=%04d%02d%02d%02d%02d%02d;", type,
+             (unsigned long long)stx.stx_size, tm.tm_year + 1900, tm.tm_mon + 1,
+             tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    vector_append_str(out, buf);
+    append_perm(out, &stx);
+    vector_append(out, ' ');
+    vector_append_str(out, display);
+    vector_append_str(out, "\r\n");
+    return 0;
+}
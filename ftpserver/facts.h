@@ -0,0 +1,32 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * facts.h
+ *
+ * Header for facts.c
+ */
+
+#ifndef FTPS_FACTS_H
+#define FTPS_FACTS_H
+
+#include "vector.h"
+
+/* Facts reported for each entry, as advertised by FEAT. */
+#define FACTS_SUPPORTED "type*;size*;modify*;perm*;"
+
+/*
+ * Append the facts of entry name in the directory open at dirfd to out,
+ * followed by display and CRLF, as in an MLSD or MLST listing:
+ *
+ *     type=file;size=1024;modify=20240101120000;perm=rwa; display
+ *
+ * The entry is examined with a single statx(2) relative to dirfd, so no path
+ * is resolved again. dirfd may be AT_FDCWD to examine a whole path instead,
+ * or name may be empty to examine dirfd itself.
+ * The entries "." and ".." are typed cdir and pdir. A symbolic link is not
+ * followed and is typed OS.unix=slink with an empty perm. Returns 0 on success
+ * or -1 if the entry could not be examined, leaving out unchanged.
+ */
+int append_facts(struct vector *out, int dirfd, const char *name, const char *display);
+
+#endif /* FTPS_FACTS_H */
@@ -0,0 +1,115 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * gencmds.c
+ *
+ * Build-time generator for the command dispatch table. It searches for a
+ * multiplicative hash that maps every verb in cmds.def to its own slot and
+ * writes the parameters and slot table as a C header.
+ *
+ * usage: gencmds OUTFILE
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+/* Largest table searched, as a power of two. */
+#define MAX_HASH_BITS (10U)
+/* Multipliers tried for each table size. */
+#define MAX_TRIES (100000U)
+
+static const char *verbs[] = {
+#define FTP_CMD(verb, args, auth, transfer) #verb,
+#include "cmds.def"
+#undef FTP_CMD
+};
+#define NVERBS (sizeof verbs / sizeof *verbs)
+
+/* Pack up to 4 letters of verb into an integer; missing letters are 0. */
+static uint32_t pack_verb(const char *verb) {
+    uint32_t key = 0;
+    for (size_t i = 0; i < 4 && verb[i]; i++) {
+        key |= (uint32_t)(uint8_t)verb[i] << (8 * i);
+    }
+    return key;
+}
+
+/* Small deterministic PRNG (xorshift32) so every build picks the same hash. */
+static uint32_t next_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/*
+ * Try to place every verb in a table of 2^bits slots using mult. Returns 1 and
+ * fills slots with verb index + 1 (0 for empty) if no two verbs collide.
+ */
+static int try_hash(uint32_t mult, unsigned bits, uint8_t slots[]) {
+    memset(slots, 0, (size_t)1 << bits);
+    for (size_t i = 0; i < NVERBS; i++) {
+        uint32_t slot = (uint32_t)(pack_verb(verbs[i]) * mult) >> (32 - bits);
+        if (slots[slot]) {
+            return 0;
+        }
+        slots[slot] = i + 1;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: gencmds OUTFILE\n");
+        return EXIT_FAILURE;
+    }
+    static uint8_t slots[1U << MAX_HASH_BITS];
+    unsigned bits = 1;
+    while ((1U << bits) < NVERBS) {
+        bits++;
+    }
+    uint32_t state = 0x9e3779b9U;
+    uint32_t mult = 0;
+    for (; bits <= MAX_HASH_BITS; bits++) {
+        unsigned tries;
+        for (tries = 0; tries < MAX_TRIES; tries++) {
+            mult = next_rand(&state) | 1;
+            if (try_hash(mult, bits, slots)) break;
+        }
+        if (tries < MAX_TRIES) break;
+    }
+    if (bits > MAX_HASH_BITS) {
+        fprintf(stderr, "gencmds: no perfect hash found for %zu commands\n", NVERBS);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = fopen(argv[1], "w");
+    if (!out) {
+        perror("gencmds: Failed to open output file");
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "/* Generated by gencmds from cmds.def; do not edit. */\n\n");
+    fprintf(out, "#ifndef FTPS_CMDS_HASH_H\n#define FTPS_CMDS_HASH_H\n\n");
+    fprintf(out, "#include <stdint.h>\n\n");
+    fprintf(out, "/*\n"
+                 " * Slot of a verb packed little-endian into 32 bits (letter i in bits\n"
+                 " * 8i..8i+7, 0 for missing letters).\n"
+                 " */\n");
+    fprintf(out, "#define CMD_HASH(key) ((uint32_t)((key) * 0x%08" PRIx32 "U) >> %u)\n\n",
+            mult, 32 - bits);
+    fprintf(out, "/* Index + 1 into cmds.def of the verb hashing to each slot; 0 if none. */\n");
+    fprintf(out, "static const uint8_t cmd_hash_slots[%u] = {", 1U << bits);
+    for (unsigned i = 0; i < (1U << bits); i++) {
+        fprintf(out, "%s%u,", i % 16 == 0 ? "\n    " : " ", slots[i]);
+    }
+    fprintf(out, "\n};\n\n#endif /* FTPS_CMDS_HASH_H */\n");
+    if (fclose(out) == EOF) {
+        perror("gencmds: Failed to write output file");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
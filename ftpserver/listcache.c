@@ -0,0 +1,338 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * listcache.c
+ *
+ * This module caches rendered directory listings so a directory polled by
+ * many clients is read once and then sent from memory. Each cached directory
+ * is watched with inotify(7) and its listings are dropped as soon as the
+ * kernel reports a change, whoever made it. Pending events are read before
+ * every lookup, so a listing is never served after a change that completed
+ * before the LIST or MLSD arrived. The cache is bounded by the configured
+ * size and evicts the least recently used listings first. Every process
+ * serving clients has its own cache, so it is only used in the EPOLL and
+ * PREFORK modes, where one process serves many clients; in FORK mode each
+ * process serves a single client and would only pay for the watches.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "cfgparse.h"
+#include "listcache.h"
+
+#define LISTCACHE_BUCKETS (1024U)
+#define WATCH_BUCKETS (256U)
+/* Changes that invalidate the listings of a watched directory. */
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | \
+                    IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct listing {
+    struct listing *next;   /* Next listing in the same bucket */
+    struct listing *newer;  /* Neighbours in least recently used order */
+    struct listing *older;
+    char *path;
+    bool facts;
+    bool cached;            /* False once dropped from the cache */
+    int wd;                 /* Watch on the directory */
+    unsigned refs;          /* Holders besides the cache */
+    size_t charge;          /* Bytes counted against the cache size */
+    size_t len;
+    char data[];
+};
+
+/* A directory watch shared by its cached listings and pending misses. */
+struct watch {
+    struct watch *next;
+    int wd;
+    unsigned gen;    /* Changes seen on the directory */
+    unsigned users;  /* Cached listings and misses using the watch */
+};
+
+/* Guards everything below. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* inotify instance; -2 before first use and -1 if caching is off. */
+static int inotify_fd = -2;
+static struct listing *buckets[LISTCACHE_BUCKETS];
+static struct watch *watches[WATCH_BUCKETS];
+/* Most and least recently used cached listings. */
+static struct listing *newest;
+static struct listing *oldest;
+/* Bytes used by cached listings. */
+static size_t used;
+
+/* Return the bucket index of the listing of path. */
+static unsigned hash_key(const char *path, bool facts) {
+    uint32_t h = 2166136261U;  /* FNV-1a */
+    for (const char *p = path; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619U;
+    }
+    return (h ^ facts) % LISTCACHE_BUCKETS;
+}
+
+/* Return the watch with descriptor wd, creating it if create is true. */
+static struct watch *get_watch(int wd, bool create) {
+    struct watch **w = &watches[(unsigned)wd % WATCH_BUCKETS];
+    for (; *w; w = &(*w)->next) {
+        if ((*w)->wd == wd) {
+            return *w;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    *w = calloc(1, sizeof **w);
+    if (!*w) {
+        logerr("Listing cache: failed to allocate watch");
+        exit(EXIT_FAILURE);
+    }
+    (*w)->wd = wd;
+    return *w;
+}
+
+/* Drop one user of the watch wd and remove the watch once it has none. */
+static void put_watch(int wd) {
+    struct watch **w = &watches[(unsigned)wd % WATCH_BUCKETS];
+    while (*w && (*w)->wd != wd) {
+        w = &(*w)->next;
+    }
+    if (!*w || --(*w)->users > 0) {
+        return;
+    }
+    struct watch *dead = *w;
+    *w = dead->next;
+    free(dead);
+    inotify_rm_watch(inotify_fd, wd);  /* Fails harmlessly if already gone */
+}
+
+/* Take l out of the cache. It is freed now or when its last holder releases it. */
+static void drop_listing(struct listing *l) {
+    struct listing **p = &buckets[hash_key(l->path, l->facts)];
+    while (*p != l) {
+        p = &(*p)->next;
+    }
+    *p = l->next;
+    if (l->newer) l->newer->older = l->older; else newest = l->older;
+    if (l->older) l->older->newer = l->newer; else oldest = l->newer;
+    used -= l->charge;
+    l->cached = false;
+    put_watch(l->wd);
+    if (l->refs == 0) {
+        free(l->path);
+        free(l);
+    }
+}
+
+/* Note a change to the directory watched by wd and drop its listings. */
+static void invalidate_wd(int wd) {
+    struct watch *w = get_watch(wd, false);
+    if (w) {
+        w->gen++;
+    }
+    for (struct listing *l = oldest, *next; l; l = next) {
+        next = l->newer;
+        if (l->wd == wd) {
+            drop_listing(l);
+        }
+    }
+}
+
+/* Note a change to every watched directory and empty the cache. */
+static void invalidate_all(void) {
+    for (unsigned i = 0; i < WATCH_BUCKETS; i++) {
+        for (struct watch *w = watches[i]; w; w = w->next) {
+            w->gen++;
+        }
+    }
+    while (oldest) {
+        drop_listing(oldest);
+    }
+}
+
+/* Apply every change reported by inotify since the last call. */
+static void read_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n=read(inotify_fd, buf, sizeof buf)) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                invalidate_all();
+            } else {
+                invalidate_wd(ev->wd);
+            }
+            p += sizeof *ev + ev->len;
+        }
+    }
+    if (n == -1 && errno != EAGAIN && errno != EINTR) {
+        logwarn("Listing cache: failed to read changes; emptying cache (read: %s)",
+                strerror(errno));
+        invalidate_all();
+    }
+}
+
+/* Set up inotify on first use. Returns false if caching is off. */
+static bool cache_enabled(void) {
+    if (inotify_fd == -2) {
+        inotify_fd = -1;
+        if (ftps_config.list_cache_size > 0 && ftps_config.server_mode != SERVER_MODE_FORK) {
+            inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd == -1) {
+                logwarn("Listing cache: disabled (inotify_init1: %s)", strerror(errno));
+            }
+        }
+    }
+    return inotify_fd != -1;
+}
+
+/* Look up a cached listing. */
+struct listing *listcache_lookup(const char *path, int dirfd, bool facts,
+                                 struct listcache_ticket *ticket) {
+    ticket->wd = -1;
+    pthread_mutex_lock(&cache_lock);
+    if (!cache_enabled()) {
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    read_events();
+
+    /*
+     * Adding a watch on a directory already watched returns the same
+     * descriptor, so a differing one means path now names another directory.
+     * The watch is added through dirfd so the directory is not looked up again.
+     */
+    char fdpath[32];
+    snprintf(fdpath, sizeof fdpath, "/proc/self/fd/%d", dirfd);
+    int wd = inotify_add_watch(inotify_fd, fdpath, WATCH_MASK);
+    if (wd == -1) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            logwarn("Listing cache: cannot watch '%s' (inotify_add_watch: %s)",
+                    path, strerror(errno));
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    struct listing *l = buckets[hash_key(path, facts)];
+    while (l && (l->facts != facts || strcmp(l->path, path) != 0)) {
+        l = l->next;
+    }
+    if (l && l->wd != wd) {
+        drop_listing(l);
+        l = NULL;
+    }
+    if (l) {
+        /* Hit; make it the most recently used */
+        if (l->newer) {
+            l->newer->older = l->older;
+            if (l->older) l->older->newer = l->newer; else oldest = l->newer;
+            l->older = newest;
+            l->newer = NULL;
+            newest->newer = l;
+            newest = l;
+        }
+        l->refs++;
+    } else {
+        struct watch *w = get_watch(wd, true);
+        w->users++;
+        ticket->wd = wd;
+        ticket->gen = w->gen;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return l;
+}
+
+/* Cache a listing read after a miss. */
+void listcache_insert(const char *path, bool facts, const struct listcache_ticket *ticket,
+                      const char *buf, size_t len) {
+    if (ticket->wd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    read_events();
+    struct watch *w = get_watch(ticket->wd, false);
+    size_t limit = (size_t)ftps_config.list_cache_size * 1024;
+    size_t charge = sizeof(struct listing) + len + strlen(path) + 1;
+    if (!buf || !w || w->gen != ticket->gen || charge > limit) {
+        put_watch(ticket->wd);
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    /* Replace a listing cached by a concurrent miss, then make room */
+    struct listing **p = &buckets[hash_key(path, facts)];
+    for (struct listing *old = *p; old; old = old->next) {
+        if (old->facts == facts && strcmp(old->path, path) == 0) {
+            drop_listing(old);
+            break;
+        }
+    }
+    while (used + charge > limit) {
+        drop_listing(oldest);
+    }
+    struct listing *l = malloc(sizeof *l + len);
+    char *key = strdup(path);
+    if (!l || !key) {
+        logerr("Listing cache: failed to allocate listing");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(l->data, buf, len);
+    l->len = len;
+    l->path = key;
+    l->facts = facts;
+    l->cached = true;
+    l->wd = ticket->wd;  /* The miss's use of the watch passes to the listing */
+    l->refs = 0;
+    l->charge = charge;
+    l->next = *p;
+    *p = l;
+    l->older = newest;
+    l->newer = NULL;
+    if (newest) newest->newer = l; else oldest = l;
+    newest = l;
+    used += charge;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Return the contents of a listing. */
+const char *listing_data(const struct listing *l, size_t *len) {
+    *len = l->len;
+    return l->data;
+}
+
+/* Release a listing from a hit. */
+void listcache_release(struct listing *l) {
+    pthread_mutex_lock(&cache_lock);
+    if (--l->refs == 0 && !l->cached) {
+        free(l->path);
+        free(l);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Drop the listings of the directory holding path. */
+void listcache_invalidate_parent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        return;
+    }
+    size_t len = slash == path ? 1 : (size_t)(slash - path);  /* Keep "/" for the root */
+    pthread_mutex_lock(&cache_lock);
+    if (inotify_fd >= 0) {
+        for (struct listing *l = oldest; l; l = l->newer) {
+            if (strncmp(l->path, path, len) == 0 && l->path[len] == '\0') {
+                /* Also keeps out a listing being read by a miss right now */
+                invalidate_wd(l->wd);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
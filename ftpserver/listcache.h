@@ -0,0 +1,52 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * listcache.h
+ *
+ * Header for listcache.c
+ */
+
+#ifndef FTPS_LISTCACHE_H
+#define FTPS_LISTCACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * A rendered directory listing held by the cache. It stays valid until it is
+ * released, even if the cache drops it in the meantime.
+ */
+struct listing;
+
+/* Filled in by a cache miss and handed back to listcache_insert(). */
+struct listcache_ticket {
+    int wd;        /* Watch on the directory, or -1 if it cannot be cached */
+    unsigned gen;  /* Changes seen on the watch when the miss happened */
+};
+
+/*
+ * Look up the listing of the directory open at dirfd, cached under its
+ * virtual path path, with facts if facts is true (MLSD) or names only
+ * otherwise (LIST). On a hit returns the
+ * listing, which must be released with listcache_release(). On a miss returns
+ * NULL and fills ticket, which must then be passed to listcache_insert(). The
+ * directory is watched before this returns, so a change made while the caller
+ * reads it keeps the stale listing out of the cache.
+ */
+struct listing *listcache_lookup(const char *path, int dirfd, bool facts,
+                                 struct listcache_ticket *ticket);
+/*
+ * Finish a miss by caching the listing in buf of len bytes for path. buf may
+ * be NULL to give up on the miss. The listing is not cached if the directory
+ * changed since the miss or the listing does not fit in the cache.
+ */
+void listcache_insert(const char *path, bool facts, const struct listcache_ticket *ticket,
+                      const char *buf, size_t len);
+/* Return the rendered listing and store its length in len. */
+const char *listing_data(const struct listing *l, size_t *len);
+/* Release a listing returned by listcache_lookup(). */
+void listcache_release(struct listing *l);
+/* Drop any cached listing of the directory containing path. */
+void listcache_invalidate_parent(const char *path);
+
+#endif /* FTPS_LISTCACHE_H */
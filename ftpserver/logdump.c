@@ -0,0 +1,287 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * logdump.c
+ *
+ * Offline decoder for binary ftps logs. It prints every message of the log in
+ * the same text format ftps writes when log_format is TEXT, so the output can
+ * be searched like a text log. Text lines already in the log are printed as
+ * they are.
+ *
+ * usage: ftps-logdump [LOGFILE]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "logbin.h"
+
+#define FORMAT_BUCKETS (4096U)
+#define READ_CHUNK (1U << 20)
+
+/* A format string defined in the log. */
+struct format {
+    struct format *next;
+    uint32_t id;
+    char *fmt;
+};
+
+static struct format *formats[FORMAT_BUCKETS];
+
+/* Wall clock time of the monotonic time anchor_mono; valid once have_anchor is set. */
+static bool have_anchor;
+static uint64_t anchor_mono;
+static struct timespec anchor_real;
+
+/* Read all of file into memory. Stores its length in len. */
+static char *read_all(FILE *file, size_t *len) {
+    size_t cap = READ_CHUNK, n = 0;
+    char *buf = malloc(cap);
+    size_t got;
+    while (buf && (got=fread(&buf[n], 1, cap - n, file)) > 0) {
+        n += got;
+        if (n == cap) {
+            cap *= 2;
+            char *bigger = realloc(buf, cap);
+            if (!bigger) {
+                free(buf);
+            }
+            buf = bigger;
+        }
+    }
+    if (!buf) {
+        fputs("ftps-logdump: out of memory\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    *len = n;
+    return buf;
+}
+
+/* Return the format with ID id, or NULL if it is not defined. */
+static struct format *find_format(uint32_t id) {
+    struct format *f = formats[id % FORMAT_BUCKETS];
+    while (f && f->id != id) {
+        f = f->next;
+    }
+    return f;
+}
+
+/* Remember the format string fmt of len bytes with ID id. */
+static void define_format(uint32_t id, const char *fmt, size_t len) {
+    struct format *f = find_format(id);
+    if (f) {
+        if (strlen(f->fmt) != len || memcmp(f->fmt, fmt, len) != 0) {
+            fprintf(stderr, "ftps-logdump: format %08x defined twice; keeping the first\n", id);
+        }
+        return;
+    }
+    f = malloc(sizeof *f);
+    char *copy = malloc(len + 1);
+    if (!f || !copy) {
+        fputs("ftps-logdump: out of memory\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, fmt, len);
+    copy[len] = '\0';
+    f->id = id;
+    f->fmt = copy;
+    f->next = formats[id % FORMAT_BUCKETS];
+    formats[id % FORMAT_BUCKETS] = f;
+}
+
+/* Print the time and level of a message logged at monotonic time mono. */
+static void print_prefix(uint64_t mono, unsigned level) {
+    char stamp[32];
+    time_t t = -1;
+    if (have_anchor) {
+        int64_t ns = anchor_real.tv_nsec + (int64_t)(mono - anchor_mono);
+        t = anchor_real.tv_sec + ns / 1000000000 - (ns % 1000000000 < 0);
+    }
+    if (t == (time_t) -1 || !ctime_r(&t, stamp)) {
+        strcpy(stamp, "Unknown time\n");
+    }
+    stamp[strlen(stamp)-1] = '\0';
+    printf("%s %s", stamp, level < 3 ? logbin_level_tags[level] : "[?] ");
+}
+
+/* Print the literal text between p and end, where "%%" stands for '%'. */
+static void print_literal(const char *p, const char *end) {
+    while (p < end) {
+        putchar(*p);
+        p += *p == '%' ? 2 : 1;
+    }
+}
+
+/* Take n bytes of arguments from *p into dst. Returns false if too few are left. */
+static bool take(const char **p, const char *end, void *dst, size_t n) {
+    if ((size_t)(end - *p) < n) {
+        return false;
+    }
+    memcpy(dst, *p, n);
+    *p += n;
+    return true;
+}
+
+/* Print a value with the conversion spec, after the star arguments in stars. */
+#define PRINT_ARG(spec, nstars, star, value) do { \
+        if ((nstars) == 0) printf((spec), (value)); \
+        else if ((nstars) == 1) printf((spec), (star)[0], (value)); \
+        else printf((spec), (star)[0], (star)[1], (value)); \
+    } while (0)
+
+/* Print the message with format fmt whose arguments are the payload between p and end. */
+static void print_message(const char *fmt, const char *p, const char *end) {
+    const char *start, *conv_end;
+    enum logbin_arg type;
+    unsigned nstars;
+    int ret;
+    while ((ret=logbin_next_conv(fmt, &start, &conv_end, &type, &nstars)) == 1) {
+        print_literal(fmt, start);
+        char spec[64];
+        size_t speclen = conv_end - start;
+        if (speclen >= sizeof spec || nstars > 2) {
+            printf("<bad conversion>");
+            return;
+        }
+        memcpy(spec, start, speclen);
+        spec[speclen] = '\0';
+        fmt = conv_end;
+
+        int star[2];
+        bool ok = true;
+        for (unsigned i = 0; i < nstars; i++) {
+            ok = ok && take(&p, end, &star[i], sizeof star[i]);
+        }
+        int i32;
+        int64_t i64;
+        double d;
+        uint16_t n16;
+        char str[UINT16_MAX + 1];
+        switch (type) {
+        case LOGBIN_ARG_INT:
+            if ((ok=ok && take(&p, end, &i32, sizeof i32))) PRINT_ARG(spec, nstars, star, i32);
+            break;
+        case LOGBIN_ARG_DOUBLE:
+            if ((ok=ok && take(&p, end, &d, sizeof d))) PRINT_ARG(spec, nstars, star, d);
+            break;
+        case LOGBIN_ARG_STR:
+            ok = ok && take(&p, end, &n16, sizeof n16) && take(&p, end, str, n16);
+            if (ok) {
+                str[n16] = '\0';
+                PRINT_ARG(spec, nstars, star, str);
+            }
+            break;
+        default:
+            if (!(ok=ok && take(&p, end, &i64, sizeof i64))) {
+                break;
+            }
+            switch (type) {
+            case LOGBIN_ARG_LONG:    PRINT_ARG(spec, nstars, star, (long)i64); break;
+            case LOGBIN_ARG_LLONG:   PRINT_ARG(spec, nstars, star, (long long)i64); break;
+            case LOGBIN_ARG_SIZE:    PRINT_ARG(spec, nstars, star, (size_t)i64); break;
+            case LOGBIN_ARG_INTMAX:  PRINT_ARG(spec, nstars, star, (intmax_t)i64); break;
+            case LOGBIN_ARG_PTRDIFF: PRINT_ARG(spec, nstars, star, (ptrdiff_t)i64); break;
+            default: PRINT_ARG(spec, nstars, star, (void *)(uintptr_t)i64); break;
+            }
+        }
+        if (!ok) {
+            printf("<missing argument>");
+            return;
+        }
+    }
+    print_literal(fmt, fmt + strlen(fmt));
+    if (ret == -1) {
+        printf(" <unsupported conversion>");
+    }
+}
+
+/*
+ * Walk the log in buf of len bytes. The first pass only collects format
+ * strings, since a child process may write a message before its parent
+ * writes the format. The second pass prints every message.
+ */
+static void dump(const char *buf, size_t len, bool print) {
+    const char *p = buf, *end = buf + len;
+    while (p < end) {
+        if ((unsigned char)*p != LOGBIN_MAGIC) {
+            const char *nl = memchr(p, '\n', end - p);
+            const char *next = nl ? nl + 1 : end;
+            if (print) {
+                fwrite(p, 1, next - p, stdout);
+            }
+            p = next;
+            continue;
+        }
+
+        struct logbin_header h;
+        if ((size_t)(end - p) < sizeof h) {
+            break;
+        }
+        memcpy(&h, p, sizeof h);
+        const char *payload = p + sizeof h;
+        if ((size_t)(end - payload) < h.len) {
+            break;
+        }
+        p = payload + h.len;
+        unsigned type = LOGBIN_TYPE(h.kind);
+        if (!print) {
+            if (type == LOGBIN_FORMAT) {
+                define_format(h.id, payload, h.len);
+            }
+        } else if (type == LOGBIN_ANCHOR && h.len >= 2 * sizeof(int64_t)) {
+            int64_t sec, nsec;
+            memcpy(&sec, payload, sizeof sec);
+            memcpy(&nsec, payload + sizeof sec, sizeof nsec);
+            anchor_real.tv_sec = sec;
+            anchor_real.tv_nsec = nsec;
+            anchor_mono = h.time;
+            have_anchor = true;
+        } else if (type == LOGBIN_MESSAGE) {
+            print_prefix(h.time, LOGBIN_LEVEL(h.kind));
+            struct format *f = find_format(h.id);
+            if (f) {
+                print_message(f->fmt, payload, p);
+            } else {
+                printf("<unknown format %08x>", h.id);
+            }
+            putchar('\n');
+        } else if (type == LOGBIN_TEXT) {
+            print_prefix(h.time, LOGBIN_LEVEL(h.kind));
+            fwrite(payload, 1, h.len, stdout);
+            putchar('\n');
+        }
+    }
+    if (print && p < end) {
+        fputs("ftps-logdump: log ends with a partial record\n", stderr);
+    }
+}
+
+/* Main entry point. */
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fputs("usage: ftps-logdump [LOGFILE]\n", stderr);
+        return EXIT_FAILURE;
+    }
+    FILE *file = argc == 2 ? fopen(argv[1], "rb") : stdin;
+    if (!file) {
+        fprintf(stderr, "ftps-logdump: cannot open %s: %s\n", argv[1], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    size_t len;
+    char *buf = read_all(file, &len);
+    if (ferror(file)) {
+        fprintf(stderr, "ftps-logdump: read error: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fclose(file);
+    dump(buf, len, false);
+    dump(buf, len, true);
+    free(buf);
+    return EXIT_SUCCESS;
+}
@@ -17,6 +17,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
@@ -28,6 +29,11 @@
 #include "client.h"
 #include "auth.h"
 #include "cfgparse.h"
+#include "reactor.h"
+#include "pasv.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "shaper.h"
 
 #include <openssl/ssl.h>
 
@@ -91,16 +97,28 @@ static void setup_sighandlers(void) {
     struct sigaction sigchld = {0};
     sigchld.sa_handler = handle_SIGCHLD;
     sigaction(SIGCHLD, &sigchld, NULL);
+    /* A client closing its connection must not kill a process serving others */
+    struct sigaction sigpipe = {0};
+    sigpipe.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sigpipe, NULL);
 }
 
-/* Start the server listening for connections on `port`. */
-static void start_server(const uint16_t port) {
-    /* Create listen socket */
+/*
+ * Create a socket listening for control connections on `port`. With
+ * reuseport, several sockets may listen on the same port and the kernel
+ * spreads incoming connections across them.
+ */
+static int open_listener(const uint16_t port, const bool reuseport) {
     int socklisten = socket(AF_INET, SOCK_STREAM, 0);
     if (socklisten < 0) {
         logerr("Main: failed to create socket (socket: %s)", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    const int on = 1;
+    if (reuseport && setsockopt(socklisten, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+        logerr("Main: failed to set SO_REUSEPORT (setsockopt: %s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
     struct sockaddr_in listen_addr = {0};
     listen_addr.sin_family = AF_INET;
     listen_addr.sin_addr.s_addr = INADDR_ANY;
@@ -109,13 +127,16 @@ static void start_server(const uint16_t port) {
         logerr("Main: error binding socket (bind: %s)", strerror(errno));
         exit(EXIT_FAILURE);
     }
-    if (listen(socklisten, 10) < 0) {
+    if (listen(socklisten, SOMAXCONN) < 0) {
         logerr("Main: error listening on socket (listen: %s)", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    return socklisten;
+}
 
-    /* Wait for connections */
-    loginfo("Main: now accepting connections");
+/* Accept connections on socklisten and fork a process for each one. */
+static void serve_forked(const int socklisten) {
+    loginfo("Main: now accepting connections (fork)");
     struct sockaddr_storage addr;
     socklen_t addrlen = sizeof addr;
     pid_t pid = 1;  /* Set to 1 so the loop continues in case of initial error */
@@ -125,6 +146,9 @@ static void start_server(const uint16_t port) {
             if (errno != EINTR) {
                 logwarn("Main: error accepting a connection (accept: %s)", strerror(errno));
             }
+        } else if (!ratelimit_connection(&addr)) {
+            loginfo("Main: refused a connection from %s (ip_conn_rate)", addrtostr(&addr));
+            ratelimit_refuse(sockclient);
         } else {
             loginfo("Main: accepted a connection from %s", addrtostr(&addr));
             conn_count++;
@@ -133,18 +157,128 @@ static void start_server(const uint16_t port) {
                         "(fork: %s)",
                         strerror(errno));
             }
+            if (pid) {
+                close(sockclient);  /* The child owns the connection */
+            }
         }
     } while (accept_connections && pid);
 
     if (pid) /* in parent */ {
         close(socklisten);
         loginfo("Main: no longer accepting connections");
-        /* TODO: Wait for children to end */
+        /* Reap the children here instead of in the handler and let their sessions end */
+        struct sigaction sigchld = {0};
+        sigchld.sa_handler = SIG_DFL;
+        sigaction(SIGCHLD, &sigchld, NULL);
+        while (wait(NULL) != -1 || errno == EINTR) {
+            continue;
+        }
+        loginfo("Main: every session has ended");
     } else  /* in child */ {
+        close(socklisten);
         handle_new_client(conn_count, sockclient);
     }
 }
 
+/*
+ * Fork a worker that serves connections from its own listener on `port`.
+ * Returns the pid of the worker or -1 on error.
+ */
+static pid_t spawn_worker(const uint16_t port, const int worker, const int nworkers) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        logwarn("Main: error forking worker %d (fork: %s)", worker, strerror(errno));
+    } else if (pid == 0) {
+        int socklisten = open_listener(port, true);
+        loginfo("Worker %d: started", worker);
+        run_reactor(socklisten, &accept_connections, worker + 1, nworkers);
+        close(socklisten);
+        loginfo("Worker %d: no longer accepting connections", worker);
+        exit(EXIT_SUCCESS);
+    }
+    return pid;
+}
+
+/*
+ * Start the pre-forked workers and respawn any that die until the server is
+ * stopped.
+ */
+static void serve_prefork(const uint16_t port) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const int nworkers = ftps_config.workers ? (int)ftps_config.workers :
+                         ncpus > 0 ? (int)ncpus : 1;
+    pid_t *workers = calloc(nworkers, sizeof *workers);
+    time_t *started = calloc(nworkers, sizeof *started);
+    if (!workers || !started) {
+        logerr("Main: failed to allocate memory for workers");
+        exit(EXIT_FAILURE);
+    }
+    /* The supervisor reaps workers itself */
+    struct sigaction sigchld = {0};
+    sigchld.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &sigchld, NULL);
+    /* Fail early if the port cannot be used */
+    close(open_listener(port, true));
+
+    loginfo("Main: starting %d workers", nworkers);
+    for (int i = 0; i < nworkers; i++) {
+        workers[i] = spawn_worker(port, i, nworkers);
+        started[i] = time(NULL);
+    }
+    while (accept_connections) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == ECHILD) {
+                sleep(1);  /* Every fork failed; retry below */
+            } else if (errno != EINTR) {
+                logwarn("Main: failed to wait for a worker (wait: %s)", strerror(errno));
+            }
+        }
+        for (int i = 0; i < nworkers && accept_connections; i++) {
+            if (pid > 0 && workers[i] == pid) {
+                logwarn("Main: worker %d (pid %d) exited with status %d",
+                        i, (int)pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+                workers[i] = -1;
+                if (time(NULL) - started[i] < 1) {
+                    sleep(1);  /* Don't spin on a worker that dies at startup */
+                }
+            }
+            if (workers[i] == -1) {
+                workers[i] = spawn_worker(port, i, nworkers);
+                started[i] = time(NULL);
+            }
+        }
+    }
+
+    loginfo("Main: stopping workers");
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], SIGINT);
+        }
+    }
+    while (wait(NULL) != -1 || errno == EINTR) {
+        continue;
+    }
+    free(workers);
+    free(started);
+    loginfo("Main: no longer accepting connections");
+}
+
+/* Start the server listening for connections on `port`. */
+static void start_server(const uint16_t port) {
+    if (ftps_config.server_mode == SERVER_MODE_PREFORK) {
+        serve_prefork(port);
+    } else if (ftps_config.server_mode == SERVER_MODE_EPOLL) {
+        int socklisten = open_listener(port, false);
+        run_reactor(socklisten, &accept_connections, 1, 1);
+        close(socklisten);
+        loginfo("Main: no longer accepting connections");
+    } else {
+        serve_forked(open_listener(port, false));
+    }
+}
+
 /* Main entry point. */
 int main(int argc, char *argv[]) {
     if (argc < 3) {
@@ -158,7 +292,17 @@ int main(int argc, char *argv[]) {
     loginit(logpathstr);
     setup_sighandlers();
     read_cfg();
+    logsetlevel(ftps_config.log_level);
+    logsetformat(ftps_config.log_format);
     auth_read_passwd();
+    client_init();
+    pasv_pool_init();
+    metrics_init();
+    ratelimit_init();
+    shaper_init();
+    if (ftps_config.metrics_file) {
+        metrics_start_export(ftps_config.metrics_file, ftps_config.metrics_interval);
+    }
     start_server(port);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,254 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * metrics.c
+ *
+ * This module keeps server-wide counters and latency histograms in memory
+ * shared by every process serving clients, and exports them in Prometheus
+ * text format. Histograms are log-linear like HdrHistogram: each power of two
+ * microseconds is split into HIST_SUB_BUCKETS buckets, so any recorded value
+ * is known to within about 6%. Updates are single atomic adds.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+
+#define HIST_SUB_BITS (4U)
+#define HIST_SUB_BUCKETS (1U << HIST_SUB_BITS)
+/* Powers of two covered above the first HIST_SUB_BUCKETS microseconds; up to 2^40 us. */
+#define HIST_MAX_EXP (40U)
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+static const char *const verbs[] = {
+#define FTP_CMD(verb, args, auth, transfer) #verb,
+#include "cmds.def"
+#undef FTP_CMD
+};
+#define NVERBS (sizeof verbs / sizeof *verbs)
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} counter_info[METRIC_COUNTERS] = {
+    [METRIC_SESSIONS]={"ftps_sessions_total", "counter", "Control connections accepted."},
+    [METRIC_SESSIONS_ACTIVE]={"ftps_sessions_active", "gauge", "Control connections open."},
+    [METRIC_LOGINS_FAILED]={"ftps_logins_failed_total", "counter", "USER or PASS refused."},
+    [METRIC_BYTES_IN]={"ftps_bytes_received_total", "counter",
+                       "File bytes received on data connections."},
+    [METRIC_BYTES_OUT]={"ftps_bytes_sent_total", "counter",
+                        "File and listing bytes sent on data connections."},
+    [METRIC_RATE_LIMITED]={"ftps_rate_limited_total", "counter",
+                           "Connections and logins refused by rate limits or session caps."},
+};
+
+/* Quantiles exported for each histogram. */
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/* Latencies recorded in microseconds. */
+struct histogram {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t sum;
+};
+
+/* Everything shared by the server's processes. */
+struct metrics {
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    struct histogram commands[NVERBS];
+    struct histogram data_setup;
+};
+
+static struct metrics *metrics;
+static char *export_path;
+static unsigned export_interval;
+static pid_t exporter;
+/* Keeps the exporter thread and the export at exit apart. */
+static pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Map the shared metrics. */
+void metrics_init(void) {
+    metrics = mmap(NULL, sizeof *metrics, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        logwarn("Main: metrics disabled (mmap: %s)", strerror(errno));
+        metrics = NULL;
+    }
+}
+
+/* Add n to counter. */
+void metrics_add(enum metrics_counter counter, int64_t n) {
+    if (metrics) {
+        atomic_fetch_add_explicit(&metrics->counters[counter], (uint64_t)n,
+                                  memory_order_relaxed);
+    }
+}
+
+/* Return the bucket of a value. */
+static unsigned bucket_of(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    unsigned exp = 63 - __builtin_clzll(value);
+    if (exp > HIST_MAX_EXP) {
+        return HIST_BUCKETS - 1;
+    }
+    unsigned sub = (value >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/* Return the highest value that falls in bucket. */
+static uint64_t bucket_max(unsigned bucket) {
+    if (bucket < HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned exp = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % HIST_SUB_BUCKETS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+/* Record a value in h. */
+static void record(struct histogram *h, uint64_t usec) {
+    atomic_fetch_add_explicit(&h->counts[bucket_of(usec)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, usec, memory_order_relaxed);
+}
+
+/* Record a command latency. */
+void metrics_command(unsigned cmd, uint64_t usec) {
+    if (metrics && cmd < NVERBS) {
+        record(&metrics->commands[cmd], usec);
+    }
+}
+
+/* Record a data connection setup time. */
+void metrics_data_setup(uint64_t usec) {
+    if (metrics) {
+        record(&metrics->data_setup, usec);
+    }
+}
+
+/* Write h as a summary named name, with the label label if not NULL. */
+static void write_summary(FILE *out, const char *name, const char *label,
+                          const struct histogram *h) {
+    /* Read the histogram once so the quantiles agree with the count */
+    static uint64_t counts[HIST_BUCKETS];
+    uint64_t total = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    const char *sep = label ? "," : "";
+    label = label ? label : "";
+    for (unsigned q = 0; q < sizeof quantiles / sizeof *quantiles; q++) {
+        fprintf(out, "%s{%s%squantile=\"%g\"} ", name, label, sep, quantiles[q]);
+        if (total == 0) {
+            fputs("NaN\n", out);
+            continue;
+        }
+        uint64_t rank = (uint64_t)(quantiles[q] * total + 0.5);
+        rank = rank == 0 ? 1 : rank;
+        uint64_t seen = 0;
+        unsigned i = 0;
+        while ((seen += counts[i]) < rank) {
+            i++;
+        }
+        fprintf(out, "%.6f\n", bucket_max(i) / 1e6);
+    }
+    const char *open = *label ? "{" : "", *close = *label ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %.6f\n", name, open, label, close,
+            atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e6);
+    fprintf(out, "%s_count%s%s%s %"PRIu64"\n", name, open, label, close, total);
+}
+
+/* Write every metric to the export file. Must be called with export_lock held. */
+static void export(void) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof tmp, "%s.tmp", export_path);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        logwarn("Main: failed to write metrics to '%s' (fopen: %s)", tmp, strerror(errno));
+        return;
+    }
+    for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %"PRIu64"\n", counter_info[i].name,
+                counter_info[i].help, counter_info[i].name, counter_info[i].type,
+                counter_info[i].name,
+                atomic_load_explicit(&metrics->counters[i], memory_order_relaxed));
+    }
+    fputs("# HELP ftps_command_duration_seconds Time from receiving a command to its "
+          "final reply.\n# TYPE ftps_command_duration_seconds summary\n", out);
+    for (unsigned i = 0; i < NVERBS; i++) {
+        char label[32];
+        snprintf(label, sizeof label, "verb=\"%s\"", verbs[i]);
+        write_summary(out, "ftps_command_duration_seconds", label, &metrics->commands[i]);
+    }
+    fputs("# HELP ftps_data_connection_setup_seconds Time to establish a data "
+          "connection.\n# TYPE ftps_data_connection_setup_seconds summary\n", out);
+    write_summary(out, "ftps_data_connection_setup_seconds", NULL, &metrics->data_setup);
+    if (fclose(out) == EOF || rename(tmp, export_path) == -1) {
+        logwarn("Main: failed to write metrics to '%s' (%s)", export_path, strerror(errno));
+    }
+}
+
+/* Export the metrics periodically. */
+static void *run_exporter(__attribute__((unused)) void *arg) {
+    for (;;) {
+        sleep(export_interval);
+        pthread_mutex_lock(&export_lock);
+        export();
+        pthread_mutex_unlock(&export_lock);
+    }
+    return NULL;
+}
+
+/* Export the metrics a last time. */
+static void export_at_exit(void) {
+    if (getpid() == exporter) {
+        pthread_mutex_lock(&export_lock);
+        export();
+        pthread_mutex_unlock(&export_lock);
+    }
+}
+
+/* Start exporting to path. */
+void metrics_start_export(const char *path, unsigned interval) {
+    if (!metrics) {
+        return;
+    }
+    export_path = strdup(path);
+    export_interval = interval;
+    exporter = getpid();
+    if (!export_path) {
+        logerr("Main: failed to allocate metrics path");
+        exit(EXIT_FAILURE);
+    }
+    /* Leave signals to the threads that expect them */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, run_exporter, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        logwarn("Main: metrics will only be written on exit (pthread_create: %s)",
+                strerror(err));
+    } else {
+        pthread_detach(tid);
+    }
+    atexit(export_at_exit);
+    loginfo("Main: writing metrics to '%s' every %u s", path, interval);
+}
@@ -0,0 +1,44 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * metrics.h
+ *
+ * Header for metrics.c
+ */
+
+#ifndef FTPS_METRICS_H
+#define FTPS_METRICS_H
+
+#include <stdint.h>
+
+/* Server-wide counters. */
+enum metrics_counter {
+    METRIC_SESSIONS,         /* Control connections accepted */
+    METRIC_SESSIONS_ACTIVE,  /* Control connections open now */
+    METRIC_LOGINS_FAILED,    /* USER or PASS refused */
+    METRIC_BYTES_IN,         /* File bytes received by STOR and APPE */
+    METRIC_BYTES_OUT,        /* File and listing bytes sent */
+    METRIC_RATE_LIMITED,     /* Connections or logins refused by a limit in ratelimit.c */
+    METRIC_COUNTERS,
+};
+
+/*
+ * Map the counters and histograms into memory shared with every process
+ * forked afterwards. Must be called before forking. Metrics are not kept if
+ * the memory cannot be mapped.
+ */
+void metrics_init(void);
+/* Add n, which may be negative, to counter. */
+void metrics_add(enum metrics_counter counter, int64_t n);
+/* Record that the command at index cmd in cmds.def took usec microseconds. */
+void metrics_command(unsigned cmd, uint64_t usec);
+/* Record that a data connection took usec microseconds to establish. */
+void metrics_data_setup(uint64_t usec);
+/*
+ * Write every metric in Prometheus text format to path every interval
+ * seconds from a background thread, and once more on exit. The file is
+ * replaced with rename(2) so readers never see it half written.
+ */
+void metrics_start_export(const char *path, unsigned interval);
+
+#endif /* FTPS_METRICS_H */
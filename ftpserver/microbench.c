@@ -0,0 +1,381 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * microbench.c
+ *
+ * Microbenchmarks for the primitives every control connection command goes
+ * through. Each one runs against in-memory socketpairs, synthetic command
+ * streams and a scratch data root, and reports nanoseconds and heap
+ * allocations per operation. client.c is included rather than linked so its
+ * static functions can be called directly.
+ *
+ * usage: ftps-microbench [-t MS] [-l INFO|WARN|ERROR] [-B] [FILTER]
+ */
+
+#include "client.c"
+
+#include <strings.h>
+#include <stdatomic.h>
+
+#define DEFAULT_RUN_MS (500U)
+#define MIN_BATCH_NS (10000000U)
+#define SOCK_CHUNK (4096U)
+
+/* Heap allocations made so far; counted by the --wrap'd allocators below. */
+static atomic_ulong allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_reallocarray(void *ptr, size_t nmemb, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+void *__wrap_reallocarray(void *ptr, size_t nmemb, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_reallocarray(ptr, nmemb, size);
+}
+
+/* A benchmark. run performs n operations and returns the nanoseconds they took. */
+struct bench {
+    const char *name;
+    uint64_t (*run)(uint64_t n);
+};
+
+/* The two ends of a socketpair: the server reads from or writes to srv. */
+static int srv = -1, peer = -1;
+/* A session reading from srv, as session_new() would set it up. */
+static struct session *sess;
+static char scratch_root[] = "/tmp/ftps-microbench.XXXXXX";
+
+/* Write all of buf to fd. */
+static void write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            perror("ftps-microbench: write");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* Read and discard everything waiting on fd. */
+static void drain(int fd) {
+    char buf[SOCK_CHUNK];
+    while (recv(fd, buf, sizeof buf, MSG_DONTWAIT) > 0) {
+        continue;
+    }
+}
+
+/* Read characters with getchar_from_sock(), SOCK_CHUNK bytes sent at a time. */
+static uint64_t bench_getchar_from_sock(uint64_t n) {
+    static char chunk[SOCK_CHUNK];
+    struct sockbuf buf = {.i=0, .size=0};
+    uint64_t elapsed = 0;
+    memset(chunk, 'x', sizeof chunk);
+    for (uint64_t done = 0; done < n; ) {
+        uint64_t batch = n - done < sizeof chunk ? n - done : sizeof chunk;
+        write_all(peer, chunk, batch);
+        uint64_t start = monotonic_ns();
+        for (uint64_t i = 0; i < batch; i++) {
+            if (getchar_from_sock(srv, &buf) <= 0) {
+                fputs("ftps-microbench: getchar_from_sock failed\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+        }
+        elapsed += monotonic_ns() - start;
+        done += batch;
+    }
+    return elapsed;
+}
+
+/* Append characters to vectors grown from the size replies start at, 256 each. */
+static uint64_t bench_vector_append(uint64_t n) {
+    uint64_t start = monotonic_ns();
+    for (uint64_t done = 0; done < n; ) {
+        struct vector vec;
+        vector_create(&vec, 16, 2);
+        for (unsigned i = 0; i < 256 && done < n; i++, done++) {
+            vector_append(&vec, (char)i);
+        }
+        vector_free(&vec);
+    }
+    return monotonic_ns() - start;
+}
+
+/* Queue single line replies; the queue is emptied as flush_replies() would. */
+static uint64_t bench_reply_with(uint64_t n) {
+    uint64_t start = monotonic_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        reply_with(sess, FILE_ACT_OK, NULL, false);
+        sess->replies.size = 0;
+    }
+    return monotonic_ns() - start;
+}
+
+/* Queue a reply and send it to the client, as after most commands. */
+static uint64_t bench_reply_flush(uint64_t n) {
+    uint64_t elapsed = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t start = monotonic_ns();
+        reply_with(sess, FILE_ACT_OK, NULL, false);
+        flush_replies(sess);
+        elapsed += monotonic_ns() - start;
+        if (i % 64 == 63) {
+            drain(peer);
+        }
+    }
+    drain(peer);
+    return elapsed;
+}
+
+/* Receive and parse a typical session's commands as session_on_ready() does. */
+static uint64_t bench_get_next_cmd(uint64_t n) {
+    static const char stream[] =
+        "USER alice\r\nPASS blowfish\r\nPWD\r\nCWD dir\r\nPASV\r\nLIST\r\n"
+        "TYPE I\r\nSIZE testfile.txt\r\nREST 1024\r\nEPSV\r\nRETR testfile.txt\r\n"
+        "MLST testfile.txt\r\nNOOP\r\nPORT 127,0,0,1,4,1\r\nSTOR upload.bin\r\nCDUP\r\n";
+    static const unsigned stream_cmds = 16;
+    char arg[MAX_ARG_LEN];
+    uint64_t elapsed = 0, done = 0;
+    while (done < n) {
+        write_all(peer, stream, sizeof stream - 1);
+        uint64_t start = monotonic_ns();
+        if (pi_recv(sess, MSG_DONTWAIT) != sizeof stream - 1) {
+            fputs("ftps-microbench: short read of command stream\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        while (sockbuf_line_ready(&sess->pi_buf)) {
+            get_next_cmd(sess, arg, sizeof arg);
+        }
+        elapsed += monotonic_ns() - start;
+        done += stream_cmds;
+    }
+    sess->replies.size = 0;  /* TYPE is not implemented */
+    return elapsed * n / done;
+}
+
+/* Open a file nested under the working directory, then close it. */
+static uint64_t bench_sandbox_open(uint64_t n) {
+    char vpath[PATH_MAX];
+    uint64_t start = monotonic_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        int fd = sandbox_open(sess->cwd_fd, "/", "a/b/file", O_RDONLY | O_CLOEXEC, 0, vpath);
+        if (fd == -1) {
+            perror("ftps-microbench: sandbox_open");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    return monotonic_ns() - start;
+}
+
+/* As bench_sandbox_open(), with ".." making the path resolve from the root. */
+static uint64_t bench_sandbox_open_dotdot(uint64_t n) {
+    char vpath[PATH_MAX];
+    uint64_t start = monotonic_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        int fd = sandbox_open(sess->cwd_fd, "/", "a/../a/b/file", O_RDONLY | O_CLOEXEC, 0,
+                              vpath);
+        if (fd == -1) {
+            perror("ftps-microbench: sandbox_open");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    return monotonic_ns() - start;
+}
+
+/* Format IPv4 and IPv6 addresses, alternately. */
+static uint64_t bench_addrtostr(uint64_t n) {
+    struct sockaddr_storage addrs[2];
+    memset(addrs, 0, sizeof addrs);
+    struct sockaddr_in *v4 = (struct sockaddr_in *)&addrs[0];
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)&addrs[1];
+    v4->sin_family = AF_INET;
+    v4->sin_port = htons(50123);
+    inet_pton(AF_INET, "192.168.100.200", &v4->sin_addr);
+    v6->sin6_family = AF_INET6;
+    v6->sin6_port = htons(50123);
+    inet_pton(AF_INET6, "2001:db8:85a3::8a2e:370:7334", &v6->sin6_addr);
+    volatile char sink;
+    uint64_t start = monotonic_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        sink = addrtostr(&addrs[i & 1])[0];
+    }
+    (void)sink;
+    return monotonic_ns() - start;
+}
+
+static const struct bench benches[] = {
+    {"getchar_from_sock", bench_getchar_from_sock},
+    {"vector_append", bench_vector_append},
+    {"reply_with", bench_reply_with},
+    {"reply_with+flush_replies", bench_reply_flush},
+    {"get_next_cmd", bench_get_next_cmd},
+    {"sandbox_open", bench_sandbox_open},
+    {"sandbox_open(..)", bench_sandbox_open_dotdot},
+    {"addrtostr", bench_addrtostr},
+};
+
+/* Create the scratch data root, with the file a/b/file, and a session on a socketpair. */
+static void setup(void) {
+    if (!mkdtemp(scratch_root)) {
+        perror("ftps-microbench: mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/a", scratch_root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof path, "%s/a/b", scratch_root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof path, "%s/a/b/file", scratch_root);
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("ftps-microbench: open");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    sandbox_init(scratch_root);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        perror("ftps-microbench: socketpair");
+        exit(EXIT_FAILURE);
+    }
+    srv = fds[0];
+    peer = fds[1];
+    const int bufsize = 1 << 20;
+    setsockopt(srv, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof bufsize);
+    setsockopt(peer, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof bufsize);
+
+    /* The parts of session_new() the benchmarks use; no greeting or socket options */
+    sess = calloc(1, sizeof *sess);
+    char vpath[PATH_MAX];
+    if (!sess || (sess->cwd_fd=sandbox_open(-1, "/", "/", O_PATH | O_DIRECTORY | O_CLOEXEC,
+                                            0, vpath)) == -1) {
+        fputs("ftps-microbench: failed to set up session\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    sess->id = 1;
+    sess->sockpi = srv;
+    sess->pasv_sock = sess->pasv_slot = sess->xfer_sock = sess->wake_fd = -1;
+    strcpy(sess->cwd, "/");
+    pthread_mutex_init(&sess->reply_lock, NULL);
+    pthread_mutex_init(&sess->xfer_lock, NULL);
+    vector_create(&sess->replies, 512, 2);
+}
+
+/* Remove the scratch data root. */
+static void teardown(void) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/a/b/file", scratch_root);
+    unlink(path);
+    snprintf(path, sizeof path, "%s/a/b", scratch_root);
+    rmdir(path);
+    snprintf(path, sizeof path, "%s/a", scratch_root);
+    rmdir(path);
+    rmdir(scratch_root);
+}
+
+/*
+ * Run b for about run_ms milliseconds in batches long enough for the clock
+ * not to matter, and print its cost per operation.
+ */
+static void measure(const struct bench *b, unsigned run_ms) {
+    uint64_t batch = 1;
+    while (b->run(batch) < MIN_BATCH_NS / 10 && batch < (UINT64_C(1) << 40)) {
+        batch *= 2;
+    }
+    batch *= 10;
+    uint64_t ops = 0, ns = 0;
+    unsigned long allocs = atomic_load(&allocations);
+    do {
+        ns += b->run(batch);
+        ops += batch;
+    } while (ns < (uint64_t)run_ms * 1000000U);
+    allocs = atomic_load(&allocations) - allocs;
+    printf("%-26s %12.1f %12.3f %14"PRIu64"\n", b->name, (double)ns / ops,
+           (double)allocs / ops, ops);
+}
+
+/* Prints usage information about how to invoke the application. */
+static void usage(void) {
+    fputs("usage: ftps-microbench [-t MS] [-l INFO|WARN|ERROR] [-B] [FILTER]\n"
+          "    -t MS - How long to run each benchmark (default 500)\n"
+          "    -l LEVEL - Log level, as log_level in ftps.conf (default INFO). The log is\n"
+          "               written to /dev/null\n"
+          "    -B - Log in the binary format\n"
+          "    FILTER - Only run benchmarks whose name contains FILTER\n",
+          stderr);
+}
+
+/* Main entry point. */
+int main(int argc, char *argv[]) {
+    unsigned run_ms = DEFAULT_RUN_MS;
+    enum log_level level = LOG_LEVEL_INFO;
+    bool binary = false;
+    int opt;
+    while ((opt=getopt(argc, argv, "t:l:B")) != -1) {
+        switch (opt) {
+            case 't':
+                run_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                if (strcasecmp(optarg, "INFO") == 0) level = LOG_LEVEL_INFO;
+                else if (strcasecmp(optarg, "WARN") == 0) level = LOG_LEVEL_WARN;
+                else if (strcasecmp(optarg, "ERROR") == 0) level = LOG_LEVEL_ERROR;
+                else {
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                binary = true;
+                break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind > 1 || run_ms == 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    const char *filter = optind < argc ? argv[optind] : NULL;
+
+    loginit("/dev/null");
+    logsetlevel(level);
+    if (binary) {
+        logsetformat(LOG_FORMAT_BINARY);
+    }
+    setup();
+    printf("%-26s %12s %12s %14s\n", "benchmark", "ns/op", "allocs/op", "ops");
+    for (size_t i = 0; i < sizeof benches / sizeof *benches; i++) {
+        if (!filter || strstr(benches[i].name, filter)) {
+            measure(&benches[i], run_ms);
+        }
+    }
+    teardown();
+    fflush(stdout);
+    if (logdropped() > 0) {
+        fprintf(stderr, "ftps-microbench: %lu log messages dropped\n", logdropped());
+    }
+    return EXIT_SUCCESS;
+}
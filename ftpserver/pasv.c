@@ -0,0 +1,118 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * pasv.c
+ *
+ * This module manages the pool of listen sockets used for passive data
+ * connections. Every port in the configured range is bound once at startup,
+ * before any process is forked, and leased to one session at a time. Leases
+ * live in shared memory so every process serving clients sees them.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "cfgparse.h"
+#include "pasv.h"
+
+#define PASV_BACKLOG (16)
+
+/* Listen sockets for every port in the range, indexed by port - min port. */
+static int *listeners;
+/* Number of ports in the pool. */
+static unsigned nports;
+/* Process holding each listener or 0 if free. Shared by every process. */
+static pid_t *owners;
+/* Where the next search for a free listener starts. */
+static unsigned next_slot;
+
+/* Accept and close connections left over from a previous lease of slot. */
+static void drain_listener(unsigned slot) {
+    int sock;
+    while ((sock=accept(listeners[slot], NULL, NULL)) >= 0) {
+        close(sock);
+    }
+}
+
+/* Bind and listen on every port in the configured passive port range. */
+void pasv_pool_init(void) {
+    if (ftps_config.pasv_min_port == 0) {
+        return;
+    }
+    nports = ftps_config.pasv_max_port - ftps_config.pasv_min_port + 1;
+    listeners = calloc(nports, sizeof *listeners);
+    owners = mmap(NULL, nports * sizeof *owners, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (!listeners || owners == MAP_FAILED) {
+        logerr("Main: failed to allocate passive port pool");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < nports; i++) {
+        uint16_t port = ftps_config.pasv_min_port + i;
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (sock < 0) {
+            logerr("Main: failed to create passive socket (socket: %s)", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        const int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        if (bind(sock, (struct sockaddr *)&addr, sizeof addr) < 0) {
+            logerr("Main: error binding passive port %u (bind: %s)", port, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (listen(sock, PASV_BACKLOG) < 0) {
+            logerr("Main: error listening on passive port %u (listen: %s)",
+                   port, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        listeners[i] = sock;
+    }
+    loginfo("Main: passive ports %u-%u ready",
+            ftps_config.pasv_min_port, ftps_config.pasv_max_port);
+}
+
+/* Lease a listener from the pool. */
+int pasv_lease(int af, int *slot) {
+    if (!owners || af != AF_INET) {
+        return -1;
+    }
+    const pid_t self = getpid();
+    const unsigned start = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+    /* Take a free listener; failing that, one held by a process that died */
+    for (int pass = 0; pass < 2; pass++) {
+        for (unsigned n = 0; n < nports; n++) {
+            unsigned i = (start + n) % nports;
+            pid_t owner = __atomic_load_n(&owners[i], __ATOMIC_RELAXED);
+            if (owner != 0 && (pass == 0 || kill(owner, 0) == 0 || errno != ESRCH)) {
+                continue;
+            }
+            if (__atomic_compare_exchange_n(&owners[i], &owner, self, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                drain_listener(i);
+                *slot = i;
+                return listeners[i];
+            }
+        }
+    }
+    return -1;
+}
+
+/* Return a leased listener to the pool. */
+void pasv_release(int slot) {
+    __atomic_store_n(&owners[slot], 0, __ATOMIC_RELEASE);
+}
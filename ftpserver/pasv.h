@@ -0,0 +1,27 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * pasv.h
+ *
+ * Header for pasv.c
+ */
+
+#ifndef FTPS_PASV_H
+#define FTPS_PASV_H
+
+/*
+ * Bind and listen on every port in the passive port range set in the config
+ * file. Does nothing if no range is set. Must be called before forking so
+ * every process shares the listeners. Quits with an error on failure.
+ */
+void pasv_pool_init(void);
+/*
+ * Lease a non-blocking listener for a data connection of address family af.
+ * Returns the listen socket and stores its slot in slot, or returns -1 if the
+ * pool is not set up, does not support af or has no free listener.
+ */
+int pasv_lease(int af, int *slot);
+/* Return the listener leased under slot to the pool. */
+void pasv_release(int slot);
+
+#endif /* FTPS_PASV_H */
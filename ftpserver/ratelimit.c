@@ -0,0 +1,340 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * ratelimit.c
+ *
+ * This module limits how fast one IPv4 address may connect and attempt to log
+ * in, and how many sessions may be logged in as one user at once. Both tables
+ * live in shared memory so every process serving clients enforces the same
+ * limits, and are updated with compare-and-swap only.
+ *
+ * Each address has a connection and a login token bucket, each packed into a
+ * 64-bit word holding the time it was last refilled in milliseconds and the
+ * thousandths of a token left. Addresses probe a few slots of a fixed table
+ * and take over the one idle longest when all are in use, so the table never
+ * fills up; an address pushed out starts again with full buckets.
+ *
+ * Users are counted in a table of 64-bit words holding 48 bits of the hash of
+ * the name and the number of sessions. A word whose count drops to zero may
+ * be taken over by another user. Every count is backed by a lease naming the
+ * process holding it, like the passive port pool, so the counts of a process
+ * that died without logging out are reclaimed when its user hits the limit.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "misc.h"
+#include "cfgparse.h"
+#include "metrics.h"
+#include "ratelimit.h"
+
+#define ADDR_SLOTS (16384U)
+#define ADDR_PROBES (8U)
+#define USER_SLOTS (65536U)
+#define USER_PROBES (16U)
+#define TOKEN_BITS (24U)
+#define TOKEN_MASK ((UINT64_C(1) << TOKEN_BITS) - 1)
+#define TOKEN (1000U)
+#define COUNT_BITS (16U)
+#define COUNT_MASK ((UINT64_C(1) << COUNT_BITS) - 1)
+#define LEASE_SLOTS (65536U)
+#define SLOT_BITS (32U)
+
+/* Token buckets of one address; a bucket of 0 has not been used yet. */
+struct addr_entry {
+    _Atomic uint32_t addr;  /* IPv4 address in network byte order or 0 if free */
+    _Atomic uint64_t conn;
+    _Atomic uint64_t login;
+};
+
+static struct addr_entry *addrs;
+static _Atomic uint64_t *users;
+/* Leases of user counts: holder pid << SLOT_BITS | slot in users, or 0 if free */
+static _Atomic uint64_t *leases;
+
+/* Map the shared tables of the limits that are set. */
+void ratelimit_init(void) {
+    if (ftps_config.ip_conn_rate != 0 || ftps_config.ip_login_rate != 0) {
+        addrs = mmap(NULL, ADDR_SLOTS * sizeof *addrs, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (addrs == MAP_FAILED) {
+            logerr("Main: failed to map rate limit table (mmap: %s)", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (ftps_config.user_max_sessions != 0) {
+        users = mmap(NULL, USER_SLOTS * sizeof *users, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        leases = mmap(NULL, LEASE_SLOTS * sizeof *leases, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (users == MAP_FAILED || leases == MAP_FAILED) {
+            logerr("Main: failed to map user session table (mmap: %s)", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Return the IPv4 address of addr in network byte order, or 0 if it has none. */
+static uint32_t ipv4_of(const struct sockaddr_storage *addr) {
+    if (addr->ss_family == AF_INET) {
+        return ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6)) {
+            uint32_t v4;
+            memcpy(&v4, &a6->s6_addr[12], sizeof v4);
+            return v4;
+        }
+    }
+    return 0;
+}
+
+/* Return the time a bucket was last refilled. */
+static uint64_t refilled_at(uint64_t bucket) {
+    return bucket >> TOKEN_BITS;
+}
+
+/*
+ * Return the entry of addr, taking over a free slot or the one idle longest
+ * if it has none. Returns NULL if other processes keep taking the slots.
+ */
+static struct addr_entry *find_addr(uint32_t addr) {
+    uint32_t i = (addr * 2654435761U) >> 18;  /* Fibonacci hash to 14 bits */
+    struct addr_entry *victim = NULL;
+    uint64_t victim_time = UINT64_MAX;
+    for (unsigned probe = 0; probe < ADDR_PROBES; probe++) {
+        struct addr_entry *e = &addrs[(i + probe) % ADDR_SLOTS];
+        uint32_t cur = atomic_load_explicit(&e->addr, memory_order_acquire);
+        if (cur == addr) {
+            return e;
+        } else if (cur == 0) {
+            if (atomic_compare_exchange_strong(&e->addr, &cur, addr) || cur == addr) {
+                return e;
+            }
+        }
+        uint64_t used = refilled_at(atomic_load_explicit(&e->conn, memory_order_relaxed));
+        uint64_t login = refilled_at(atomic_load_explicit(&e->login, memory_order_relaxed));
+        used = login > used ? login : used;
+        if (used < victim_time) {
+            victim = e;
+            victim_time = used;
+        }
+    }
+    uint32_t cur = atomic_load_explicit(&victim->addr, memory_order_acquire);
+    if (cur != addr && !atomic_compare_exchange_strong(&victim->addr, &cur, addr)) {
+        return cur == addr ? victim : NULL;
+    }
+    atomic_store_explicit(&victim->conn, 0, memory_order_relaxed);
+    atomic_store_explicit(&victim->login, 0, memory_order_relaxed);
+    return victim;
+}
+
+/*
+ * Refill bucket at rate tokens per minute up to burst tokens and take a
+ * token. Returns false if there is none.
+ */
+static bool take(_Atomic uint64_t *bucket, unsigned rate, unsigned burst) {
+    const uint64_t now = monotonic_ns() / 1000000, full = (uint64_t)burst * TOKEN;
+    uint64_t old = atomic_load_explicit(bucket, memory_order_relaxed);
+    for (;;) {
+        uint64_t tokens = full, then = now;
+        if (old != 0) {
+            tokens = old & TOKEN_MASK;
+            then = refilled_at(old);
+            if (now > then) {
+                /* Keep the time not yet worth a thousandth so slow rates still refill */
+                uint64_t added = (now - then) * rate / 60;
+                tokens += added;
+                then += added * 60 / rate;
+            }
+            if (tokens >= full) {
+                tokens = full;
+                then = now > then ? now : then;
+            }
+        }
+        if (tokens < TOKEN) {
+            return false;
+        }
+        uint64_t new = then << TOKEN_BITS | (tokens - TOKEN);
+        if (atomic_compare_exchange_weak_explicit(bucket, &old, new, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+/* Take a token from the connection bucket of an address. */
+bool ratelimit_connection(const struct sockaddr_storage *addr) {
+    uint32_t v4;
+    struct addr_entry *e;
+    if (ftps_config.ip_conn_rate == 0 || (v4=ipv4_of(addr)) == 0 || !(e=find_addr(v4))) {
+        return true;
+    }
+    if (take(&e->conn, ftps_config.ip_conn_rate, ftps_config.ip_conn_burst)) {
+        return true;
+    }
+    metrics_add(METRIC_RATE_LIMITED, 1);
+    return false;
+}
+
+/* Take a token from the login bucket of an address. */
+bool ratelimit_login(const struct sockaddr_storage *addr) {
+    uint32_t v4;
+    struct addr_entry *e;
+    if (ftps_config.ip_login_rate == 0 || (v4=ipv4_of(addr)) == 0 || !(e=find_addr(v4))) {
+        return true;
+    }
+    if (take(&e->login, ftps_config.ip_login_rate, ftps_config.ip_login_burst)) {
+        return true;
+    }
+    metrics_add(METRIC_RATE_LIMITED, 1);
+    return false;
+}
+
+/* Take one session off the count in slot if it still has any. */
+static void uncount(uint32_t slot) {
+    uint64_t cur = atomic_load_explicit(&users[slot], memory_order_relaxed);
+    while ((cur & COUNT_MASK) > 0 && !atomic_compare_exchange_weak(&users[slot], &cur, cur - 1)) {
+        continue;
+    }
+}
+
+/*
+ * Lease a count in slot to this process. Returns the ticket releasing it or 0
+ * if every lease is taken.
+ */
+static uint64_t lease(uint32_t slot) {
+    const uint64_t self = (uint64_t)getpid() << SLOT_BITS | slot;
+    const uint32_t start = (uint32_t)getpid() * 2654435761U % LEASE_SLOTS;
+    for (uint32_t n = 0; n < LEASE_SLOTS; n++) {
+        uint32_t i = (start + n) % LEASE_SLOTS;
+        uint64_t cur = 0;
+        if (atomic_load_explicit(&leases[i], memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&leases[i], &cur, self))
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Release the counts in slot leased by processes that no longer exist.
+ * Returns true if any was released.
+ */
+static bool reclaim(uint32_t slot) {
+    bool reclaimed = false;
+    for (uint32_t i = 0; i < LEASE_SLOTS; i++) {
+        uint64_t cur = atomic_load_explicit(&leases[i], memory_order_relaxed);
+        if (cur == 0 || (cur & ((UINT64_C(1) << SLOT_BITS) - 1)) != slot) {
+            continue;
+        }
+        pid_t holder = cur >> SLOT_BITS;
+        if ((kill(holder, 0) == -1 && errno == ESRCH) &&
+            atomic_compare_exchange_strong(&leases[i], &cur, 0))
+        {
+            loginfo("Main: releasing a session count held by exited process %d", (int)holder);
+            uncount(slot);
+            reclaimed = true;
+        }
+    }
+    return reclaimed;
+}
+
+/* Count a session of uname. */
+bool ratelimit_user_acquire(const char *uname, uint64_t *ticket) {
+    *ticket = 0;
+    if (!users) {
+        return true;
+    }
+    uint64_t h = 14695981039346656037U;  /* FNV-1a */
+    for (const char *p = uname; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 1099511628211U;
+    }
+    const uint64_t key = (h >> COUNT_BITS) ? (h >> COUNT_BITS) : 1;
+    const uint32_t start = h % USER_SLOTS;
+    bool reclaimed = false;
+    /* Retry if another process takes the free slot picked below first */
+    for (int attempt = 0; attempt < 4; attempt++) {
+        int slot = -1, free_slot = -1;
+        uint64_t free_word = 0;
+        for (unsigned probe = 0; probe < USER_PROBES && slot == -1; probe++) {
+            uint32_t i = (start + probe) % USER_SLOTS;
+            uint64_t word = atomic_load_explicit(&users[i], memory_order_relaxed);
+            while (word >> COUNT_BITS == key) {
+                if ((word & COUNT_MASK) >= ftps_config.user_max_sessions) {
+                    /* Some of the sessions may belong to processes that died */
+                    if (!reclaimed) {
+                        reclaimed = true;
+                        if (reclaim(i)) {
+                            word = atomic_load_explicit(&users[i], memory_order_relaxed);
+                            continue;
+                        }
+                    }
+                    metrics_add(METRIC_RATE_LIMITED, 1);
+                    return false;
+                }
+                if (atomic_compare_exchange_weak(&users[i], &word, word + 1)) {
+                    slot = i;
+                    break;
+                }
+            }
+            if (slot == -1 && (word & COUNT_MASK) == 0 && free_slot == -1) {
+                free_slot = i;
+                free_word = word;
+            }
+        }
+        if (slot == -1 && free_slot != -1 &&
+            atomic_compare_exchange_strong(&users[free_slot], &free_word, key << COUNT_BITS | 1))
+        {
+            slot = free_slot;
+        }
+        if (slot != -1) {
+            if ((*ticket=lease(slot)) == 0) {
+                uncount(slot);
+                break;
+            }
+            return true;
+        }
+        if (free_slot == -1) {
+            break;
+        }
+    }
+    logwarn("Main: user session table full; not limiting sessions of '%s'", uname);
+    return true;
+}
+
+/* Stop counting a session. */
+void ratelimit_user_release(uint64_t ticket) {
+    if (ticket == 0) {
+        return;
+    }
+    _Atomic uint64_t *l = &leases[ticket - 1];
+    uint64_t cur = atomic_load_explicit(l, memory_order_relaxed);
+    /* The lease is only gone if this process was taken for dead after a pid reuse */
+    if (cur >> SLOT_BITS == (uint64_t)getpid() && atomic_compare_exchange_strong(l, &cur, 0)) {
+        uncount(cur & ((UINT64_C(1) << SLOT_BITS) - 1));
+    }
+}
+
+/* Refuse a connection with a 421 reply. */
+void ratelimit_refuse(int sock) {
+    static const char reply[] = "421 Too many connections from your address; try again later.\r\n";
+    if (send(sock, reply, sizeof reply - 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        loginfo("Main: failed to send 421 to refused connection (send: %s)", strerror(errno));
+    }
+    close(sock);
+}
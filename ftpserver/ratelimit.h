@@ -0,0 +1,48 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * ratelimit.h
+ *
+ * Header for ratelimit.c
+ */
+
+#ifndef FTPS_RATELIMIT_H
+#define FTPS_RATELIMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+/*
+ * Map the tables of per-address token buckets and per-user session counts
+ * into memory shared with every process forked afterwards. Does nothing if
+ * no limit is set in the config file. Must be called before forking.
+ */
+void ratelimit_init(void);
+/*
+ * Take a token from the connection bucket of addr. Returns false if the
+ * address has run out and the connection should be refused.
+ */
+bool ratelimit_connection(const struct sockaddr_storage *addr);
+/*
+ * Take a token from the login bucket of addr. Returns false if the address
+ * has run out and the login attempt should be refused.
+ */
+bool ratelimit_login(const struct sockaddr_storage *addr);
+/*
+ * Count a new session logged in as uname and store the ticket that releases
+ * it in ticket, 0 if nothing needs releasing. The count is held by the
+ * calling process and released by any later call for uname once that process
+ * has exited. Returns false without counting it if uname already has as many
+ * sessions as allowed.
+ */
+bool ratelimit_user_acquire(const char *uname, uint64_t *ticket);
+/* Stop counting the session ticket was returned for, unless ticket is 0. */
+void ratelimit_user_release(uint64_t ticket);
+/*
+ * Send a 421 reply to a connection refused by ratelimit_connection() without
+ * blocking and close it.
+ */
+void ratelimit_refuse(int sock);
+
+#endif /* FTPS_RATELIMIT_H */
@@ -0,0 +1,118 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * reactor.c
+ *
+ * This module implements the single-process server model. Every client
+ * connection is a session driven by an epoll(7) loop instead of a forked
+ * process. Client sockets are non-blocking and watched edge-triggered for
+ * both input and room to send replies, so a client that stops reading cannot
+ * stall the loop.
+ */
+
+#define _GNU_SOURCE  /* accept4(2) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "misc.h"
+#include "client.h"
+#include "ratelimit.h"
+#include "reactor.h"
+
+#define MAX_EVENTS (64U)
+
+/*
+ * Accept every pending connection on socklisten and register it with epfd.
+ * next_id is the connection ID handed to the next session and is advanced by
+ * id_step for each accepted connection.
+ */
+static void accept_pending(int epfd, int socklisten, int *next_id, int id_step) {
+    while (true) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof addr;
+        int sockclient = accept4(socklisten, (struct sockaddr *)&addr, &addrlen,
+                                 SOCK_NONBLOCK);
+        if (sockclient == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                logwarn("Main: error accepting a connection (accept4: %s)", strerror(errno));
+            }
+            return;
+        }
+        if (!ratelimit_connection(&addr)) {
+            loginfo("Main: refused a connection from %s (ip_conn_rate)", addrtostr(&addr));
+            ratelimit_refuse(sockclient);
+            continue;
+        }
+        loginfo("Main: accepted a connection from %s", addrtostr(&addr));
+        const int id = *next_id;
+        *next_id += id_step;
+        struct session *s = session_new(id, sockclient);
+        if (!s) {
+            close(sockclient);
+            continue;
+        }
+        /* Edge-triggered, so a transfer thread leaving replies queued is woken for too */
+        struct epoll_event ev = {.events=EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr=s};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockclient, &ev) == -1) {
+            logerr("Conn %d: failed to watch connection (epoll_ctl: %s)",
+                   id, strerror(errno));
+            session_free(s);
+        }
+    }
+}
+
+/*
+ * Accept connections on socklisten and serve every client from this process
+ * until *running becomes false.
+ */
+void run_reactor(int socklisten, const bool *running, int first_id, int id_step) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        logerr("Main: failed to create epoll instance (epoll_create1: %s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int flags = fcntl(socklisten, F_GETFL);
+    if (flags == -1 || fcntl(socklisten, F_SETFL, flags | O_NONBLOCK) == -1) {
+        logerr("Main: failed to make listen socket non-blocking (fcntl: %s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    /* The listen socket is the only event source without a session */
+    struct epoll_event ev = {.events=EPOLLIN, .data.ptr=NULL};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, socklisten, &ev) == -1) {
+        logerr("Main: failed to watch listen socket (epoll_ctl: %s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    loginfo("Main: now accepting connections (epoll)");
+    int next_id = first_id;
+    struct epoll_event events[MAX_EVENTS];
+    while (*running) {
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (nready == -1) {
+            if (errno != EINTR) {
+                logerr("Main: error waiting for events (epoll_wait: %s)", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (int i = 0; i < nready; i++) {
+            struct session *s = events[i].data.ptr;
+            if (!s) {
+                accept_pending(epfd, socklisten, &next_id, id_step);
+            } else if (!session_on_ready(s)) {
+                session_free(s);  /* Closing the socket removes it from epfd */
+            }
+        }
+    }
+    close(epfd);
+}
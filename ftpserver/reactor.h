@@ -0,0 +1,22 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * reactor.h
+ *
+ * Header for reactor.c
+ */
+
+#ifndef FTPS_REACTOR_H
+#define FTPS_REACTOR_H
+
+#include <stdbool.h>
+
+/*
+ * Accept connections on socklisten and serve every client from this process
+ * until *running becomes false. Connections are numbered first_id,
+ * first_id+id_step, first_id+2*id_step, ... so that several reactors can
+ * hand out distinct connection IDs.
+ */
+void run_reactor(int socklisten, const bool *running, int first_id, int id_step);
+
+#endif /* FTPS_REACTOR_H */
@@ -0,0 +1,191 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * sandbox.c
+ *
+ * This module resolves client paths inside the server root. The root stays
+ * open for the life of the server and each session keeps its working
+ * directory open, so a lookup is a single openat2(2) call relative to one of
+ * them and the kernel keeps it from leaving the root. Kernels without
+ * openat2(2) fall back to realpath(3) and a check that the result is inside
+ * the root.
+ */
+
+#define _GNU_SOURCE  /* O_PATH */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "sandbox.h"
+
+/* Times a lookup is retried when openat2(2) reports a concurrent rename. */
+#define MAX_RESOLVE_RETRIES (8U)
+
+/* Directory every path is resolved inside. */
+static int root_fd = -1;
+/* Canonical path of the root, used by the realpath(3) fallback. */
+static char root_path[PATH_MAX];
+static size_t root_len;
+/* True if the kernel supports openat2(2). */
+static bool have_openat2;
+
+/* Call openat2(2), retrying if a rename raced with the lookup. */
+static int openat2_retry(int dirfd, const char *path, int flags, mode_t mode,
+                         unsigned long long resolve) {
+    struct open_how how = {
+        .flags=flags,
+        .mode=(flags & O_CREAT) ? mode : 0,
+        .resolve=resolve | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = -1;
+    for (unsigned tries = 0; tries < MAX_RESOLVE_RETRIES; tries++) {
+        fd = syscall(SYS_openat2, dirfd, path, &how, sizeof how);
+        if (fd != -1 || errno != EAGAIN) {
+            break;
+        }
+    }
+    return fd;
+}
+
+/*
+ * Apply path to the virtual directory cwd and store the result in vpath,
+ * with no ".", ".." or empty components left. simple is set to true if path
+ * is relative and contains no "..". Returns -1 if the result is too long.
+ */
+static int normalize(const char *cwd, const char *path, char vpath[PATH_MAX], bool *simple) {
+    size_t len = 0;
+    vpath[0] = '\0';
+    *simple = path[0] != '/';
+    const char *parts[] = {path[0] == '/' ? "" : cwd, path};
+    for (unsigned i = 0; i < 2; i++) {
+        for (const char *p = parts[i]; *p; ) {
+            size_t n = strcspn(p, "/");
+            if (n == 2 && p[0] == '.' && p[1] == '.') {
+                *simple = *simple && i == 0;
+                while (len > 0 && vpath[--len] != '/');
+                vpath[len] = '\0';
+            } else if (n > 0 && !(n == 1 && p[0] == '.')) {
+                if (len + n + 1 >= PATH_MAX) {
+                    errno = ENAMETOOLONG;
+                    return -1;
+                }
+                vpath[len++] = '/';
+                memcpy(&vpath[len], p, n);
+                len += n;
+                vpath[len] = '\0';
+            }
+            p += n;
+            while (*p == '/') p++;
+        }
+    }
+    if (len == 0) {
+        strcpy(vpath, "/");
+    }
+    return 0;
+}
+
+/*
+ * Open vpath by resolving it with realpath(3) and checking it is inside the
+ * root. The resolved path has no symbolic links left, so it is opened with
+ * O_NOFOLLOW to refuse a link put in place of its last component since.
+ */
+static int open_fallback(const char *vpath, int flags, mode_t mode) {
+    char host[PATH_MAX];
+    if ((size_t)snprintf(host, sizeof host, "%s%s", root_path, vpath) >= sizeof host) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* A file being created may not exist yet, so then only its directory is resolved */
+    const char *name = NULL;
+    char real[PATH_MAX];
+    if (!realpath(host, real)) {
+        if (!(flags & O_CREAT) || errno != ENOENT) {
+            return -1;
+        }
+        char *slash = strrchr(host, '/');
+        if (slash[1] == '\0') {
+            errno = EISDIR;
+            return -1;
+        }
+        *slash = '\0';
+        name = slash + 1;
+        if (!realpath(host, real)) {
+            return -1;
+        }
+    }
+    if (strncmp(real, root_path, root_len) != 0 ||
+        (real[root_len] != '/' && real[root_len] != '\0'))
+    {
+        errno = EXDEV;
+        return -1;
+    }
+    if (name) {
+        size_t len = strlen(real);
+        if (len + strlen(name) + 1 >= sizeof real) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        real[len] = '/';
+        strcpy(&real[len + 1], name);
+    }
+    return open(real, flags | O_NOFOLLOW, mode);
+}
+
+/* Open the server root and pick how paths are resolved. */
+void sandbox_init(const char *root) {
+    if (!realpath(root, root_path)) {
+        logerr("Main: cannot get canonical path for data root (realpath: %s)",
+               strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    root_len = strlen(root_path);
+    root_fd = open(root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        logerr("Main: cannot open data root (open: %s)", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int fd = openat2_retry(root_fd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC, 0, RESOLVE_IN_ROOT);
+    if (fd == -1) {
+        logwarn("Main: openat2 unavailable; resolving paths with realpath (%s)",
+                strerror(errno));
+    } else {
+        have_openat2 = true;
+        close(fd);
+    }
+}
+
+/* Open a client path inside the root. */
+int sandbox_open(int cwd_fd, const char *cwd, const char *path, int flags, mode_t mode,
+                 char vpath[PATH_MAX]) {
+    bool simple;
+    if (normalize(cwd, path, vpath, &simple) == -1) {
+        return -1;
+    }
+    if (!have_openat2) {
+        return open_fallback(vpath, flags, mode);
+    }
+
+    /*
+     * A relative path without ".." is looked up from the working directory.
+     * If it leaves the directory through a symbolic link, it is resolved
+     * again from the root.
+     */
+    if (simple && cwd_fd >= 0) {
+        int fd = openat2_retry(cwd_fd, path[0] ? path : ".", flags, mode, RESOLVE_BENEATH);
+        if (fd != -1 || errno != EXDEV) {
+            return fd;
+        }
+    }
+    return openat2_retry(root_fd, vpath[1] ? &vpath[1] : ".", flags, mode, RESOLVE_IN_ROOT);
+}
@@ -0,0 +1,33 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * sandbox.h
+ *
+ * Header for sandbox.c
+ */
+
+#ifndef FTPS_SANDBOX_H
+#define FTPS_SANDBOX_H
+
+#include <limits.h>
+#include <sys/types.h>
+
+/*
+ * Open the directory at root, which every path is later resolved inside, and
+ * check which way the kernel supports resolving them. Must be called before
+ * forking. Quits with an error on failure.
+ */
+void sandbox_init(const char *root);
+/*
+ * Open path as open(2) does with flags and mode, resolving it against the
+ * virtual working directory cwd ("/" or "/dir/") open at cwd_fd, and store
+ * its virtual path in vpath. "." and ".." are applied to the virtual path
+ * first, with ".." at "/" staying there. The kernel then resolves the result
+ * inside the root, also keeping symbolic links inside it, so a path can never
+ * name a file outside the root. Returns the file descriptor or -1 with errno
+ * set.
+ */
+int sandbox_open(int cwd_fd, const char *cwd, const char *path, int flags, mode_t mode,
+                 char vpath[PATH_MAX]);
+
+#endif /* FTPS_SANDBOX_H */
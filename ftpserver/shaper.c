@@ -0,0 +1,264 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * shaper.c
+ *
+ * This module limits the bandwidth of file transfers per session, per user
+ * and for the whole server. Every transfer reserves each chunk of data in the
+ * bucket of its session, of its user and in the global bucket before moving
+ * it, so it runs no faster than the tightest of the three.
+ *
+ * A bucket is the single time at which everything reserved in it is paid off
+ * at its rate (the theoretical arrival time of GCRA). Reserving a chunk moves
+ * that time forward by the chunk's cost, and the chunk may be moved once the
+ * time is less than BURST_NS ahead, so a bucket left idle allows a short burst
+ * and is otherwise drained at exactly its rate. The user and global buckets
+ * live in shared memory and are updated with compare-and-swap only. Users
+ * hash to a few slots of a fixed table and take over one whose bucket has been
+ * idle for a while when all are in use.
+ */
+
+#define _GNU_SOURCE  /* ppoll(2) */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "misc.h"
+#include "cfgparse.h"
+#include "shaper.h"
+
+#define NS (1000000000U)
+/* How far ahead of its rate a bucket may run, in nanoseconds */
+#define BURST_NS (100000000U)
+/* A user's bucket idle this long may be taken over by another user */
+#define IDLE_NS (1000000000U)
+/* Chunks are sized to take this long at the tightest rate... */
+#define CHUNKS_PER_SEC (100U)
+/* ...within these bounds, in bytes */
+#define MIN_CHUNK (4096U)
+#define MAX_CHUNK (1U << 20)
+#define USER_SLOTS (4096U)
+#define USER_PROBES (8U)
+
+/* Bucket of one user; a key of 0 marks a free slot. */
+struct user_bucket {
+    _Atomic uint64_t key;
+    _Atomic uint64_t tat;
+};
+
+/* Limits in bytes per second; 0 for none */
+static uint64_t session_rate, user_rate, global_rate;
+/* Size of the chunks reserved at a time */
+static size_t chunk_size;
+static struct user_bucket *users;
+static _Atomic uint64_t *global_tat;
+
+/* Map memory shared with child processes. */
+static void *map_shared(size_t len, const char *what) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        logerr("Main: failed to map %s (mmap: %s)", what, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Map the shared buckets of the limits that are set. */
+void shaper_init(void) {
+    session_rate = (uint64_t)ftps_config.session_rate * 1024;
+    user_rate = (uint64_t)ftps_config.user_rate * 1024;
+    global_rate = (uint64_t)ftps_config.global_rate * 1024;
+    uint64_t tightest = UINT64_MAX;
+    const uint64_t rates[] = {session_rate, user_rate, global_rate};
+    for (size_t i = 0; i < sizeof rates / sizeof *rates; i++) {
+        if (rates[i] != 0 && rates[i] < tightest) {
+            tightest = rates[i];
+        }
+    }
+    if (tightest == UINT64_MAX) {
+        return;
+    }
+    chunk_size = tightest / CHUNKS_PER_SEC;
+    if (chunk_size < MIN_CHUNK) {
+        chunk_size = MIN_CHUNK;
+    } else if (chunk_size > MAX_CHUNK) {
+        chunk_size = MAX_CHUNK;
+    }
+    if (user_rate != 0) {
+        users = map_shared(USER_SLOTS * sizeof *users, "user bandwidth table");
+    }
+    if (global_rate != 0) {
+        global_tat = map_shared(sizeof *global_tat, "global bandwidth bucket");
+    }
+}
+
+/*
+ * Return the slot of the bucket of key, taking over a free slot or the one
+ * idle longest if it has none. Returns -1 if every slot is busy.
+ */
+static int find_user(uint64_t key) {
+    const uint64_t now = monotonic_ns();
+    int victim = -1;
+    uint64_t victim_tat = now - IDLE_NS;
+    for (unsigned probe = 0; probe < USER_PROBES; probe++) {
+        unsigned slot = (key + probe) % USER_SLOTS;
+        uint64_t cur = atomic_load_explicit(&users[slot].key, memory_order_acquire);
+        if (cur == key) {
+            return slot;
+        } else if (cur == 0) {
+            if (atomic_compare_exchange_strong(&users[slot].key, &cur, key) || cur == key) {
+                return slot;
+            }
+        }
+        uint64_t tat = atomic_load_explicit(&users[slot].tat, memory_order_relaxed);
+        if (tat < victim_tat) {
+            victim = slot;
+            victim_tat = tat;
+        }
+    }
+    if (victim == -1) {
+        return -1;
+    }
+    uint64_t cur = atomic_load_explicit(&users[victim].key, memory_order_acquire);
+    if (cur != key && !atomic_compare_exchange_strong(&users[victim].key, &cur, key)) {
+        return cur == key ? victim : -1;
+    }
+    atomic_store_explicit(&users[victim].tat, 0, memory_order_relaxed);
+    return victim;
+}
+
+/* Set up sh for a transfer by uname. */
+void shaper_begin(struct shaper *sh, const char *uname) {
+    sh->active = chunk_size != 0;
+    sh->user_key = 0;
+    sh->user_slot = -1;
+    if (!users) {
+        return;
+    }
+    uint64_t h = 14695981039346656037U;  /* FNV-1a */
+    for (const char *p = uname; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 1099511628211U;
+    }
+    sh->user_key = h ? h : 1;
+    sh->user_slot = find_user(sh->user_key);
+    if (sh->user_slot == -1) {
+        logwarn("Main: user bandwidth table full; not limiting user '%s'", uname);
+    }
+}
+
+/* Return true if sh limits the transfer. */
+bool shaper_active(const struct shaper *sh) {
+    return sh && sh->active;
+}
+
+/* Return how long n bytes take at rate bytes per second, in nanoseconds. */
+static uint64_t cost_of(size_t n, uint64_t rate) {
+    return (uint64_t)n * NS / rate;
+}
+
+/*
+ * Return how long to wait before moving bytes reserved in a bucket that was
+ * paid off at tat before the reservation.
+ */
+static uint64_t wait_for(uint64_t tat, uint64_t now) {
+    return tat > now + BURST_NS ? tat - now - BURST_NS : 0;
+}
+
+/* Reserve cost in the shared bucket *tat and return how long to wait. */
+static uint64_t charge(_Atomic uint64_t *tat, uint64_t cost, uint64_t now) {
+    uint64_t old = atomic_load_explicit(tat, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(tat, &old, (old > now ? old : now) + cost,
+                                                  memory_order_relaxed, memory_order_relaxed))
+    {
+        continue;
+    }
+    return wait_for(old, now);
+}
+
+/* Give back cost to the shared bucket *tat, never below 0. */
+static void uncharge(_Atomic uint64_t *tat, uint64_t cost) {
+    uint64_t old = atomic_load_explicit(tat, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(tat, &old, old > cost ? old - cost : 0,
+                                                  memory_order_relaxed, memory_order_relaxed))
+    {
+        continue;
+    }
+}
+
+/*
+ * Sleep until deadline unless sock is shut down first. Polling sock for no
+ * events still reports POLLHUP, which ABOR's shutdown(2) raises.
+ */
+static void sleep_until(uint64_t deadline, int sock) {
+    struct pollfd pfd = {.fd=sock, .events=0};
+    uint64_t now;
+    while ((now=monotonic_ns()) < deadline) {
+        struct timespec ts = {.tv_sec=(deadline - now) / NS, .tv_nsec=(deadline - now) % NS};
+        int ret = ppoll(&pfd, sock >= 0 ? 1 : 0, &ts, NULL);
+        if (ret > 0 || (ret == -1 && errno != EINTR)) {
+            return;
+        }
+    }
+}
+
+/* Reserve up to want bytes in every bucket and wait until they may be moved. */
+size_t shaper_take(struct shaper *sh, size_t want, int sock) {
+    if (!shaper_active(sh)) {
+        return want;
+    }
+    const size_t n = want < chunk_size ? want : chunk_size;
+    const uint64_t now = monotonic_ns();
+    uint64_t delay = 0, d;
+    if (session_rate != 0) {
+        d = wait_for(sh->tat, now);
+        sh->tat = (sh->tat > now ? sh->tat : now) + cost_of(n, session_rate);
+        delay = d > delay ? d : delay;
+    }
+    if (users) {
+        /* The slot is only taken over once idle, so the transfer likely still owns it */
+        if (sh->user_slot != -1 &&
+            atomic_load_explicit(&users[sh->user_slot].key, memory_order_acquire) != sh->user_key)
+        {
+            sh->user_slot = find_user(sh->user_key);
+        }
+        if (sh->user_slot != -1) {
+            d = charge(&users[sh->user_slot].tat, cost_of(n, user_rate), now);
+            delay = d > delay ? d : delay;
+        }
+    }
+    if (global_tat) {
+        d = charge(global_tat, cost_of(n, global_rate), now);
+        delay = d > delay ? d : delay;
+    }
+    if (delay != 0) {
+        sleep_until(now + delay, sock);
+    }
+    return n;
+}
+
+/* Give back bytes reserved but not moved. */
+void shaper_refund(struct shaper *sh, size_t unused) {
+    if (!shaper_active(sh) || unused == 0) {
+        return;
+    }
+    if (session_rate != 0) {
+        sh->tat -= cost_of(unused, session_rate);
+    }
+    if (users && sh->user_slot != -1 &&
+        atomic_load_explicit(&users[sh->user_slot].key, memory_order_acquire) == sh->user_key)
+    {
+        uncharge(&users[sh->user_slot].tat, cost_of(unused, user_rate));
+    }
+    if (global_tat) {
+        uncharge(global_tat, cost_of(unused, global_rate));
+    }
+}
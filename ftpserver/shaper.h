@@ -0,0 +1,46 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * shaper.h
+ *
+ * Header for shaper.c
+ */
+
+#ifndef FTPS_SHAPER_H
+#define FTPS_SHAPER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Bandwidth limits applied to the file transfers of one session. */
+struct shaper {
+    uint64_t tat;       /* When the session's bucket is paid off, in nanoseconds */
+    uint64_t user_key;  /* Hash of the user's name under user_rate or 0 */
+    int user_slot;      /* Slot of the user's bucket in the shared table or -1 */
+    bool active;        /* True if any limit applies */
+};
+
+/*
+ * Map the user and global buckets into memory shared with every process
+ * forked afterwards. Does nothing if no bandwidth limit is set in the config
+ * file. Must be called before forking.
+ */
+void shaper_init(void);
+/*
+ * Set up sh for a transfer by the session logged in as uname. Must be called
+ * before the transfer starts, not while it runs.
+ */
+void shaper_begin(struct shaper *sh, const char *uname);
+/* Return true if sh limits the transfer, false if sh is NULL or unlimited. */
+bool shaper_active(const struct shaper *sh);
+/*
+ * Reserve up to want bytes of the transfer's bandwidth, sleeping until they
+ * may be moved, and return how many were reserved. The sleep ends early if
+ * sock is shut down. Returns want at once if sh is not active.
+ */
+size_t shaper_take(struct shaper *sh, size_t want, int sock);
+/* Give back unused bytes reserved by shaper_take() but not moved. */
+void shaper_refund(struct shaper *sh, size_t unused);
+
+#endif /* FTPS_SHAPER_H */
@@ -0,0 +1,419 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * transfer.c
+ *
+ * This module moves file data over the data connection using the I/O engine
+ * selected in the configuration file. In MODE Z the data is compressed with
+ * zlib instead, a large block at a time. Transfers limited by a shaper reserve
+ * each chunk from it before moving it, after compression in MODE Z.
+ */
+
+#define _GNU_SOURCE  /* splice(2), pipe2(2) and F_SETPIPE_SZ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "log.h"
+#include "cfgparse.h"
+#include "uring.h"
+#include "shaper.h"
+#include "transfer.h"
+
+/* Most bytes moved by a single sendfile(2) call. */
+#define SENDFILE_CHUNK (1U << 20)
+/* Capacity requested for the pipe used with splice(2). */
+#define SPLICE_PIPE_SIZE (1U << 20)
+/* Size of the input and output blocks passed to zlib in MODE Z. */
+#define DEFLATE_CHUNK (256U << 10)
+
+/* Wait until sock is ready for events. Returns -1 on error. */
+static int wait_for_sock(int sock, short events) {
+    struct pollfd pfd = {.fd=sock, .events=events};
+    int ret;
+    while ((ret=poll(&pfd, 1, -1)) == -1 && errno == EINTR) {
+        continue;
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+/* Copy the file open on fd to sockdtp one buffer at a time. */
+static int send_file_blocking(int conn_id, int fd, int sockdtp, struct shaper *sh,
+                              uint64_t *nbytes) {
+    uint8_t buf[BUFSIZ];
+    ssize_t nread;
+    while ((nread=read(fd, buf, sizeof buf)) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            logerr("Conn %d: failed to read file (read: %s)", conn_id, strerror(errno));
+            return -1;
+        }
+        for (ssize_t sent = 0, n; sent < nread; sent += n) {
+            size_t want = shaper_take(sh, nread - sent, sockdtp);
+            n = send(sockdtp, &buf[sent], want, 0);
+            shaper_refund(sh, want - (n == -1 ? 0 : n));
+            if (n == -1) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                logwarn("Conn %d: failed to send some data (send: %s)", conn_id, strerror(errno));
+                return -1;
+            }
+            __atomic_fetch_add(nbytes, n, __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+/* Copy everything received on sockdtp into fd one buffer at a time. */
+static int recv_file_blocking(int conn_id, int sockdtp, int fd, struct shaper *sh,
+                              uint64_t *nbytes) {
+    uint8_t buf[BUFSIZ];
+    ssize_t nread;
+    while (true) {
+        size_t want = shaper_take(sh, sizeof buf, sockdtp);
+        nread = recv(sockdtp, buf, want, 0);
+        shaper_refund(sh, want - (nread == -1 ? 0 : nread));
+        if (nread == 0) {
+            break;
+        } else if (nread < 0) {
+            if (errno == EINTR) continue;
+            logerr("Conn %d: error receiving data (recv: %s)", conn_id, strerror(errno));
+            return -1;
+        }
+        for (ssize_t written = 0, n; written < nread; written += n) {
+            if ((n=write(fd, &buf[written], nread - written)) == -1) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                logerr("Conn %d: failed to save some data to file (write: %s)",
+                       conn_id, strerror(errno));
+                return -1;
+            }
+            __atomic_fetch_add(nbytes, n, __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copy the file open on fd to sockdtp with sendfile(2) so the data never
+ * leaves the kernel. Returns 1 if nothing was sent because sendfile(2) cannot
+ * be used with fd, otherwise 0 on success or -1 on error.
+ */
+static int send_file_zerocopy(int conn_id, int fd, int sockdtp, struct shaper *sh,
+                              uint64_t *nbytes) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (off == -1) {
+        return 1;
+    }
+    while (true) {
+        size_t want = shaper_take(sh, SENDFILE_CHUNK, sockdtp);
+        ssize_t sent = sendfile(sockdtp, fd, &off, want);
+        shaper_refund(sh, want - (sent == -1 ? 0 : sent));
+        if (sent > 0) {
+            __atomic_fetch_add(nbytes, sent, __ATOMIC_RELAXED);
+        } else if (sent == 0) {
+            return 0;  /* End of file */
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (wait_for_sock(sockdtp, POLLOUT) == -1) {
+                logwarn("Conn %d: failed to wait for data connection (poll: %s)",
+                        conn_id, strerror(errno));
+                return -1;
+            }
+        } else if ((errno == EINVAL || errno == ENOSYS) && *nbytes == 0) {
+            return 1;  /* Not supported for this file; fd offset is unchanged */
+        } else if (errno != EINTR) {
+            logwarn("Conn %d: failed to send some data (sendfile: %s)", conn_id, strerror(errno));
+            return -1;
+        }
+    }
+}
+
+/*
+ * Copy everything received on sockdtp into fd with splice(2) through a pipe
+ * so the data never leaves the kernel. Returns 1 if nothing was received
+ * because splice(2) cannot be used with fd or sockdtp, otherwise 0 on success
+ * or -1 on error.
+ */
+static int recv_file_zerocopy(int conn_id, int sockdtp, int fd, struct shaper *sh,
+                              uint64_t *nbytes) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        logwarn("Conn %d: failed to create pipe (pipe2: %s)", conn_id, strerror(errno));
+        return 1;
+    }
+    /* A larger pipe moves more data per splice; the default size is fine too */
+    int pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (pipe_size == -1) {
+        pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+    }
+
+    int ret = 0;
+    while (true) {
+        size_t want = shaper_take(sh, pipe_size, sockdtp);
+        ssize_t nread = splice(sockdtp, NULL, pipefd[1], NULL, want,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+        shaper_refund(sh, want - (nread == -1 ? 0 : nread));
+        if (nread == 0) {
+            break;  /* Client closed the data connection */
+        } else if (nread < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (wait_for_sock(sockdtp, POLLIN) == 0) continue;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EINVAL && *nbytes == 0) {
+                ret = 1;  /* Not supported; nothing has been consumed */
+                break;
+            }
+            logerr("Conn %d: error receiving data (splice: %s)", conn_id, strerror(errno));
+            ret = -1;
+            break;
+        }
+        /* Drain the pipe into the file */
+        while (nread > 0) {
+            ssize_t written = splice(pipefd[0], NULL, fd, NULL, nread, SPLICE_F_MOVE);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                logerr("Conn %d: failed to save some data to file (splice: %s)",
+                       conn_id, strerror(errno));
+                ret = -1;
+                goto done;
+            }
+            nread -= written;
+            __atomic_fetch_add(nbytes, written, __ATOMIC_RELAXED);
+        }
+    }
+
+    done:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ret;
+}
+
+/*
+ * Copy the file open on fd to the data connection sockdtp. A limited transfer
+ * uses ZEROCOPY instead of URING, whose batches cannot be paced.
+ */
+int send_file(int conn_id, int fd, int sockdtp, struct shaper *sh, uint64_t *nbytes) {
+    int ret = 1;
+    if (ftps_config.io_engine == IO_ENGINE_URING && !shaper_active(sh)) {
+        ret = uring_send_file(conn_id, fd, sockdtp, nbytes);
+    } else if (ftps_config.io_engine != IO_ENGINE_BLOCKING) {
+        ret = send_file_zerocopy(conn_id, fd, sockdtp, sh, nbytes);
+    }
+    if (ret != 1) {
+        return ret;
+    }
+    return send_file_blocking(conn_id, fd, sockdtp, sh, nbytes);
+}
+
+/* Copy everything received on the data connection sockdtp into fd, like send_file(). */
+int recv_file(int conn_id, int sockdtp, int fd, struct shaper *sh, uint64_t *nbytes) {
+    int ret = 1;
+    if (ftps_config.io_engine == IO_ENGINE_URING && !shaper_active(sh)) {
+        ret = uring_recv_file(conn_id, sockdtp, fd, nbytes);
+    } else if (ftps_config.io_engine != IO_ENGINE_BLOCKING) {
+        ret = recv_file_zerocopy(conn_id, sockdtp, fd, sh, nbytes);
+    }
+    if (ret != 1) {
+        return ret;
+    }
+    return recv_file_blocking(conn_id, sockdtp, fd, sh, nbytes);
+}
+
+/* Send len bytes of buf on sockdtp as fast as sh allows. Returns -1 on error. */
+static int send_all(int conn_id, int sockdtp, const uint8_t *buf, size_t len,
+                    struct shaper *sh) {
+    for (size_t sent = 0; sent < len;) {
+        size_t want = shaper_take(sh, len - sent, sockdtp);
+        ssize_t n = send(sockdtp, &buf[sent], want, 0);
+        shaper_refund(sh, want - (n == -1 ? 0 : n));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            logwarn("Conn %d: failed to send some data (send: %s)", conn_id, strerror(errno));
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+/* Write len bytes of buf to fd. Returns -1 on error. */
+static int write_all(int conn_id, int fd, const uint8_t *buf, size_t len) {
+    for (size_t written = 0; written < len;) {
+        ssize_t n = write(fd, &buf[written], len - written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            logerr("Conn %d: failed to save some data to file (write: %s)",
+                   conn_id, strerror(errno));
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+/*
+ * Compress len bytes of in with strm and send whatever output is ready on
+ * sockdtp as fast as sh allows, using out (DEFLATE_CHUNK bytes) as scratch.
+ * flush is passed on to deflate(3); Z_FINISH ends the stream. Returns -1 on
+ * error.
+ */
+static int deflate_send(int conn_id, z_stream *strm, const uint8_t *in, size_t len,
+                        int flush, uint8_t *out, int sockdtp, struct shaper *sh) {
+    strm->next_in = (Bytef *)in;
+    strm->avail_in = len;
+    do {
+        strm->next_out = out;
+        strm->avail_out = DEFLATE_CHUNK;
+        if (deflate(strm, flush) == Z_STREAM_ERROR) {
+            logerr("Conn %d: failed to compress data (deflate: %s)", conn_id, strm->msg);
+            return -1;
+        }
+        if (send_all(conn_id, sockdtp, out, DEFLATE_CHUNK - strm->avail_out, sh) == -1) {
+            return -1;
+        }
+    } while (strm->avail_out == 0);
+    return 0;
+}
+
+/* Send len bytes of buf on sockdtp. */
+int send_buf(int conn_id, const void *buf, size_t len, int sockdtp, uint64_t *nbytes) {
+    if (send_all(conn_id, sockdtp, buf, len, NULL) == -1) {
+        return -1;
+    }
+    __atomic_fetch_add(nbytes, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Compress len bytes of buf at level and send them on sockdtp as a whole stream. */
+int send_buf_deflate(int conn_id, const void *buf, size_t len, int sockdtp, int level,
+                     uint64_t *nbytes) {
+    z_stream strm = {0};
+    uint8_t *out = malloc(DEFLATE_CHUNK);
+    if (!out || deflateInit(&strm, level) != Z_OK) {
+        logerr("Conn %d: failed to set up compression", conn_id);
+        free(out);
+        return -1;
+    }
+    int ret = deflate_send(conn_id, &strm, buf, len, Z_FINISH, out, sockdtp, NULL);
+    if (ret == 0) {
+        __atomic_fetch_add(nbytes, len, __ATOMIC_RELAXED);
+    }
+    deflateEnd(&strm);
+    free(out);
+    return ret;
+}
+
+/* Compress the file open on fd at level and send it on sockdtp. */
+int send_file_deflate(int conn_id, int fd, int sockdtp, int level, struct shaper *sh,
+                      uint64_t *nbytes) {
+    z_stream strm = {0};
+    uint8_t *in = malloc(DEFLATE_CHUNK);
+    uint8_t *out = malloc(DEFLATE_CHUNK);
+    if (!in || !out || deflateInit(&strm, level) != Z_OK) {
+        logerr("Conn %d: failed to set up compression", conn_id);
+        free(in);
+        free(out);
+        return -1;
+    }
+    int ret = 0;
+    ssize_t nread;
+    do {
+        if ((nread=read(fd, in, DEFLATE_CHUNK)) == -1) {
+            if (errno == EINTR) continue;
+            logerr("Conn %d: failed to read file (read: %s)", conn_id, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (deflate_send(conn_id, &strm, in, nread, nread == 0 ? Z_FINISH : Z_NO_FLUSH,
+                         out, sockdtp, sh) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        __atomic_fetch_add(nbytes, nread, __ATOMIC_RELAXED);
+    } while (nread != 0);
+    deflateEnd(&strm);
+    free(in);
+    free(out);
+    return ret;
+}
+
+/* Decompress the stream received on sockdtp into fd. */
+int recv_file_inflate(int conn_id, int sockdtp, int fd, struct shaper *sh, uint64_t *nbytes) {
+    z_stream strm = {0};
+    uint8_t *in = malloc(DEFLATE_CHUNK);
+    uint8_t *out = malloc(DEFLATE_CHUNK);
+    if (!in || !out || inflateInit(&strm) != Z_OK) {
+        logerr("Conn %d: failed to set up decompression", conn_id);
+        free(in);
+        free(out);
+        return -1;
+    }
+    int ret = 0;
+    int zret = Z_OK;
+    while (zret != Z_STREAM_END) {
+        size_t want = shaper_take(sh, DEFLATE_CHUNK, sockdtp);
+        ssize_t nread = recv(sockdtp, in, want, 0);
+        shaper_refund(sh, want - (nread == -1 ? 0 : nread));
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            logerr("Conn %d: error receiving data (recv: %s)", conn_id, strerror(errno));
+            ret = -1;
+            break;
+        } else if (nread == 0) {
+            logwarn("Conn %d: compressed data ended early", conn_id);
+            ret = -1;
+            break;
+        }
+        strm.next_in = in;
+        strm.avail_in = nread;
+        do {
+            strm.next_out = out;
+            strm.avail_out = DEFLATE_CHUNK;
+            zret = inflate(&strm, Z_NO_FLUSH);
+            if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+                logwarn("Conn %d: received corrupt compressed data (inflate: %s)",
+                        conn_id, strm.msg ? strm.msg : "unknown error");
+                ret = -1;
+                goto done;
+            }
+            size_t len = DEFLATE_CHUNK - strm.avail_out;
+            if (write_all(conn_id, fd, out, len) == -1) {
+                ret = -1;
+                goto done;
+            }
+            __atomic_fetch_add(nbytes, len, __ATOMIC_RELAXED);
+        } while (strm.avail_out == 0 && zret != Z_STREAM_END);
+    }
+
+    done:
+    inflateEnd(&strm);
+    free(in);
+    free(out);
+    return ret;
+}
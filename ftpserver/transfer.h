@@ -0,0 +1,57 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * transfer.h
+ *
+ * Header for transfer.c
+ */
+
+#ifndef FTPS_TRANSFER_H
+#define FTPS_TRANSFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "shaper.h"
+
+/*
+ * Copy the file open on fd, starting at its current offset, to the data
+ * connection sockdtp, no faster than the shaper sh allows unless it is NULL.
+ * The number of bytes sent is added to nbytes as data moves, so other threads
+ * may follow progress with an atomic load. Returns 0 on success or -1 on
+ * error.
+ */
+int send_file(int conn_id, int fd, int sockdtp, struct shaper *sh, uint64_t *nbytes);
+/*
+ * Copy everything received on the data connection sockdtp into the file open
+ * on fd, starting at its current offset. The shaper sh and nbytes are used
+ * like in send_file(). Returns 0 on success or -1 on error.
+ */
+int recv_file(int conn_id, int sockdtp, int fd, struct shaper *sh, uint64_t *nbytes);
+/*
+ * Like send_file() but compresses the data as a single deflate stream at the
+ * given zlib level for MODE Z. sh limits the compressed bytes sent and nbytes
+ * counts bytes read from the file.
+ */
+int send_file_deflate(int conn_id, int fd, int sockdtp, int level, struct shaper *sh,
+                      uint64_t *nbytes);
+/*
+ * Like recv_file() but decompresses a deflate stream received in MODE Z.
+ * sh limits the compressed bytes received and nbytes counts bytes saved to the
+ * file.
+ */
+int recv_file_inflate(int conn_id, int sockdtp, int fd, struct shaper *sh, uint64_t *nbytes);
+/*
+ * Send len bytes of buf on sockdtp and add them to nbytes. Returns 0 on success
+ * or -1 on error.
+ */
+int send_buf(int conn_id, const void *buf, size_t len, int sockdtp, uint64_t *nbytes);
+/*
+ * Compress len bytes of buf as a single deflate stream at the given zlib level
+ * and send it on sockdtp. nbytes counts bytes of buf. Returns 0 on success or
+ * -1 on error.
+ */
+int send_buf_deflate(int conn_id, const void *buf, size_t len, int sockdtp, int level,
+                     uint64_t *nbytes);
+
+#endif /* FTPS_TRANSFER_H */
@@ -0,0 +1,414 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * uring.c
+ *
+ * This module implements file transfers on the data connection with
+ * io_uring(7). Every transfer borrows a ring with a small set of registered
+ * buffers from a per-process pool, so transfers running on different threads
+ * never share a ring. File reads and writes are issued at explicit offsets so
+ * several can be in flight at once, while socket reads and writes are issued
+ * one at a time to preserve stream order. Every io_uring_enter(2) call submits all
+ * queued requests and reaps completions in one system call.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+#include "log.h"
+#include "uring.h"
+
+#define URING_NBUFS (4U)                /* Number of registered buffers */
+#define URING_BUFSIZ (256U * 1024U)     /* Size of each registered buffer */
+#define URING_ENTRIES (2U * URING_NBUFS)
+
+/* State of an io_uring instance. */
+struct ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_pending;  /* Requests queued since the last io_uring_enter(2) */
+    uint8_t *bufs;        /* URING_NBUFS registered buffers of URING_BUFSIZ bytes */
+    void *rings;          /* Mapping holding both ring buffers */
+    size_t rings_len, sqes_len;
+    bool broken;          /* True if requests may be left in flight after an error */
+    struct ring *next;    /* Next idle ring in the pool */
+};
+
+/* Rings not currently used by a transfer. */
+static struct ring *idle_rings;
+/* True once setting up a ring has failed; io_uring is not used again. */
+static bool rings_disabled;
+/* Guards idle_rings and rings_disabled. */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A registered buffer and the request it is used for. */
+struct slot {
+    enum {
+        SLOT_FREE,
+        SLOT_READING,  /* Waiting for a read into the buffer */
+        SLOT_READY,    /* Holds data that has not been written yet */
+        SLOT_WRITING,  /* Waiting for a write out of the buffer */
+    } state;
+    uint64_t seq;   /* Position of the data in the stream */
+    uint64_t off;   /* File offset of the data */
+    uint32_t len;   /* Number of bytes held */
+    uint32_t done;  /* Number of bytes already written */
+};
+
+/* Set up ring and register its buffers. Returns 0 on success. */
+static int ring_setup(struct ring *ring) {
+    int err;
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t rings_len = sq_len > cq_len ? sq_len : cq_len;
+    uint8_t *rings = mmap(NULL, rings_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof *sqes,
+                                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(rings, rings_len);
+        close(fd);
+        return -1;
+    }
+    uint8_t *bufs = mmap(NULL, URING_NBUFS * URING_BUFSIZ, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED) {
+        goto err;
+    }
+    struct iovec iov[URING_NBUFS];
+    for (unsigned i = 0; i < URING_NBUFS; i++) {
+        iov[i].iov_base = &bufs[i * URING_BUFSIZ];
+        iov[i].iov_len = URING_BUFSIZ;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_NBUFS) < 0) {
+        munmap(bufs, URING_NBUFS * URING_BUFSIZ);
+        goto err;
+    }
+
+    ring->fd = fd;
+    ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(rings + params.sq_off.array);
+    ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    ring->sqes = sqes;
+    ring->bufs = bufs;
+    ring->rings = rings;
+    ring->rings_len = rings_len;
+    ring->sqes_len = params.sq_entries * sizeof *sqes;
+    ring->sq_pending = 0;
+    ring->broken = false;
+    return 0;
+
+    err:
+    err = errno;
+    munmap(sqes, params.sq_entries * sizeof *sqes);
+    munmap(rings, rings_len);
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+/* Tear down ring and free it. Closing the ring cancels any pending requests. */
+static void ring_free(struct ring *ring) {
+    close(ring->fd);
+    munmap(ring->bufs, URING_NBUFS * URING_BUFSIZ);
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->rings, ring->rings_len);
+    free(ring);
+}
+
+/*
+ * Take an idle ring from the pool or set up a new one. Returns NULL if
+ * io_uring cannot be used by this process.
+ */
+static struct ring *ring_acquire(void) {
+    pthread_mutex_lock(&rings_lock);
+    struct ring *ring = idle_rings;
+    if (ring) {
+        idle_rings = ring->next;
+    } else if (!rings_disabled) {
+        ring = malloc(sizeof *ring);
+        if (!ring || ring_setup(ring) == -1) {
+            logwarn("Main: io_uring unavailable; using blocking I/O (%s)", strerror(errno));
+            rings_disabled = true;
+            free(ring);
+            ring = NULL;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    return ring;
+}
+
+/* Return ring to the pool for use by a later transfer. */
+static void ring_release(struct ring *ring) {
+    if (ring->broken) {
+        ring_free(ring);
+        return;
+    }
+    pthread_mutex_lock(&rings_lock);
+    ring->next = idle_rings;
+    idle_rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+/*
+ * Queue a read or write of len bytes between the file fd at off and
+ * registered buffer i of ring starting at pos.
+ */
+static void ring_prep(struct ring *ring, uint8_t opcode, int fd, unsigned i,
+                      uint32_t pos, uint32_t len, uint64_t off) {
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->addr = (uintptr_t)&ring->bufs[i * URING_BUFSIZ + pos];
+    sqe->len = len;
+    sqe->buf_index = i;
+    sqe->user_data = i;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+}
+
+/* Submit every request queued on ring and wait for at least one completion. */
+static int ring_submit_and_wait(struct ring *ring) {
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        ring->broken = true;
+        return -1;
+    }
+    ring->sq_pending -= ret;
+    return 0;
+}
+
+/* Pop the next completion of ring into cqe. Returns false if there are none. */
+static bool ring_pop_cqe(struct ring *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Copy the file open on fd to sockdtp using ring. */
+static int ring_send_file(struct ring *ring, int conn_id, int fd, int sockdtp, uint64_t *nbytes) {
+    struct slot slots[URING_NBUFS] = {0};
+    off_t start = lseek(fd, 0, SEEK_CUR);  /* Set by REST */
+    uint64_t next_off = start == -1 ? 0 : start;
+    uint64_t next_seq = 0, send_seq = 0, eof_seq = UINT64_MAX;
+    unsigned inflight = 0;
+    bool sending = false, failed = false;
+    while (true) {
+        if (!failed) {
+            /* Read ahead into every free buffer until the end of file is seen */
+            for (unsigned i = 0; i < URING_NBUFS && eof_seq == UINT64_MAX; i++) {
+                if (slots[i].state == SLOT_FREE) {
+                    slots[i] = (struct slot){.state=SLOT_READING, .seq=next_seq++, .off=next_off};
+                    next_off += URING_BUFSIZ;
+                    ring_prep(ring, IORING_OP_READ_FIXED, fd, i, 0, URING_BUFSIZ, slots[i].off);
+                    inflight++;
+                }
+            }
+            /* Send the next buffer in stream order */
+            for (unsigned i = 0; i < URING_NBUFS && !sending; i++) {
+                if (slots[i].state == SLOT_READY && slots[i].seq == send_seq) {
+                    slots[i].state = SLOT_WRITING;
+                    ring_prep(ring, IORING_OP_WRITE_FIXED, sockdtp, i, 0, slots[i].len, (uint64_t)-1);
+                    sending = true;
+                    inflight++;
+                }
+            }
+        }
+        if (inflight == 0) {
+            break;
+        }
+        if (ring_submit_and_wait(ring) == -1) {
+            logerr("Conn %d: failed to submit I/O (io_uring_enter: %s)", conn_id, strerror(errno));
+            return -1;
+        }
+
+        struct io_uring_cqe cqe;
+        while (ring_pop_cqe(ring, &cqe)) {
+            unsigned i = cqe.user_data;
+            struct slot *slot = &slots[i];
+            inflight--;
+            if (slot->state == SLOT_READING) {
+                if (cqe.res < 0) {
+                    logerr("Conn %d: failed to read file (read: %s)", conn_id, strerror(-cqe.res));
+                    failed = true;
+                    slot->state = SLOT_FREE;
+                } else if (cqe.res == 0) {
+                    /* End of file; the buffer may still hold the last bytes */
+                    uint64_t seq = slot->len ? slot->seq + 1 : slot->seq;
+                    eof_seq = seq < eof_seq ? seq : eof_seq;
+                    slot->state = slot->len ? SLOT_READY : SLOT_FREE;
+                } else if ((slot->len += cqe.res) < URING_BUFSIZ) {
+                    /* Short read; fill the rest of the buffer */
+                    ring_prep(ring, IORING_OP_READ_FIXED, fd, i, slot->len,
+                              URING_BUFSIZ - slot->len, slot->off + slot->len);
+                    inflight++;
+                } else {
+                    slot->state = SLOT_READY;
+                }
+            } else {
+                sending = false;
+                if (cqe.res < 0) {
+                    logwarn("Conn %d: failed to send some data (send: %s)",
+                            conn_id, strerror(-cqe.res));
+                    failed = true;
+                    slot->state = SLOT_FREE;
+                    continue;
+                }
+                __atomic_fetch_add(nbytes, cqe.res, __ATOMIC_RELAXED);
+                slot->done += cqe.res;
+                if (slot->done < slot->len) {
+                    /* Short send; send the rest of the buffer */
+                    ring_prep(ring, IORING_OP_WRITE_FIXED, sockdtp, i, slot->done,
+                              slot->len - slot->done, (uint64_t)-1);
+                    sending = true;
+                    inflight++;
+                } else {
+                    slot->state = SLOT_FREE;
+                    send_seq++;
+                }
+            }
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/* Copy everything received on sockdtp into fd using ring. */
+static int ring_recv_file(struct ring *ring, int conn_id, int sockdtp, int fd, uint64_t *nbytes) {
+    struct slot slots[URING_NBUFS] = {0};
+    off_t start = lseek(fd, 0, SEEK_CUR);  /* Set by REST or APPE */
+    uint64_t next_off = start == -1 ? 0 : start;
+    unsigned inflight = 0;
+    bool receiving = false, eof = false, failed = false;
+    while (true) {
+        /* Receive into a free buffer while the writes of earlier ones complete */
+        for (unsigned i = 0; i < URING_NBUFS && !(failed || eof || receiving); i++) {
+            if (slots[i].state == SLOT_FREE) {
+                slots[i] = (struct slot){.state=SLOT_READING};
+                ring_prep(ring, IORING_OP_READ_FIXED, sockdtp, i, 0, URING_BUFSIZ, (uint64_t)-1);
+                receiving = true;
+                inflight++;
+            }
+        }
+        if (inflight == 0) {
+            break;
+        }
+        if (ring_submit_and_wait(ring) == -1) {
+            logerr("Conn %d: failed to submit I/O (io_uring_enter: %s)", conn_id, strerror(errno));
+            return -1;
+        }
+
+        struct io_uring_cqe cqe;
+        while (ring_pop_cqe(ring, &cqe)) {
+            unsigned i = cqe.user_data;
+            struct slot *slot = &slots[i];
+            inflight--;
+            if (slot->state == SLOT_READING) {
+                receiving = false;
+                if (cqe.res <= 0) {
+                    if (cqe.res < 0) {
+                        logerr("Conn %d: error receiving data (recv: %s)",
+                               conn_id, strerror(-cqe.res));
+                        failed = true;
+                    }
+                    eof = true;
+                    slot->state = SLOT_FREE;
+                } else if (!failed) {
+                    slot->state = SLOT_WRITING;
+                    slot->off = next_off;
+                    slot->len = cqe.res;
+                    next_off += cqe.res;
+                    ring_prep(ring, IORING_OP_WRITE_FIXED, fd, i, 0, slot->len, slot->off);
+                    inflight++;
+                } else {
+                    slot->state = SLOT_FREE;
+                }
+            } else {
+                if (cqe.res <= 0) {
+                    logerr("Conn %d: failed to save some data to file (write: %s)",
+                           conn_id, cqe.res ? strerror(-cqe.res) : "no space written");
+                    failed = true;
+                    slot->state = SLOT_FREE;
+                    continue;
+                }
+                __atomic_fetch_add(nbytes, cqe.res, __ATOMIC_RELAXED);
+                slot->done += cqe.res;
+                if (slot->done < slot->len) {
+                    ring_prep(ring, IORING_OP_WRITE_FIXED, fd, i, slot->done,
+                              slot->len - slot->done, slot->off + slot->done);
+                    inflight++;
+                } else {
+                    slot->state = SLOT_FREE;
+                }
+            }
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/* Copy the file open on fd to the data connection sockdtp. */
+int uring_send_file(int conn_id, int fd, int sockdtp, uint64_t *nbytes) {
+    struct ring *ring = ring_acquire();
+    if (!ring) {
+        return 1;
+    }
+    int ret = ring_send_file(ring, conn_id, fd, sockdtp, nbytes);
+    ring_release(ring);
+    return ret;
+}
+
+/* Copy everything received on the data connection sockdtp into fd. */
+int uring_recv_file(int conn_id, int sockdtp, int fd, uint64_t *nbytes) {
+    struct ring *ring = ring_acquire();
+    if (!ring) {
+        return 1;
+    }
+    int ret = ring_recv_file(ring, conn_id, sockdtp, fd, nbytes);
+    ring_release(ring);
+    return ret;
+}
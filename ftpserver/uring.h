@@ -0,0 +1,29 @@
+/*
+ * CS472 HW 4
+ * Jason R. Carrete
+ * uring.h
+ *
+ * Header for uring.c
+ */
+
+#ifndef FTPS_URING_H
+#define FTPS_URING_H
+
+#include <stdint.h>
+
+/*
+ * Copy the file open on fd to the data connection sockdtp. The number of bytes
+ * written to sockdtp is added to nbytes as data is sent. Returns 0 on success,
+ * -1 on error or 1 if io_uring cannot be used by this process, in which case
+ * nothing was sent.
+ */
+int uring_send_file(int conn_id, int fd, int sockdtp, uint64_t *nbytes);
+/*
+ * Copy everything received on the data connection sockdtp into the file open
+ * on fd. The number of bytes written to fd is added to nbytes as data is
+ * saved. Returns 0 on success, -1 on error or 1 if io_uring cannot be used by
+ * this process, in which case nothing was received.
+ */
+int uring_recv_file(int conn_id, int sockdtp, int fd, uint64_t *nbytes);
+
+#endif /* FTPS_URING_H */